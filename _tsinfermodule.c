@@ -22,6 +22,8 @@ static PyObject *TsinfLibraryError;
 typedef struct {
     PyObject_HEAD
     ancestor_builder_t *builder;
+    /* References to the packed genotype arrays used by the builder */
+    PyObject *packed_genotypes;
 } AncestorBuilder;
 
 typedef struct {
@@ -80,6 +82,7 @@ AncestorBuilder_dealloc(AncestorBuilder* self)
         PyMem_Free(self->builder);
         self->builder = NULL;
     }
+    Py_XDECREF(self->packed_genotypes);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -93,10 +96,15 @@ AncestorBuilder_init(AncestorBuilder *self, PyObject *args, PyObject *kwds)
     int flags = 0;
 
     self->builder = NULL;
+    self->packed_genotypes = NULL;
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii", kwlist,
                 &num_samples, &max_sites)) {
         goto out;
     }
+    self->packed_genotypes = PyList_New(0);
+    if (self->packed_genotypes == NULL) {
+        goto out;
+    }
     self->builder = PyMem_Malloc(sizeof(ancestor_builder_t));
     if (self->builder == NULL) {
         PyErr_NoMemory();
@@ -160,6 +168,183 @@ out:
     return ret;
 }
 
+static PyObject *
+AncestorBuilder_add_sites(AncestorBuilder *self, PyObject *args, PyObject *kwds)
+{
+    int err;
+    static char *kwlist[] = {"time", "genotypes", "use_site", NULL};
+    PyObject *ret = NULL;
+    PyObject *time = NULL;
+    PyObject *genotypes = NULL;
+    PyObject *use_site = NULL;
+    PyArrayObject *time_array = NULL;
+    PyArrayObject *genotypes_array = NULL;
+    PyArrayObject *use_site_array = NULL;
+    npy_intp *shape;
+    size_t num_sites;
+
+    if (AncestorBuilder_check_state(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO", kwlist,
+            &time, &genotypes, &use_site)) {
+        goto out;
+    }
+    genotypes_array = (PyArrayObject *) PyArray_FROM_OTF(genotypes, NPY_INT8,
+            NPY_ARRAY_IN_ARRAY);
+    if (genotypes_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(genotypes_array) != 2) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 2");
+        goto out;
+    }
+    shape = PyArray_DIMS(genotypes_array);
+    num_sites = shape[0];
+    if (shape[1] != self->builder->num_samples) {
+        PyErr_SetString(PyExc_ValueError, "genotypes array wrong size.");
+        goto out;
+    }
+    time_array = (PyArrayObject *) PyArray_FROM_OTF(time, NPY_FLOAT64,
+            NPY_ARRAY_IN_ARRAY);
+    if (time_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(time_array) != 1) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 1");
+        goto out;
+    }
+    shape = PyArray_DIMS(time_array);
+    if (shape[0] != num_sites) {
+        PyErr_SetString(PyExc_ValueError, "time array wrong size.");
+        goto out;
+    }
+    /* We return a copy of use_site updated to show the sites that were added */
+    use_site_array = (PyArrayObject *) PyArray_FROM_OTF(use_site, NPY_BOOL,
+            NPY_ARRAY_IN_ARRAY|NPY_ARRAY_ENSURECOPY);
+    if (use_site_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(use_site_array) != 1) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 1");
+        goto out;
+    }
+    shape = PyArray_DIMS(use_site_array);
+    if (shape[0] != num_sites) {
+        PyErr_SetString(PyExc_ValueError, "use_site array wrong size.");
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = ancestor_builder_add_sites(self->builder, num_sites,
+            (double *) PyArray_DATA(time_array),
+            (allele_t *) PyArray_DATA(genotypes_array),
+            (bool *) PyArray_DATA(use_site_array));
+    Py_END_ALLOW_THREADS
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = (PyObject *) use_site_array;
+    use_site_array = NULL;
+out:
+    Py_XDECREF(time_array);
+    Py_XDECREF(genotypes_array);
+    Py_XDECREF(use_site_array);
+    return ret;
+}
+
+static PyObject *
+AncestorBuilder_add_packed_sites(AncestorBuilder *self, PyObject *args, PyObject *kwds)
+{
+    int err;
+    static char *kwlist[] = {"time", "genotypes", "use_site", NULL};
+    PyObject *ret = NULL;
+    PyObject *time = NULL;
+    PyObject *genotypes = NULL;
+    PyObject *use_site = NULL;
+    PyArrayObject *time_array = NULL;
+    PyArrayObject *genotypes_array = NULL;
+    PyArrayObject *use_site_array = NULL;
+    npy_intp *shape;
+    size_t num_sites;
+
+    if (AncestorBuilder_check_state(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO", kwlist,
+            &time, &genotypes, &use_site)) {
+        goto out;
+    }
+    /* If the genotypes are a suitable array (e.g. a numpy memmap) we use the
+     * data in place, so no copy of the genotypes is made. */
+    genotypes_array = (PyArrayObject *) PyArray_FROM_OTF(genotypes, NPY_UINT64,
+            NPY_ARRAY_IN_ARRAY);
+    if (genotypes_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(genotypes_array) != 2) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 2");
+        goto out;
+    }
+    shape = PyArray_DIMS(genotypes_array);
+    num_sites = shape[0];
+    if (shape[1] != 2 * self->builder->num_words) {
+        PyErr_SetString(PyExc_ValueError, "genotypes array wrong size.");
+        goto out;
+    }
+    time_array = (PyArrayObject *) PyArray_FROM_OTF(time, NPY_FLOAT64,
+            NPY_ARRAY_IN_ARRAY);
+    if (time_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(time_array) != 1) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 1");
+        goto out;
+    }
+    shape = PyArray_DIMS(time_array);
+    if (shape[0] != num_sites) {
+        PyErr_SetString(PyExc_ValueError, "time array wrong size.");
+        goto out;
+    }
+    /* We return a copy of use_site updated to show the sites that were added */
+    use_site_array = (PyArrayObject *) PyArray_FROM_OTF(use_site, NPY_BOOL,
+            NPY_ARRAY_IN_ARRAY|NPY_ARRAY_ENSURECOPY);
+    if (use_site_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(use_site_array) != 1) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 1");
+        goto out;
+    }
+    shape = PyArray_DIMS(use_site_array);
+    if (shape[0] != num_sites) {
+        PyErr_SetString(PyExc_ValueError, "use_site array wrong size.");
+        goto out;
+    }
+    /* The builder refers to the genotypes directly, so we must keep a
+     * reference to the array for the lifetime of the builder. */
+    if (PyList_Append(self->packed_genotypes, (PyObject *) genotypes_array) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = ancestor_builder_add_packed_sites(self->builder, num_sites,
+            (double *) PyArray_DATA(time_array),
+            (const uint64_t *) PyArray_DATA(genotypes_array),
+            (bool *) PyArray_DATA(use_site_array));
+    Py_END_ALLOW_THREADS
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = (PyObject *) use_site_array;
+    use_site_array = NULL;
+out:
+    Py_XDECREF(time_array);
+    Py_XDECREF(genotypes_array);
+    Py_XDECREF(use_site_array);
+    return ret;
+}
+
 static PyObject *
 AncestorBuilder_make_ancestor(AncestorBuilder *self, PyObject *args, PyObject *kwds)
 {
@@ -228,6 +413,86 @@ out:
     return ret;
 }
 
+static PyObject *
+AncestorBuilder_make_ancestors(AncestorBuilder *self, PyObject *args, PyObject *kwds)
+{
+    int err;
+    PyObject *ret = NULL;
+    static char *kwlist[] = {"first", "last", "haplotypes", "start", "end", NULL};
+    Py_ssize_t first, last;
+    PyObject *haplotypes = NULL;
+    PyObject *start = NULL;
+    PyObject *end = NULL;
+    PyArrayObject *haplotypes_array = NULL;
+    PyArrayObject *start_array = NULL;
+    PyArrayObject *end_array = NULL;
+    size_t buffer_size, num_made;
+    npy_intp *shape;
+
+    if (AncestorBuilder_check_state(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "nnO!O!O!", kwlist,
+            &first, &last, &PyArray_Type, &haplotypes, &PyArray_Type, &start,
+            &PyArray_Type, &end)) {
+        goto out;
+    }
+    if (first < 0 || last < first || last > (Py_ssize_t) self->builder->num_ancestors) {
+        PyErr_SetString(PyExc_ValueError, "Bad ancestor range");
+        goto out;
+    }
+    haplotypes_array = (PyArrayObject *) PyArray_FROM_OTF(haplotypes, NPY_INT8,
+            NPY_ARRAY_INOUT_ARRAY);
+    if (haplotypes_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(haplotypes_array) != 1) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 1");
+        goto out;
+    }
+    shape = PyArray_DIMS(haplotypes_array);
+    buffer_size = shape[0];
+    if (buffer_size < self->builder->num_sites) {
+        PyErr_SetString(PyExc_ValueError, "haplotypes buffer must be >= num_sites");
+        goto out;
+    }
+    start_array = (PyArrayObject *) PyArray_FROM_OTF(start, NPY_INT32,
+            NPY_ARRAY_INOUT_ARRAY);
+    if (start_array == NULL) {
+        goto out;
+    }
+    end_array = (PyArrayObject *) PyArray_FROM_OTF(end, NPY_INT32,
+            NPY_ARRAY_INOUT_ARRAY);
+    if (end_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(start_array) != 1 || PyArray_NDIM(end_array) != 1) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 1");
+        goto out;
+    }
+    if (PyArray_DIMS(start_array)[0] < last - first
+            || PyArray_DIMS(end_array)[0] < last - first) {
+        PyErr_SetString(PyExc_ValueError, "start and end must be >= last - first");
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = ancestor_builder_make_ancestors(self->builder, (size_t) first,
+        (size_t) last, buffer_size, (allele_t *) PyArray_DATA(haplotypes_array),
+        (tsk_id_t *) PyArray_DATA(start_array), (tsk_id_t *) PyArray_DATA(end_array),
+        &num_made);
+    Py_END_ALLOW_THREADS
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = Py_BuildValue("n", (Py_ssize_t) num_made);
+out:
+    Py_XDECREF(haplotypes_array);
+    Py_XDECREF(start_array);
+    Py_XDECREF(end_array);
+    return ret;
+}
+
 static PyObject *
 AncestorBuilder_ancestor_descriptors(AncestorBuilder *self)
 {
@@ -345,9 +610,22 @@ static PyMethodDef AncestorBuilder_methods[] = {
     {"add_site", (PyCFunction) AncestorBuilder_add_site,
         METH_VARARGS|METH_KEYWORDS,
         "Adds the specified site to this ancestor builder."},
+    {"add_sites", (PyCFunction) AncestorBuilder_add_sites,
+        METH_VARARGS|METH_KEYWORDS,
+        "Adds the sites in the specified genotype matrix that are suitable for "
+        "inference, and returns a boolean array marking the sites added."},
+    {"add_packed_sites", (PyCFunction) AncestorBuilder_add_packed_sites,
+        METH_VARARGS|METH_KEYWORDS,
+        "Adds the sites in the specified bit-packed genotype matrix that are "
+        "suitable for inference without copying the genotypes, and returns a "
+        "boolean array marking the sites added."},
     {"make_ancestor", (PyCFunction) AncestorBuilder_make_ancestor,
         METH_VARARGS|METH_KEYWORDS,
         "Makes the specified ancestor."},
+    {"make_ancestors", (PyCFunction) AncestorBuilder_make_ancestors,
+        METH_VARARGS|METH_KEYWORDS,
+        "Makes the ancestors in the specified range of descriptors, packing "
+        "their haplotypes into the specified buffer."},
     {"ancestor_descriptors", (PyCFunction) AncestorBuilder_ancestor_descriptors,
         METH_NOARGS,
         "Returns a list of ancestor (frequency, focal_sites) tuples."},
@@ -425,20 +703,25 @@ TreeSequenceBuilder_init(TreeSequenceBuilder *self, PyObject *args, PyObject *kw
 {
     int ret = -1;
     int err;
-    static char *kwlist[] = {"num_alleles", "max_nodes", "max_edges", NULL};
+    static char *kwlist[] = {"num_alleles", "max_nodes", "max_edges",
+        "relabel_nodes", NULL};
     PyArrayObject *num_alleles = NULL;
     unsigned long max_nodes = 1024;
     unsigned long max_edges = 1024;
     unsigned long num_sites;
     npy_intp *shape;
+    int relabel_nodes = 0;
     int flags = 0;
 
     self->tree_sequence_builder = NULL;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|kk", kwlist,
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|kki", kwlist,
             uint32_PyArray_converter, &num_alleles,
-            &max_nodes, &max_edges)) {
+            &max_nodes, &max_edges, &relabel_nodes)) {
         goto out;
     }
+    if (relabel_nodes) {
+        flags |= TSI_RELABEL_NODES;
+    }
     shape = PyArray_DIMS(num_alleles);
     num_sites = shape[0];
 
@@ -1262,8 +1545,10 @@ AncestorMatcher_init(AncestorMatcher *self, PyObject *args, PyObject *kwds)
     int ret = -1;
     int err;
     int extended_checks = 0;
+    int checkpoint_traceback = 0;
     static char *kwlist[] = {"tree_sequence_builder", "recombination_rate",
-        "mismatch_rate", "precision", "extended_checks", NULL};
+        "mismatch_rate", "precision", "extended_checks", "max_memory",
+        "checkpoint_traceback", NULL};
     TreeSequenceBuilder *tree_sequence_builder = NULL;
     PyObject *recombination_rate = NULL;
     PyObject *mismatch_rate = NULL;
@@ -1271,14 +1556,20 @@ AncestorMatcher_init(AncestorMatcher *self, PyObject *args, PyObject *kwds)
     PyArrayObject *mismatch_rate_array = NULL;
     npy_intp *shape;
     unsigned int precision = 22;
+    Py_ssize_t max_memory = 0;
     int flags = 0;
 
     self->ancestor_matcher = NULL;
     self->tree_sequence_builder = NULL;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!OO|Ii", kwlist,
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!OO|Iini", kwlist,
                 &TreeSequenceBuilderType, &tree_sequence_builder,
                 &recombination_rate, &mismatch_rate, &precision,
-                &extended_checks)) {
+                &extended_checks, &max_memory,
+                &checkpoint_traceback)) {
+        goto out;
+    }
+    if (max_memory < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_memory must be >= 0");
         goto out;
     }
     self->tree_sequence_builder = tree_sequence_builder;
@@ -1319,11 +1610,14 @@ AncestorMatcher_init(AncestorMatcher *self, PyObject *args, PyObject *kwds)
     if (extended_checks) {
         flags = TSI_EXTENDED_CHECKS;
     }
+    if (checkpoint_traceback) {
+        flags |= TSI_CHECKPOINT_TRACEBACK;
+    }
     err = ancestor_matcher_alloc(self->ancestor_matcher,
             self->tree_sequence_builder->tree_sequence_builder,
             PyArray_DATA(recombination_rate_array),
             PyArray_DATA(mismatch_rate_array),
-            precision, flags);
+            precision, (size_t) max_memory, flags);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -1428,15 +1722,145 @@ out:
     return ret;
 }
 
+static PyObject *
+AncestorMatcher_find_paths(AncestorMatcher *self, PyObject *args, PyObject *kwds)
+{
+    int err;
+    PyObject *ret = NULL;
+    static char *kwlist[] = {"haplotypes", "start", "end", "match", NULL};
+    PyObject *haplotypes = NULL;
+    PyArrayObject *haplotypes_array = NULL;
+    PyObject *match = NULL;
+    PyArrayObject *match_array = NULL;
+    PyObject *list = NULL;
+    PyObject *path = NULL;
+    npy_intp *shape;
+    size_t j, num_haplotypes;
+    int start, end;
+    size_t *num_edges = NULL;
+    tsk_id_t **ret_left = NULL;
+    tsk_id_t **ret_right = NULL;
+    tsk_id_t **ret_parent = NULL;
+    PyArrayObject *left = NULL;
+    PyArrayObject *right = NULL;
+    PyArrayObject *parent = NULL;
+    npy_intp dims[1];
+
+    if (AncestorMatcher_check_state(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OiiO!", kwlist,
+                &haplotypes, &start, &end, &PyArray_Type, &match)) {
+        goto out;
+    }
+    haplotypes_array = (PyArrayObject *) PyArray_FROM_OTF(haplotypes, NPY_INT8,
+            NPY_ARRAY_IN_ARRAY);
+    if (haplotypes_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(haplotypes_array) != 2) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 2");
+        goto out;
+    }
+    shape = PyArray_DIMS(haplotypes_array);
+    if (shape[1] != self->ancestor_matcher->num_sites) {
+        PyErr_SetString(PyExc_ValueError, "Incorrect size for input haplotypes.");
+        goto out;
+    }
+    num_haplotypes = (size_t) shape[0];
+
+    match_array = (PyArrayObject *) PyArray_FROM_OTF(match, NPY_INT8,
+            NPY_ARRAY_INOUT_ARRAY);
+    if (match_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(match_array) != 2) {
+        PyErr_SetString(PyExc_ValueError, "Dim != 2");
+        goto out;
+    }
+    shape = PyArray_DIMS(match_array);
+    if (shape[0] != (npy_intp) num_haplotypes
+            || shape[1] != self->ancestor_matcher->num_sites) {
+        PyErr_SetString(PyExc_ValueError, "input match wrong size");
+        goto out;
+    }
+
+    num_edges = PyMem_Malloc((num_haplotypes + 1) * sizeof(*num_edges));
+    ret_left = PyMem_Malloc((num_haplotypes + 1) * sizeof(*ret_left));
+    ret_right = PyMem_Malloc((num_haplotypes + 1) * sizeof(*ret_right));
+    ret_parent = PyMem_Malloc((num_haplotypes + 1) * sizeof(*ret_parent));
+    if (num_edges == NULL || ret_left == NULL || ret_right == NULL
+            || ret_parent == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    err = ancestor_matcher_find_paths(self->ancestor_matcher, num_haplotypes,
+            (tsk_id_t) start, (tsk_id_t) end,
+            (allele_t *) PyArray_DATA(haplotypes_array),
+            (allele_t *) PyArray_DATA(match_array),
+            num_edges, ret_left, ret_right, ret_parent);
+    Py_END_ALLOW_THREADS
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    list = PyList_New((Py_ssize_t) num_haplotypes);
+    if (list == NULL) {
+        goto out;
+    }
+    for (j = 0; j < num_haplotypes; j++) {
+        dims[0] = (npy_intp) num_edges[j];
+        left = (PyArrayObject *) PyArray_SimpleNew(1, dims, NPY_UINT32);
+        right = (PyArrayObject *) PyArray_SimpleNew(1, dims, NPY_UINT32);
+        parent = (PyArrayObject *) PyArray_SimpleNew(1, dims, NPY_INT32);
+        if (left == NULL || right == NULL || parent == NULL) {
+            goto out;
+        }
+        memcpy(PyArray_DATA(left), ret_left[j], num_edges[j] * sizeof(tsk_id_t));
+        memcpy(PyArray_DATA(right), ret_right[j], num_edges[j] * sizeof(tsk_id_t));
+        memcpy(PyArray_DATA(parent), ret_parent[j], num_edges[j] * sizeof(tsk_id_t));
+        path = Py_BuildValue("(OOO)", left, right, parent);
+        if (path == NULL) {
+            goto out;
+        }
+        Py_DECREF(left);
+        Py_DECREF(right);
+        Py_DECREF(parent);
+        left = NULL;
+        right = NULL;
+        parent = NULL;
+        PyList_SET_ITEM(list, (Py_ssize_t) j, path);
+    }
+    ret = list;
+    list = NULL;
+out:
+    PyMem_Free(num_edges);
+    PyMem_Free(ret_left);
+    PyMem_Free(ret_right);
+    PyMem_Free(ret_parent);
+    Py_XDECREF(haplotypes_array);
+    Py_XDECREF(match_array);
+    Py_XDECREF(list);
+    Py_XDECREF(left);
+    Py_XDECREF(right);
+    Py_XDECREF(parent);
+    return ret;
+}
+
 static PyObject *
 AncestorMatcher_get_traceback(AncestorMatcher *self, PyObject *args)
 {
     PyObject *ret = NULL;
     unsigned long site;
     node_state_list_t *list;
+    tsk_id_t *node = NULL;
+    int8_t *recombination_required = NULL;
     PyObject *dict = NULL;
     PyObject *key = NULL;
     PyObject *value = NULL;
+    tsk_id_t u;
     int j;
 
     if (AncestorMatcher_check_state(self) != 0) {
@@ -1454,9 +1878,20 @@ AncestorMatcher_get_traceback(AncestorMatcher *self, PyObject *args)
         goto out;
     }
     list = &self->ancestor_matcher->traceback[site];
+    node = PyMem_Malloc(((size_t) list->size + 1) * sizeof(*node));
+    recombination_required = PyMem_Malloc(
+            ((size_t) list->size + 1) * sizeof(*recombination_required));
+    if (node == NULL || recombination_required == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    node_state_list_decode(list, node, recombination_required);
     for (j = 0; j < list->size; j++) {
-        key = Py_BuildValue("k", (unsigned long) list->node[j]);
-        value = Py_BuildValue("i", (int) list->recombination_required[j]);
+        /* The matcher works in frozen node ids */
+        u = tree_sequence_builder_get_node_id(
+                self->ancestor_matcher->tree_sequence_builder, node[j]);
+        key = Py_BuildValue("k", (unsigned long) u);
+        value = Py_BuildValue("i", (int) recombination_required[j]);
         if (key == NULL || value == NULL) {
             goto out;
         }
@@ -1471,6 +1906,8 @@ AncestorMatcher_get_traceback(AncestorMatcher *self, PyObject *args)
     ret = dict;
     dict = NULL;
 out:
+    PyMem_Free(node);
+    PyMem_Free(recombination_required);
     Py_XDECREF(key);
     Py_XDECREF(value);
     Py_XDECREF(dict);
@@ -1505,6 +1942,20 @@ out:
     return ret;
 }
 
+static PyObject *
+AncestorMatcher_get_haplotype_memory(AncestorMatcher *self, void *closure)
+{
+    PyObject *ret = NULL;
+
+    if (AncestorMatcher_check_state(self) != 0) {
+        goto out;
+    }
+    ret = Py_BuildValue("k", (unsigned long)
+            ancestor_matcher_get_haplotype_memory(self->ancestor_matcher));
+out:
+    return ret;
+}
+
 
 static PyMemberDef AncestorMatcher_members[] = {
     {NULL}  /* Sentinel */
@@ -1516,6 +1967,8 @@ static PyGetSetDef AncestorMatcher_getsetters[] = {
         NULL, "The mean size of the traceback per site."},
     {"total_memory", (getter) AncestorMatcher_get_total_memory,
         NULL, "The total amount of memory used by this matcher."},
+    {"haplotype_memory", (getter) AncestorMatcher_get_haplotype_memory,
+        NULL, "The memory used by the state of each haplotype in a batch."},
     {NULL}  /* Sentinel */
 };
 
@@ -1523,6 +1976,10 @@ static PyMethodDef AncestorMatcher_methods[] = {
     {"find_path", (PyCFunction) AncestorMatcher_find_path,
         METH_VARARGS|METH_KEYWORDS,
         "Returns a best match path for the specified haplotype through the ancestors."},
+    {"find_paths", (PyCFunction) AncestorMatcher_find_paths,
+        METH_VARARGS|METH_KEYWORDS,
+        "Returns the best match paths for a batch of haplotypes through the "
+        "ancestors, in a single pass through the trees."},
     {"get_traceback", (PyCFunction) AncestorMatcher_get_traceback,
         METH_VARARGS, "Returns the traceback likelihood dictionary at the specified site."},
     {NULL}  /* Sentinel */
@@ -27,6 +27,12 @@
 
 #include "avl.h"
 
+/* Must be a power of two */
+#define PATTERN_MAP_INITIAL_BUCKETS 8
+
+#define SITE_BLOCK_SHIFT 6
+#define SITE_SUPERBLOCK_SHIFT 12
+
 static int
 cmp_time_map(const void *a, const void *b)
 {
@@ -35,36 +41,167 @@ cmp_time_map(const void *a, const void *b)
     return (ia->time > ib->time) - (ia->time < ib->time);
 }
 
+#ifdef __GNUC__
+#define popcount64(x) ((size_t) __builtin_popcountll(x))
+#else
+static inline size_t
+popcount64(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (size_t)((x * 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+/* A set of samples stored as a bitset, along with the indexes of its non-zero
+ * words. Samples only ever leave the set while an ancestor is built, so
+ * operations on the set only visit the words that may still hold samples. */
+typedef struct {
+    uint64_t *bits;
+    size_t *words;
+    size_t num_words;
+} sample_set_t;
+
+static int
+sample_set_alloc(sample_set_t *self, size_t num_words)
+{
+    int ret = 0;
+
+    self->bits = malloc(num_words * sizeof(*self->bits));
+    self->words = malloc(num_words * sizeof(*self->words));
+    self->num_words = 0;
+    if (self->bits == NULL || self->words == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+    }
+    return ret;
+}
+
+static void
+sample_set_free(sample_set_t *self)
+{
+    tsi_safe_free(self->bits);
+    tsi_safe_free(self->words);
+}
+
+static inline allele_t
+bitset_get_genotype(const uint64_t *derived, const uint64_t *missing, size_t j)
+{
+    const uint64_t bit = 1ULL << (j % 64);
+    allele_t ret = (derived[j / 64] & bit) != 0;
+
+    if (missing != NULL && (missing[j / 64] & bit) != 0) {
+        ret = TSK_MISSING_DATA;
+    }
+    return ret;
+}
+
+/* Orders patterns in the same way as a memcmp of the original genotype
+ * vectors, so that 0 < 1 < TSK_MISSING_DATA. This keeps the order of the
+ * ancestor descriptors independent of how we store the genotypes. */
 static int
 cmp_pattern_map(const void *a, const void *b)
 {
     const pattern_map_t *ia = (pattern_map_t const *) a;
     const pattern_map_t *ib = (pattern_map_t const *) b;
-    int ret = memcmp(ia->genotypes, ib->genotypes, ia->num_samples * sizeof(allele_t));
+    uint64_t ma, mb, diff, bit;
+    int va, vb;
+    size_t j;
+    int ret = 0;
+
+    for (j = 0; j < ia->num_words; j++) {
+        ma = ia->missing == NULL ? 0 : ia->missing[j];
+        mb = ib->missing == NULL ? 0 : ib->missing[j];
+        diff = (ia->derived[j] ^ ib->derived[j]) | (ma ^ mb);
+        if (diff != 0) {
+            /* The lowest set bit is the first sample that differs */
+            bit = diff & (~diff + 1);
+            va = (ma & bit) ? 2 : (ia->derived[j] & bit) != 0;
+            vb = (mb & bit) ? 2 : (ib->derived[j] & bit) != 0;
+            ret = (va > vb) - (va < vb);
+            break;
+        }
+    }
+    return ret;
+}
+
+static inline uint64_t
+hash_word(uint64_t h, uint64_t x)
+{
+    /* splitmix64 finaliser applied to the running hash */
+    h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static uint64_t
+hash_pattern(const uint64_t *derived, const uint64_t *missing, size_t num_words)
+{
+    size_t j;
+    uint64_t h = num_words;
+
+    for (j = 0; j < num_words; j++) {
+        h = hash_word(h, derived[j]);
+    }
+    if (missing != NULL) {
+        for (j = 0; j < num_words; j++) {
+            h = hash_word(h, missing[j]);
+        }
+    }
+    return h;
+}
+
+static bool
+pattern_map_equals(const pattern_map_t *a, const pattern_map_t *b)
+{
+    const size_t size = a->num_words * sizeof(uint64_t);
+    bool ret = a->hash == b->hash && memcmp(a->derived, b->derived, size) == 0;
+
+    if (ret) {
+        if (a->missing == NULL || b->missing == NULL) {
+            ret = a->missing == b->missing;
+        } else {
+            ret = memcmp(a->missing, b->missing, size) == 0;
+        }
+    }
     return ret;
 }
 
 static void
 ancestor_builder_check_state(ancestor_builder_t *self)
 {
-    size_t count;
-    avl_node_t *a, *b;
+    size_t j, count, num_patterns;
+    avl_node_t *a;
     pattern_map_t *pattern_map;
     time_map_t *time_map;
     site_list_t *s;
 
     for (a = self->time_map.head; a != NULL; a = a->next) {
         time_map = (time_map_t *) a->item;
-        for (b = time_map->pattern_map.head; b != NULL; b = b->next) {
-            pattern_map = (pattern_map_t *) b->item;
-            count = 0;
-            for (s = pattern_map->sites; s != NULL; s = s->next) {
-                assert(self->sites[s->site].time == time_map->time);
-                assert(self->sites[s->site].genotypes == pattern_map->genotypes);
-                count++;
+        num_patterns = 0;
+        for (j = 0; j < time_map->num_buckets; j++) {
+            for (pattern_map = time_map->buckets[j]; pattern_map != NULL;
+                 pattern_map = pattern_map->next) {
+                assert((pattern_map->hash & (time_map->num_buckets - 1)) == j);
+                assert(pattern_map->hash
+                       == hash_pattern(pattern_map->derived, pattern_map->missing,
+                           pattern_map->num_words));
+                num_patterns++;
+                count = 0;
+                for (s = pattern_map->sites; s != NULL; s = s->next) {
+                    assert(self->sites[s->site].time == time_map->time);
+                    assert(self->sites[s->site].derived == pattern_map->derived);
+                    assert(self->sites[s->site].missing == pattern_map->missing);
+                    count++;
+                }
+                assert(pattern_map->num_sites == count);
             }
-            assert(pattern_map->num_sites == count);
         }
+        assert(time_map->num_patterns == num_patterns);
     }
 }
 
@@ -72,7 +209,7 @@ int
 ancestor_builder_print_state(ancestor_builder_t *self, FILE *out)
 {
     size_t j, k;
-    avl_node_t *a, *b;
+    avl_node_t *a;
     pattern_map_t *pattern_map;
     time_map_t *time_map;
     site_list_t *s;
@@ -84,26 +221,30 @@ ancestor_builder_print_state(ancestor_builder_t *self, FILE *out)
 
     fprintf(out, "Sites:\n");
     for (j = 0; j < self->num_sites; j++) {
-        fprintf(out, "%d\t%d\t%p\n", (int) j, (int) self->sites[j].time,
-            (void *) self->sites[j].genotypes);
+        fprintf(out, "%d\t%d\t%p\t%p\n", (int) j, (int) self->sites[j].time,
+            (const void *) self->sites[j].derived,
+            (const void *) self->sites[j].missing);
     }
     fprintf(out, "Time map:\n");
 
     for (a = self->time_map.head; a != NULL; a = a->next) {
         time_map = (time_map_t *) a->item;
-        fprintf(out, "Epoch: time = %f: %d ancestors\n", time_map->time,
-            avl_count(&time_map->pattern_map));
-        for (b = time_map->pattern_map.head; b != NULL; b = b->next) {
-            pattern_map = (pattern_map_t *) b->item;
-            fprintf(out, "\t");
-            for (k = 0; k < self->num_samples; k++) {
-                fprintf(out, "%d", pattern_map->genotypes[k]);
-            }
-            fprintf(out, "\t");
-            for (s = pattern_map->sites; s != NULL; s = s->next) {
-                fprintf(out, "%d ", s->site);
+        fprintf(out, "Epoch: time = %f: %d ancestors, %d buckets\n", time_map->time,
+            (int) time_map->num_patterns, (int) time_map->num_buckets);
+        for (j = 0; j < time_map->num_buckets; j++) {
+            for (pattern_map = time_map->buckets[j]; pattern_map != NULL;
+                 pattern_map = pattern_map->next) {
+                fprintf(out, "\t");
+                for (k = 0; k < self->num_samples; k++) {
+                    fprintf(out, "%d", bitset_get_genotype(pattern_map->derived,
+                                           pattern_map->missing, k));
+                }
+                fprintf(out, "\t");
+                for (s = pattern_map->sites; s != NULL; s = s->next) {
+                    fprintf(out, "%d ", s->site);
+                }
+                fprintf(out, "\n");
             }
-            fprintf(out, "\n");
         }
     }
     fprintf(out, "Descriptors:\n");
@@ -133,16 +274,26 @@ ancestor_builder_alloc(
     }
 
     self->num_samples = num_samples;
+    self->num_words = (num_samples + 63) / 64;
     self->max_sites = max_sites;
     self->num_sites = 0;
     self->flags = flags;
     self->sites = calloc(max_sites, sizeof(site_t));
     self->descriptors = calloc(max_sites, sizeof(ancestor_descriptor_t));
-    if (self->sites == NULL || self->descriptors == NULL) {
+    self->block_time
+        = malloc(((max_sites >> SITE_BLOCK_SHIFT) + 1) * sizeof(*self->block_time));
+    self->superblock_time = malloc(
+        ((max_sites >> SITE_SUPERBLOCK_SHIFT) + 1) * sizeof(*self->superblock_time));
+    self->genotype_buffer = malloc(2 * self->num_words * sizeof(uint64_t));
+    if (self->sites == NULL || self->descriptors == NULL || self->block_time == NULL
+        || self->superblock_time == NULL || self->genotype_buffer == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    ret = tsk_blkalloc_init(&self->allocator, 1024 * 1024);
+    /* All objects allocated from the block allocator before finalise are a
+     * multiple of 8 bytes in size, so the genotype bitsets are word aligned. */
+    ret = tsk_blkalloc_init(&self->allocator,
+        TSK_MAX(1024 * 1024, 2 * self->num_words * sizeof(uint64_t)));
     if (ret != 0) {
         goto out;
     }
@@ -154,8 +305,18 @@ out:
 int
 ancestor_builder_free(ancestor_builder_t *self)
 {
+    avl_node_t *a;
+    time_map_t *time_map;
+
     tsi_safe_free(self->sites);
     tsi_safe_free(self->descriptors);
+    for (a = self->time_map.head; a != NULL; a = a->next) {
+        time_map = (time_map_t *) a->item;
+        tsi_safe_free(time_map->buckets);
+    }
+    tsi_safe_free(self->block_time);
+    tsi_safe_free(self->superblock_time);
+    tsi_safe_free(self->genotype_buffer);
     tsk_blkalloc_free(&self->allocator);
     return 0;
 }
@@ -176,7 +337,12 @@ ancestor_builder_get_time_map(ancestor_builder_t *self, double time)
             goto out;
         }
         time_map->time = time;
-        avl_init_tree(&time_map->pattern_map, cmp_pattern_map, NULL);
+        time_map->num_patterns = 0;
+        time_map->num_buckets = PATTERN_MAP_INITIAL_BUCKETS;
+        time_map->buckets = calloc(time_map->num_buckets, sizeof(*time_map->buckets));
+        if (time_map->buckets == NULL) {
+            goto out;
+        }
         avl_init_node(avl_node, time_map);
         avl_node = avl_insert_node(&self->time_map, avl_node);
         assert(avl_node != NULL);
@@ -188,116 +354,185 @@ out:
     return ret;
 }
 
-static inline void
+/* Sets sample_set to the samples carrying the derived allele at the specified
+ * site, and returns the number of samples in it. */
+static inline size_t
 ancestor_builder_get_consistent_samples(
-    ancestor_builder_t *self, tsk_id_t site, tsk_id_t *samples, size_t *num_samples)
+    ancestor_builder_t *self, tsk_id_t site, sample_set_t *sample_set)
 {
-    tsk_id_t j, k;
-    allele_t *restrict genotypes = self->sites[site].genotypes;
+    size_t j, num_samples;
+    const uint64_t *restrict derived = self->sites[site].derived;
+    uint64_t *restrict bits = sample_set->bits;
+    size_t *restrict words = sample_set->words;
+    size_t num_words = 0;
 
-    k = 0;
-    for (j = 0; j < (tsk_id_t) self->num_samples; j++) {
-        if (genotypes[j] == 1) {
-            samples[k] = j;
-            k++;
+    num_samples = 0;
+    for (j = 0; j < self->num_words; j++) {
+        bits[j] = derived[j];
+        if (derived[j] != 0) {
+            words[num_words] = j;
+            num_words++;
+            num_samples += popcount64(derived[j]);
         }
     }
-    *num_samples = (size_t) k;
+    sample_set->num_words = num_words;
+    return num_samples;
+}
+
+/* Counts the number of samples in the specified set that carry the derived
+ * (ones) and ancestral (zeros) alleles at the specified site. */
+static inline void
+ancestor_builder_count_alleles(ancestor_builder_t *self, tsk_id_t site,
+    const sample_set_t *sample_set, size_t *ones_ret, size_t *zeros_ret)
+{
+    size_t j, k;
+    size_t ones = 0;
+    size_t zeros = 0;
+    const uint64_t *restrict bits = sample_set->bits;
+    const size_t *restrict words = sample_set->words;
+    const size_t num_words = sample_set->num_words;
+    const uint64_t *restrict derived = self->sites[site].derived;
+    const uint64_t *restrict missing = self->sites[site].missing;
+
+    if (missing == NULL) {
+        for (k = 0; k < num_words; k++) {
+            j = words[k];
+            ones += popcount64(bits[j] & derived[j]);
+            zeros += popcount64(bits[j] & ~derived[j]);
+        }
+    } else {
+        for (k = 0; k < num_words; k++) {
+            j = words[k];
+            ones += popcount64(bits[j] & derived[j]);
+            zeros += popcount64(bits[j] & ~(derived[j] | missing[j]));
+        }
+    }
+    *ones_ret = ones;
+    *zeros_ret = zeros;
+}
+
+/* Returns the first site after l in the specified direction that is older
+ * than the specified time, or -1 or num_sites if there is no such site. Whole
+ * blocks and superblocks of younger sites are skipped using their max time. */
+static inline int64_t
+ancestor_builder_next_older_site(
+    ancestor_builder_t *self, int64_t l, int direction, double time)
+{
+    const int64_t num_sites = (int64_t) self->num_sites;
+    const site_t *restrict sites = self->sites;
+    const double *restrict block_time = self->block_time;
+    const double *restrict superblock_time = self->superblock_time;
+    int64_t j = l + direction;
+
+    if (direction > 0) {
+        while (j < num_sites) {
+            if (superblock_time[j >> SITE_SUPERBLOCK_SHIFT] <= time) {
+                j = ((j >> SITE_SUPERBLOCK_SHIFT) + 1) << SITE_SUPERBLOCK_SHIFT;
+            } else if (block_time[j >> SITE_BLOCK_SHIFT] <= time) {
+                j = ((j >> SITE_BLOCK_SHIFT) + 1) << SITE_BLOCK_SHIFT;
+            } else if (sites[j].time > time) {
+                break;
+            } else {
+                j++;
+            }
+        }
+        j = TSK_MIN(j, num_sites);
+    } else {
+        while (j >= 0) {
+            if (superblock_time[j >> SITE_SUPERBLOCK_SHIFT] <= time) {
+                j = ((j >> SITE_SUPERBLOCK_SHIFT) << SITE_SUPERBLOCK_SHIFT) - 1;
+            } else if (block_time[j >> SITE_BLOCK_SHIFT] <= time) {
+                j = ((j >> SITE_BLOCK_SHIFT) << SITE_BLOCK_SHIFT) - 1;
+            } else if (sites[j].time > time) {
+                break;
+            } else {
+                j--;
+            }
+        }
+    }
+    return j;
 }
 
 static int
 ancestor_builder_compute_ancestral_states(ancestor_builder_t *self, int direction,
-    tsk_id_t focal_site, allele_t *ancestor, tsk_id_t *restrict sample_set,
-    bool *restrict disagree, tsk_id_t *last_site_ret)
+    tsk_id_t focal_site, allele_t *ancestor, sample_set_t *sample_set,
+    uint64_t *restrict disagree, tsk_id_t *last_site_ret)
 {
     int ret = 0;
     tsk_id_t last_site = focal_site;
-    int64_t l;
-    tsk_id_t u;
-    size_t j, ones, zeros, tmp_size, sample_set_size, min_sample_set_size;
+    int64_t l, next;
+    size_t j, k, num_words, ones, zeros, sample_set_size, min_sample_set_size;
     double focal_site_time = self->sites[focal_site].time;
     const site_t *restrict sites = self->sites;
     const size_t num_sites = self->num_sites;
-    const allele_t *restrict genotypes;
+    uint64_t *restrict bits = sample_set->bits;
+    size_t *restrict words = sample_set->words;
+    const uint64_t *restrict derived;
+    const uint64_t *restrict missing;
+    uint64_t mismatch, consensus_mask;
     allele_t consensus;
 
-    ancestor_builder_get_consistent_samples(
-        self, focal_site, sample_set, &sample_set_size);
+    sample_set_size
+        = ancestor_builder_get_consistent_samples(self, focal_site, sample_set);
     /* This can't happen because we've already tested for it in
      * ancestor_builder_compute_between_focal_sites */
     assert(sample_set_size > 0);
-    memset(disagree, 0, self->num_samples * sizeof(*disagree));
+    for (k = 0; k < sample_set->num_words; k++) {
+        disagree[words[k]] = 0;
+    }
     min_sample_set_size = sample_set_size / 2;
 
-    /* printf("site=%d, direction=%d min_sample_size=%d\n", (int) focal_site, direction,
-     */
-    /*         (int) min_sample_set_size); */
-    for (l = focal_site + direction; l >= 0 && l < (int64_t) num_sites; l += direction) {
-        /* printf("\tl = %d\n", (int) l); */
+    l = focal_site;
+    while (true) {
+        next = ancestor_builder_next_older_site(self, l, direction, focal_site_time);
+        /* The younger sites that we skipped over are all zero */
+        if (direction > 0) {
+            memset(ancestor + l + 1, 0, (size_t)(next - l - 1) * sizeof(*ancestor));
+        } else {
+            memset(ancestor + next + 1, 0, (size_t)(l - next - 1) * sizeof(*ancestor));
+        }
+        if (next < 0 || next >= (int64_t) num_sites) {
+            if (next - direction != l) {
+                last_site = (tsk_id_t)(next - direction);
+            }
+            break;
+        }
+        l = next;
         ancestor[l] = 0;
         last_site = (tsk_id_t) l;
-        if (sites[l].time > focal_site_time) {
-
-            /* printf("\t%d\t%d:", (int) l, (int) sample_set_size); */
-            /* /1* for (j = 0; j < sample_set_size; j++) { *1/ */
-            /* /1*     printf("%d, ", sample_set[j]); *1/ */
-            /* /1* } *1/ */
-
-            genotypes = self->sites[l].genotypes;
-            ones = 0;
-            zeros = 0;
-            for (j = 0; j < sample_set_size; j++) {
-                switch (genotypes[sample_set[j]]) {
-                    case 0:
-                        zeros++;
-                        break;
-                    case 1:
-                        ones++;
-                        break;
-                }
-            }
-            if (ones + zeros == 0) {
-                ancestor[l] = TSK_MISSING_DATA;
-            } else {
-                if (ones >= zeros) {
-                    consensus = 1;
-                } else {
-                    consensus = 0;
-                }
-                /* printf("\t:ones=%d, consensus=%d\n", (int) ones, consensus); */
-                /* fflush(stdout); */
-                for (j = 0; j < sample_set_size; j++) {
-                    u = sample_set[j];
-                    if (disagree[u] && (genotypes[u] != consensus)
-                        && (genotypes[u] != TSK_MISSING_DATA)) {
-                        /* This sample has disagreed with consensus twice in a row,
-                         * so remove it */
-                        /* printf("\t\tremoving %d\n", sample_set[j]); */
-                        sample_set[j] = -1;
-                    }
-                }
-                ancestor[l] = consensus;
-                /* Repack the sample set */
-                tmp_size = 0;
-                for (j = 0; j < sample_set_size; j++) {
-                    if (sample_set[j] != -1) {
-                        sample_set[tmp_size] = sample_set[j];
-                        tmp_size++;
-                    }
+        ancestor_builder_count_alleles(self, (tsk_id_t) l, sample_set, &ones, &zeros);
+        if (ones + zeros == 0) {
+            ancestor[l] = TSK_MISSING_DATA;
+        } else {
+            consensus = ones >= zeros;
+            consensus_mask = consensus ? ~0ULL : 0;
+            derived = sites[l].derived;
+            missing = sites[l].missing;
+            /* Samples that have disagreed with consensus twice in a row
+             * are removed from the sample set. The remaining samples that
+             * disagree with the consensus here are then flagged. Words
+             * that become empty are dropped from the set. */
+            sample_set_size = 0;
+            num_words = 0;
+            for (k = 0; k < sample_set->num_words; k++) {
+                j = words[k];
+                mismatch = derived[j] ^ consensus_mask;
+                if (missing != NULL) {
+                    mismatch &= ~missing[j];
                 }
-                sample_set_size = tmp_size;
-                if (sample_set_size <= min_sample_set_size) {
-                    /* printf("BREAK\n"); */
-                    break;
-                }
-                /* For the remaining sample set, set the disagree flags based
-                 * on whether they agree with the consensus for this site. */
-                for (j = 0; j < sample_set_size; j++) {
-                    u = sample_set[j];
-                    disagree[u] = ((genotypes[u] != consensus)
-                                   && (genotypes[u] != TSK_MISSING_DATA));
+                bits[j] &= ~(disagree[j] & mismatch);
+                disagree[j] = bits[j] & mismatch;
+                if (bits[j] != 0) {
+                    words[num_words] = j;
+                    num_words++;
+                    sample_set_size += popcount64(bits[j]);
                 }
             }
+            sample_set->num_words = num_words;
+            ancestor[l] = consensus;
+            if (sample_set_size <= min_sample_set_size) {
+                break;
+            }
         }
     }
     *last_site_ret = last_site;
@@ -307,18 +542,16 @@ ancestor_builder_compute_ancestral_states(ancestor_builder_t *self, int directio
 static int
 ancestor_builder_compute_between_focal_sites(ancestor_builder_t *self,
     size_t num_focal_sites, tsk_id_t *focal_sites, allele_t *ancestor,
-    tsk_id_t *sample_set)
+    sample_set_t *sample_set)
 {
     int ret = 0;
     tsk_id_t l;
-    size_t j, k, ones, zeros, sample_set_size;
+    size_t j, ones, zeros, sample_set_size;
     double focal_site_time;
-    const site_t *restrict sites = self->sites;
-    const allele_t *restrict genotypes;
 
     assert(num_focal_sites > 0);
-    ancestor_builder_get_consistent_samples(
-        self, focal_sites[0], sample_set, &sample_set_size);
+    sample_set_size
+        = ancestor_builder_get_consistent_samples(self, focal_sites[0], sample_set);
     if (sample_set_size == 0) {
         ret = TSI_ERR_BAD_FOCAL_SITE;
         goto out;
@@ -328,31 +561,20 @@ ancestor_builder_compute_between_focal_sites(ancestor_builder_t *self,
     ancestor[focal_sites[0]] = 1;
     for (j = 1; j < num_focal_sites; j++) {
         ancestor[focal_sites[j]] = 1;
-        for (l = focal_sites[j - 1] + 1; l < focal_sites[j]; l++) {
-            ancestor[l] = 0;
-            if (sites[l].time > focal_site_time) {
-                /* printf("\t%d\t%d:", l, (int) sample_set_size); */
-                /* for (k = 0; k < sample_set_size; k++) { */
-                /*     printf("%d, ", sample_set[k]); */
-                /* } */
-                genotypes = self->sites[l].genotypes;
-                ones = 0;
-                zeros = 0;
-                for (k = 0; k < sample_set_size; k++) {
-                    switch (genotypes[sample_set[k]]) {
-                        case 0:
-                            zeros++;
-                            break;
-                        case 1:
-                            ones++;
-                            break;
-                    }
-                }
-                if (ones + zeros == 0) {
-                    ancestor[l] = TSK_MISSING_DATA;
-                } else if (ones >= zeros) {
-                    ancestor[l] = 1;
-                }
+        l = focal_sites[j - 1];
+        memset(
+            ancestor + l + 1, 0, (size_t)(focal_sites[j] - l - 1) * sizeof(*ancestor));
+        while (true) {
+            l = (tsk_id_t) ancestor_builder_next_older_site(
+                self, l, +1, focal_site_time);
+            if (l >= focal_sites[j]) {
+                break;
+            }
+            ancestor_builder_count_alleles(self, l, sample_set, &ones, &zeros);
+            if (ones + zeros == 0) {
+                ancestor[l] = TSK_MISSING_DATA;
+            } else if (ones >= zeros) {
+                ancestor[l] = 1;
             }
         }
     }
@@ -360,21 +582,15 @@ out:
     return ret;
 }
 
-/* Build the ancestors for sites in the specified focal sites */
-int
-ancestor_builder_make_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
-    tsk_id_t *focal_sites, tsk_id_t *ret_start, tsk_id_t *ret_end, allele_t *ancestor)
+/* Build the ancestor for the specified focal sites. Only the values in the
+ * returned [start, end) interval of the ancestor array are written. */
+static int
+ancestor_builder_build_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
+    tsk_id_t *focal_sites, tsk_id_t *ret_start, tsk_id_t *ret_end, allele_t *ancestor,
+    sample_set_t *sample_set, uint64_t *restrict disagree)
 {
     int ret = 0;
     tsk_id_t focal_site, last_site;
-    tsk_id_t *sample_set = malloc(self->num_samples * sizeof(tsk_id_t));
-    bool *restrict disagree = calloc(self->num_samples, sizeof(*disagree));
-
-    if (sample_set == NULL || disagree == NULL) {
-        ret = TSI_ERR_NO_MEMORY;
-        goto out;
-    }
-    memset(ancestor, 0xff, self->num_sites * sizeof(*ancestor));
 
     ret = ancestor_builder_compute_between_focal_sites(
         self, num_focal_sites, focal_sites, ancestor, sample_set);
@@ -398,63 +614,250 @@ ancestor_builder_make_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
     }
     *ret_start = last_site;
 out:
-    tsi_safe_free(sample_set);
+    return ret;
+}
+
+/* Build the ancestors for sites in the specified focal sites */
+int
+ancestor_builder_make_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
+    tsk_id_t *focal_sites, tsk_id_t *ret_start, tsk_id_t *ret_end, allele_t *ancestor)
+{
+    int ret = 0;
+    sample_set_t sample_set;
+    uint64_t *disagree = malloc(self->num_words * sizeof(*disagree));
+
+    ret = sample_set_alloc(&sample_set, self->num_words);
+    if (ret != 0) {
+        goto out;
+    }
+    if (disagree == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    memset(ancestor, 0xff, self->num_sites * sizeof(*ancestor));
+    ret = ancestor_builder_build_ancestor(self, num_focal_sites, focal_sites,
+        ret_start, ret_end, ancestor, &sample_set, disagree);
+out:
+    sample_set_free(&sample_set);
     tsi_safe_free(disagree);
     return ret;
 }
 
-int WARN_UNUSED
-ancestor_builder_add_site(ancestor_builder_t *self, double time, allele_t *genotypes)
+/* Build the ancestors for descriptors first, first + 1, ..., last - 1 in order,
+ * packing the haplotype of each between its start and end contiguously into
+ * the specified buffer. We stop early when the buffer has less than num_sites
+ * space left, and return the number of ancestors made in num_made. Calls on
+ * different threads are safe as long as each has its own output arrays.
+ *
+ * Unlike make_ancestor, the cost of each ancestor here is proportional to its
+ * length rather than to num_sites. */
+int
+ancestor_builder_make_ancestors(ancestor_builder_t *self, size_t first, size_t last,
+    size_t buffer_size, allele_t *buffer, tsk_id_t *start, tsk_id_t *end,
+    size_t *num_made)
+{
+    int ret = 0;
+    size_t j, length;
+    size_t offset = 0;
+    ancestor_descriptor_t *descriptor;
+    sample_set_t sample_set;
+    uint64_t *disagree = malloc(self->num_words * sizeof(*disagree));
+    allele_t *ancestor = malloc(TSK_MAX(1, self->num_sites) * sizeof(*ancestor));
+
+    *num_made = 0;
+    ret = sample_set_alloc(&sample_set, self->num_words);
+    if (ret != 0) {
+        goto out;
+    }
+    if (disagree == NULL || ancestor == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    if (first > last || last > self->num_ancestors) {
+        ret = TSI_ERR_BAD_ANCESTOR_INDEX;
+        goto out;
+    }
+    if (buffer_size < self->num_sites) {
+        ret = TSI_ERR_ANCESTOR_BUFFER_TOO_SMALL;
+        goto out;
+    }
+    for (j = first; j < last && buffer_size - offset >= self->num_sites; j++) {
+        descriptor = &self->descriptors[j];
+        ret = ancestor_builder_build_ancestor(self, descriptor->num_focal_sites,
+            descriptor->focal_sites, start, end, ancestor, &sample_set, disagree);
+        if (ret != 0) {
+            goto out;
+        }
+        length = (size_t)(*end - *start);
+        memcpy(buffer + offset, ancestor + *start, length * sizeof(*ancestor));
+        offset += length;
+        start++;
+        end++;
+        (*num_made)++;
+    }
+out:
+    sample_set_free(&sample_set);
+    tsi_safe_free(disagree);
+    tsi_safe_free(ancestor);
+    return ret;
+}
+
+/* Packs the specified genotypes into the derived and missing bit-planes of the
+ * genotype buffer, and records whether any of the genotypes are missing. */
+static int
+ancestor_builder_pack_genotypes(
+    ancestor_builder_t *self, allele_t *genotypes, bool *has_missing)
+{
+    int ret = 0;
+    size_t j;
+    uint64_t bit;
+    uint64_t *restrict derived = self->genotype_buffer;
+    uint64_t *restrict missing = self->genotype_buffer + self->num_words;
+
+    memset(derived, 0, 2 * self->num_words * sizeof(*derived));
+    *has_missing = false;
+    for (j = 0; j < self->num_samples; j++) {
+        bit = 1ULL << (j % 64);
+        switch (genotypes[j]) {
+            case 0:
+                break;
+            case 1:
+                derived[j / 64] |= bit;
+                break;
+            case TSK_MISSING_DATA:
+                missing[j / 64] |= bit;
+                *has_missing = true;
+                break;
+            default:
+                ret = TSI_ERR_BAD_GENOTYPE;
+                goto out;
+        }
+    }
+out:
+    return ret;
+}
+
+/* Doubles the number of buckets in the specified time map's hash table */
+static int
+ancestor_builder_expand_time_map(time_map_t *time_map)
+{
+    int ret = 0;
+    size_t j, k;
+    size_t num_buckets = 2 * time_map->num_buckets;
+    pattern_map_t **buckets = calloc(num_buckets, sizeof(*buckets));
+    pattern_map_t *pattern_map, *next;
+
+    if (buckets == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    for (j = 0; j < time_map->num_buckets; j++) {
+        for (pattern_map = time_map->buckets[j]; pattern_map != NULL;
+             pattern_map = next) {
+            next = pattern_map->next;
+            k = pattern_map->hash & (num_buckets - 1);
+            pattern_map->next = buckets[k];
+            buckets[k] = pattern_map;
+        }
+    }
+    free(time_map->buckets);
+    time_map->buckets = buckets;
+    time_map->num_buckets = num_buckets;
+out:
+    return ret;
+}
+
+/* Inserts a site with the specified genotype bit-planes. The planes are copied
+ * into the builder's memory if copy is true, and otherwise must remain valid
+ * for the lifetime of the builder. */
+static int WARN_UNUSED
+ancestor_builder_insert_site(ancestor_builder_t *self, double time,
+    const uint64_t *derived, const uint64_t *missing, bool copy)
 {
     int ret = 0;
     site_t *site;
-    avl_node_t *avl_node;
     site_list_t *list_node;
     pattern_map_t search, *map_elem;
-    avl_tree_t *pattern_map;
+    pattern_map_t **bucket;
     tsk_id_t site_id = (tsk_id_t) self->num_sites;
-    time_map_t *time_map = ancestor_builder_get_time_map(self, time);
+    time_map_t *time_map;
+    size_t j;
+    size_t num_words = self->num_words;
+    uint64_t *stored;
 
+    if (self->num_sites == self->max_sites) {
+        ret = TSI_ERR_TOO_MANY_SITES;
+        goto out;
+    }
+    time_map = ancestor_builder_get_time_map(self, time);
     if (time_map == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    if (self->num_sites == self->max_sites) {
-        ret = TSI_ERR_TOO_MANY_SITES;
-        goto out;
+    if (time_map->num_patterns >= time_map->num_buckets) {
+        ret = ancestor_builder_expand_time_map(time_map);
+        if (ret != 0) {
+            goto out;
+        }
     }
     self->num_sites++;
-    pattern_map = &time_map->pattern_map;
     site = &self->sites[site_id];
     site->time = time;
+    j = (size_t) site_id >> SITE_BLOCK_SHIFT;
+    if (((size_t) site_id & ((1 << SITE_BLOCK_SHIFT) - 1)) == 0
+        || time > self->block_time[j]) {
+        self->block_time[j] = time;
+    }
+    j = (size_t) site_id >> SITE_SUPERBLOCK_SHIFT;
+    if (((size_t) site_id & ((1 << SITE_SUPERBLOCK_SHIFT) - 1)) == 0
+        || time > self->superblock_time[j]) {
+        self->superblock_time[j] = time;
+    }
 
-    search.genotypes = genotypes;
-    search.num_samples = self->num_samples;
-    avl_node = avl_search(pattern_map, &search);
-    if (avl_node == NULL) {
-        avl_node = tsk_blkalloc_get(&self->allocator, sizeof(avl_node_t));
+    search.derived = derived;
+    search.missing = missing;
+    search.num_words = num_words;
+    search.hash = hash_pattern(search.derived, search.missing, num_words);
+    bucket = &time_map->buckets[search.hash & (time_map->num_buckets - 1)];
+    for (map_elem = *bucket; map_elem != NULL; map_elem = map_elem->next) {
+        if (pattern_map_equals(map_elem, &search)) {
+            break;
+        }
+    }
+    if (map_elem == NULL) {
         map_elem = tsk_blkalloc_get(&self->allocator, sizeof(pattern_map_t));
-        site->genotypes
-            = tsk_blkalloc_get(&self->allocator, self->num_samples * sizeof(allele_t));
-        if (avl_node == NULL || map_elem == NULL || site->genotypes == NULL) {
+        if (map_elem == NULL) {
             ret = TSI_ERR_NO_MEMORY;
             goto out;
         }
-        memcpy(site->genotypes, genotypes, self->num_samples * sizeof(allele_t));
-        avl_init_node(avl_node, map_elem);
-        map_elem->genotypes = site->genotypes;
-        map_elem->num_samples = self->num_samples;
+        site->derived = derived;
+        site->missing = missing;
+        if (copy) {
+            stored = tsk_blkalloc_get(&self->allocator,
+                (missing != NULL ? 2 : 1) * num_words * sizeof(uint64_t));
+            if (stored == NULL) {
+                ret = TSI_ERR_NO_MEMORY;
+                goto out;
+            }
+            memcpy(stored, derived, num_words * sizeof(uint64_t));
+            site->derived = stored;
+            if (missing != NULL) {
+                memcpy(stored + num_words, missing, num_words * sizeof(uint64_t));
+                site->missing = stored + num_words;
+            }
+        }
+        map_elem->derived = site->derived;
+        map_elem->missing = site->missing;
+        map_elem->hash = search.hash;
+        map_elem->num_words = num_words;
         map_elem->sites = NULL;
         map_elem->num_sites = 0;
-        avl_node = avl_insert_node(pattern_map, avl_node);
-        assert(avl_node != NULL);
-        if (site->genotypes == NULL) {
-            ret = TSI_ERR_NO_MEMORY;
-            goto out;
-        }
+        map_elem->next = *bucket;
+        *bucket = map_elem;
+        time_map->num_patterns++;
     } else {
-        map_elem = (pattern_map_t *) avl_node->item;
-        site->genotypes = map_elem->genotypes;
+        site->derived = map_elem->derived;
+        site->missing = map_elem->missing;
     }
     map_elem->num_sites++;
 
@@ -470,34 +873,150 @@ out:
     return ret;
 }
 
+int WARN_UNUSED
+ancestor_builder_add_site(ancestor_builder_t *self, double time, allele_t *genotypes)
+{
+    int ret = 0;
+    bool has_missing;
+
+    if (self->num_sites == self->max_sites) {
+        ret = TSI_ERR_TOO_MANY_SITES;
+        goto out;
+    }
+    ret = ancestor_builder_pack_genotypes(self, genotypes, &has_missing);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = ancestor_builder_insert_site(self, time, self->genotype_buffer,
+        has_missing ? self->genotype_buffer + self->num_words : NULL, true);
+out:
+    return ret;
+}
+
+/* Adds the sites in the specified num_sites x num_samples genotype matrix that
+ * are marked in use_site and are suitable for inference, i.e., the derived
+ * allele is carried by more than one sample but not by all samples with known
+ * genotypes. On return, use_site is true for exactly those sites that were
+ * added. Sites with time TSI_TIME_UNSPECIFIED are given the frequency of the
+ * derived allele among the known genotypes as their time. */
+int WARN_UNUSED
+ancestor_builder_add_sites(ancestor_builder_t *self, size_t num_sites, double *time,
+    allele_t *genotypes, bool *use_site)
+{
+    int ret = 0;
+    size_t j, k, known, ancestral, derived;
+    const size_t num_samples = self->num_samples;
+    allele_t *restrict site_genotypes;
+    double site_time;
+
+    for (j = 0; j < num_sites; j++) {
+        if (!use_site[j]) {
+            continue;
+        }
+        site_genotypes = genotypes + j * num_samples;
+        known = 0;
+        ancestral = 0;
+        for (k = 0; k < num_samples; k++) {
+            known += site_genotypes[k] != TSK_MISSING_DATA;
+            ancestral += site_genotypes[k] == 0;
+        }
+        derived = known - ancestral;
+        use_site[j] = derived > 1 && derived < known;
+        if (use_site[j]) {
+            site_time = time[j];
+            if (site_time == TSI_TIME_UNSPECIFIED) {
+                site_time = (double) derived / (double) known;
+            }
+            ret = ancestor_builder_add_site(self, site_time, site_genotypes);
+            if (ret != 0) {
+                goto out;
+            }
+        }
+    }
+out:
+    return ret;
+}
+
+/* Adds the sites in the specified packed genotype matrix in the same way as
+ * ancestor_builder_add_sites. Each site is a row of 2 * num_words words,
+ * holding the derived bit-plane followed by the missing bit-plane. The
+ * builder refers to the rows directly rather than copying them, so the
+ * matrix must remain valid for the lifetime of the builder. This allows
+ * the genotypes to be held in a read-only memory mapped file. */
+int WARN_UNUSED
+ancestor_builder_add_packed_sites(ancestor_builder_t *self, size_t num_sites,
+    double *time, const uint64_t *genotypes, bool *use_site)
+{
+    int ret = 0;
+    size_t j, k, known, derived;
+    const size_t num_words = self->num_words;
+    const uint64_t last_word_mask
+        = self->num_samples % 64 == 0 ? ~0ULL : (1ULL << (self->num_samples % 64)) - 1;
+    const uint64_t *restrict site_derived;
+    const uint64_t *restrict site_missing;
+    uint64_t any_missing;
+    double site_time;
+
+    for (j = 0; j < num_sites; j++) {
+        if (!use_site[j]) {
+            continue;
+        }
+        site_derived = genotypes + 2 * j * num_words;
+        site_missing = site_derived + num_words;
+        /* Bits beyond the last sample must be zero, and a sample cannot be
+         * both derived and missing. */
+        if (((site_derived[num_words - 1] | site_missing[num_words - 1])
+                & ~last_word_mask)
+            != 0) {
+            ret = TSI_ERR_BAD_GENOTYPE;
+            goto out;
+        }
+        derived = 0;
+        known = self->num_samples;
+        any_missing = 0;
+        for (k = 0; k < num_words; k++) {
+            if ((site_derived[k] & site_missing[k]) != 0) {
+                ret = TSI_ERR_BAD_GENOTYPE;
+                goto out;
+            }
+            derived += popcount64(site_derived[k]);
+            known -= popcount64(site_missing[k]);
+            any_missing |= site_missing[k];
+        }
+        use_site[j] = derived > 1 && derived < known;
+        if (use_site[j]) {
+            site_time = time[j];
+            if (site_time == TSI_TIME_UNSPECIFIED) {
+                site_time = (double) derived / (double) known;
+            }
+            ret = ancestor_builder_insert_site(self, site_time, site_derived,
+                any_missing != 0 ? site_missing : NULL, false);
+            if (ret != 0) {
+                goto out;
+            }
+        }
+    }
+out:
+    return ret;
+}
+
 /* Returns true if we should break the an ancestor that spans from focal
  * site a to focal site b */
 static bool
-ancestor_builder_break_ancestor(ancestor_builder_t *self, tsk_id_t a, tsk_id_t b,
-    tsk_id_t *restrict samples, size_t num_samples)
+ancestor_builder_break_ancestor(
+    ancestor_builder_t *self, tsk_id_t a, tsk_id_t b, const sample_set_t *samples)
 {
     bool ret = false;
-    tsk_id_t j, k;
-    size_t ones, missing;
-
-    for (j = a + 1; j < b && !ret; j++) {
-        if (self->sites[j].time > self->sites[a].time) {
-            ones = 0;
-            missing = 0;
-            for (k = 0; k < (tsk_id_t) num_samples; k++) {
-                switch (self->sites[j].genotypes[samples[k]]) {
-                    case TSK_MISSING_DATA:
-                        missing++;
-                        break;
-                    case 1:
-                        ones++;
-                        break;
-                }
-            }
-            if (ones != (num_samples - missing) && ones != 0) {
-                ret = true;
-            }
+    int64_t j = a;
+    size_t ones, zeros;
+
+    while (!ret) {
+        j = ancestor_builder_next_older_site(self, j, +1, self->sites[a].time);
+        if (j >= b) {
+            break;
         }
+        ancestor_builder_count_alleles(self, (tsk_id_t) j, samples, &ones, &zeros);
+        ret = ones != 0 && zeros != 0;
     }
     return ret;
 }
@@ -506,28 +1025,44 @@ int
 ancestor_builder_finalise(ancestor_builder_t *self)
 {
     int ret = 0;
-    size_t j, num_consistent_samples;
-    avl_node_t *a, *b;
+    size_t j, k, num_patterns;
+    avl_node_t *a;
     pattern_map_t *pattern_map;
     time_map_t *time_map;
     site_list_t *s;
     ancestor_descriptor_t *descriptor;
     tsk_id_t *focal_sites = NULL;
     tsk_id_t *p;
-    tsk_id_t *consistent_samples = malloc(self->num_samples * sizeof(tsk_id_t));
+    sample_set_t consistent_samples;
+    /* There cannot be more patterns in a time map than there are sites */
+    pattern_map_t *patterns = malloc(TSK_MAX(1, self->num_sites) * sizeof(*patterns));
 
-    if (consistent_samples == NULL) {
+    ret = sample_set_alloc(&consistent_samples, self->num_words);
+    if (ret != 0) {
+        goto out;
+    }
+    if (patterns == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    num_consistent_samples = 0; /* Keep the compiler happy */
     self->num_ancestors = 0;
 
     /* Return the descriptors in *reverse* order */
     for (a = self->time_map.tail; a != NULL; a = a->prev) {
         time_map = (time_map_t *) a->item;
-        for (b = time_map->pattern_map.head; b != NULL; b = b->next) {
-            pattern_map = (pattern_map_t *) b->item;
+        /* Sort the patterns so that the descriptor order is deterministic */
+        num_patterns = 0;
+        for (k = 0; k < time_map->num_buckets; k++) {
+            for (pattern_map = time_map->buckets[k]; pattern_map != NULL;
+                 pattern_map = pattern_map->next) {
+                patterns[num_patterns] = *pattern_map;
+                num_patterns++;
+            }
+        }
+        assert(num_patterns == time_map->num_patterns);
+        qsort(patterns, num_patterns, sizeof(*patterns), cmp_pattern_map);
+        for (k = 0; k < num_patterns; k++) {
+            pattern_map = &patterns[k];
             descriptor = self->descriptors + self->num_ancestors;
             self->num_ancestors++;
             descriptor->time = time_map->time;
@@ -548,12 +1083,11 @@ ancestor_builder_finalise(ancestor_builder_t *self)
              * further */
             if (pattern_map->num_sites > 1) {
                 ancestor_builder_get_consistent_samples(
-                    self, focal_sites[0], consistent_samples, &num_consistent_samples);
+                    self, focal_sites[0], &consistent_samples);
             }
             for (j = 0; j < pattern_map->num_sites - 1; j++) {
                 if (ancestor_builder_break_ancestor(self, focal_sites[j],
-                        focal_sites[j + 1], consistent_samples,
-                        num_consistent_samples)) {
+                        focal_sites[j + 1], &consistent_samples)) {
                     p = focal_sites + j + 1;
                     descriptor->num_focal_sites = (size_t)(p - descriptor->focal_sites);
                     descriptor = self->descriptors + self->num_ancestors;
@@ -566,6 +1100,7 @@ ancestor_builder_finalise(ancestor_builder_t *self)
         }
     }
 out:
-    tsi_safe_free(consistent_samples);
+    sample_set_free(&consistent_samples);
+    tsi_safe_free(patterns);
     return ret;
 }
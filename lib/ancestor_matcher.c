@@ -28,37 +28,87 @@
 
 /* TODO Remove this when a tskit C api with this included is released. */
 
-/* Rounds the specified double to the closest multiple of 10**-num_digits. If
- * num_digits > 22, return value without changes. This is intended for use with
- * small positive numbers; behaviour with large inputs has not been considered.
+/* Rounds the specified double to the closest multiple of 1 / pow1, where pow1 is
+ * 10**num_digits. This is intended for use with small positive numbers;
+ * behaviour with large inputs has not been considered.
  *
  * Based on double_round from the Python standard library
  * https://github.com/python/cpython/blob/master/Objects/floatobject.c#L985
  */
-static double
-tsk_round(double x, unsigned int ndigits)
+static inline double
+tsk_round(double x, double pow1)
 {
-    double pow1, y, z;
+    double y, z;
 
-    z = x;
-    if (ndigits < 22) {
-        pow1 = pow(10.0, (double) ndigits);
-        y = x * pow1;
-        z = round(y);
-        if (fabs(y - z) == 0.5) {
-            /* halfway between two integers; use round-half-even */
-            z = 2.0 * round(y / 2.0);
-        }
-        z = z / pow1;
+    y = x * pow1;
+    z = round(y);
+    if (fabs(y - z) == 0.5) {
+        /* halfway between two integers; use round-half-even */
+        z = 2.0 * round(y / 2.0);
     }
-    return z;
+    return z / pow1;
 }
 
 static inline bool
 is_nonzero_root(const tsk_id_t u, const tsk_id_t *restrict parent,
-    const tsk_id_t *restrict left_child)
+    const int32_t *restrict num_children)
+{
+    return u != 0 && parent[u] == NULL_NODE && num_children[u] == 0;
+}
+
+/* Returns the node holding the likelihood of the path up to u, where the
+ * likelihood of u is not NULL_LIKELIHOOD: this is u, unless its likelihood
+ * is cached. */
+static inline tsk_id_t
+get_likelihood_node(const tsk_id_t u, const double *restrict L)
+{
+    return L[u] <= CACHED_LIKELIHOOD ? (tsk_id_t)(CACHED_LIKELIHOOD - L[u]) : u;
+}
+
+/* Writes x as a varint at p, returning the position after it. */
+static inline uint8_t *
+varint_encode(uint32_t x, uint8_t *restrict p)
+{
+    while (x >= 0x80) {
+        *p = (uint8_t)(x | 0x80);
+        x >>= 7;
+        p++;
+    }
+    *p = (uint8_t) x;
+    return p + 1;
+}
+
+/* Reads a varint from p into x, returning the position after it. */
+static inline const uint8_t *
+varint_decode(const uint8_t *restrict p, uint32_t *x)
+{
+    uint32_t value = 0;
+    unsigned int shift = 0;
+
+    while (*p & 0x80) {
+        value |= (uint32_t)(*p & 0x7f) << shift;
+        shift += 7;
+        p++;
+    }
+    *x = value | ((uint32_t) *p << shift);
+    return p + 1;
+}
+
+void
+node_state_list_decode(
+    const node_state_list_t *self, tsk_id_t *node, int8_t *recombination_required)
 {
-    return u != 0 && parent[u] == NULL_NODE && left_child[u] == NULL_NODE;
+    const uint8_t *p = self->data;
+    uint32_t key, delta;
+    int j;
+
+    key = 0;
+    for (j = 0; j < self->size; j++) {
+        p = varint_decode(p, &delta);
+        key += delta;
+        node[j] = (tsk_id_t)(key >> 1);
+        recombination_required[j] = (int8_t)(key & 1);
+    }
 }
 
 static void
@@ -79,7 +129,7 @@ ancestor_matcher_check_state(ancestor_matcher_t *self)
         if (self->likelihood[u] >= 0) {
             num_likelihoods++;
         }
-        if (is_nonzero_root(u, self->parent, self->left_child)) {
+        if (is_nonzero_root(u, self->parent, self->num_children)) {
             assert(self->likelihood[u] == NONZERO_ROOT_LIKELIHOOD);
         }
         assert(self->allelic_state[u] == TSK_NULL);
@@ -87,11 +137,53 @@ ancestor_matcher_check_state(ancestor_matcher_t *self)
     assert(num_likelihoods == self->num_likelihood_nodes);
 }
 
+/* Checks that the likelihoods of the current haplotype can be restored from a
+ * checkpoint: apart from the likelihood nodes, nodes in the tree have a NULL
+ * likelihood and all other nodes are marked as non-zero roots. */
+static void
+ancestor_matcher_check_checkpoint_state(ancestor_matcher_t *self)
+{
+    tsk_id_t u;
+
+    for (u = 0; u < (tsk_id_t) self->num_nodes; u++) {
+        if (self->likelihood[u] < 0) {
+            if (self->parent[u] != NULL_NODE) {
+                assert(self->likelihood[u] == NULL_LIKELIHOOD);
+            } else {
+                assert(self->likelihood[u] == NONZERO_ROOT_LIKELIHOOD);
+            }
+        }
+    }
+}
+
+/* Checks that the per-node state has been restored after a call to find_path */
+static void
+ancestor_matcher_check_reset_state(ancestor_matcher_t *self)
+{
+    size_t u, k;
+    const haplotype_state_t *state;
+
+    for (k = 0; k < self->batch.max_size; k++) {
+        state = &self->batch.state[k];
+        for (u = 0; u < self->num_nodes; u++) {
+            assert(state->likelihood[u] == NONZERO_ROOT_LIKELIHOOD);
+        }
+    }
+    for (u = 0; u < self->num_nodes; u++) {
+        assert(self->parent[u] == NULL_NODE);
+        assert(self->num_children[u] == 0);
+        assert(self->recombination_required[u] == -1);
+        assert(self->allelic_state[u] == TSK_NULL);
+    }
+}
+
 int
 ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out)
 {
     int j, k;
     tsk_id_t u;
+    tsk_id_t *node;
+    int8_t *R;
 
     fprintf(out, "Ancestor matcher state\n");
     fprintf(out, "site\trecomb_rate\tmut_rate\n");
@@ -100,11 +192,11 @@ ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out)
             out, "%d\t%f\t%f\n", j, self->recombination_rate[j], self->mismatch_rate[j]);
     }
     fprintf(out, "tree = \n");
-    fprintf(out, "id\tparent\tlchild\trchild\tlsib\trsib\tlikelihood\n");
+    fprintf(out, "root = %d\n", self->root);
+    fprintf(out, "id\tparent\tnum_children\tlikelihood\n");
     for (j = 0; j < (int) self->num_nodes; j++) {
-        fprintf(out, "%d\t%d\t%d\t%d\t%d\t%d\t%f\n", (int) j, self->parent[j],
-            self->left_child[j], self->right_child[j], self->left_sib[j],
-            self->right_sib[j], self->likelihood[j]);
+        fprintf(out, "%d\t%d\t%d\t%f\n", (int) j, self->parent[j],
+            self->num_children[j], self->likelihood[j]);
     }
     fprintf(out, "likelihood nodes\n");
     /* Check the properties of the likelihood map */
@@ -116,10 +208,16 @@ ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out)
     for (j = 0; j < (int) self->num_sites; j++) {
         fprintf(out, "\t%d:%d (%d)\t", (int) j, self->max_likelihood_node[j],
             self->traceback[j].size);
-        for (k = 0; k < self->traceback[j].size; k++) {
-            fprintf(out, "(%d, %d)", self->traceback[j].node[k],
-                self->traceback[j].recombination_required[k]);
+        node = malloc((size_t) self->traceback[j].size * sizeof(*node) + 1);
+        R = malloc((size_t) self->traceback[j].size * sizeof(*R) + 1);
+        if (node != NULL && R != NULL) {
+            node_state_list_decode(&self->traceback[j], node, R);
+            for (k = 0; k < self->traceback[j].size; k++) {
+                fprintf(out, "(%d, %d)", node[k], R[k]);
+            }
         }
+        tsi_safe_free(node);
+        tsi_safe_free(R);
         fprintf(out, "\n");
     }
     tsk_blkalloc_print_state(&self->traceback_allocator, out);
@@ -128,42 +226,295 @@ ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out)
     return 0;
 }
 
+static inline void
+ancestor_matcher_load_haplotype(ancestor_matcher_t *self, size_t k)
+{
+    const haplotype_state_t *state = &self->batch.state[k];
+
+    self->likelihood = state->likelihood;
+    self->likelihood_nodes = state->likelihood_nodes;
+    self->num_likelihood_nodes = state->num_likelihood_nodes;
+    self->max_likelihood_node = state->max_likelihood_node;
+    self->traceback = state->traceback;
+    self->output.left = state->output.left;
+    self->output.right = state->output.right;
+    self->output.parent = state->output.parent;
+    self->output.size = state->output.size;
+    self->batch.current = k;
+}
+
+static inline void
+ancestor_matcher_save_haplotype(ancestor_matcher_t *self)
+{
+    haplotype_state_t *state = &self->batch.state[self->batch.current];
+
+    state->num_likelihood_nodes = self->num_likelihood_nodes;
+    state->output.size = self->output.size;
+}
+
+/* Makes haplotype k in the batch the current haplotype. */
+static inline void
+ancestor_matcher_select_haplotype(ancestor_matcher_t *self, size_t k)
+{
+    if (k != self->batch.current) {
+        ancestor_matcher_save_haplotype(self);
+        ancestor_matcher_load_haplotype(self, k);
+    }
+}
+
+/* Returns the number of bytes per node in the node arrays shared by the batch. */
+static size_t
+ancestor_matcher_get_node_size(ancestor_matcher_t *self)
+{
+    return sizeof(*self->parent) + sizeof(*self->num_children)
+           + sizeof(*self->recombination_required) + sizeof(*self->allelic_state);
+}
+
+/* Returns the number of bytes per node in the node arrays of each haplotype. */
+static size_t
+ancestor_matcher_get_haplotype_node_size(ancestor_matcher_t *self)
+{
+    return sizeof(*self->likelihood) + sizeof(*self->likelihood_nodes);
+}
+
+/* Returns the number of bytes used by the state of each haplotype in the batch. */
+static size_t
+ancestor_matcher_get_haplotype_size(ancestor_matcher_t *self)
+{
+    return sizeof(haplotype_state_t)
+           + self->max_nodes * ancestor_matcher_get_haplotype_node_size(self)
+           + self->num_sites
+                 * (sizeof(*self->traceback) + sizeof(*self->max_likelihood_node))
+           + self->output.max_size * 3 * sizeof(tsk_id_t);
+}
+
+/* Returns the number of bytes used to store the likelihood checkpoints. */
+static size_t
+ancestor_matcher_get_checkpoint_memory(ancestor_matcher_t *self)
+{
+    return self->likelihood_checkpoints.max_size
+               * (sizeof(*self->likelihood_checkpoints.offset)
+                     + sizeof(*self->likelihood_checkpoints.num_likelihood_nodes)
+                     + sizeof(*self->likelihood_checkpoints.last_root))
+           + self->likelihood_checkpoints.max_values
+                 * (sizeof(*self->likelihood_checkpoints.node)
+                       + sizeof(*self->likelihood_checkpoints.likelihood));
+}
+
+static size_t
+ancestor_matcher_get_memory(ancestor_matcher_t *self, size_t traceback_size)
+{
+    size_t site_state_size = sizeof(*self->site_state.likelihood)
+                             + sizeof(*self->site_state.allelic_state)
+                             + sizeof(*self->site_state.recombination_required)
+                             + sizeof(*self->traceback_keys)
+                             + 5 * sizeof(*self->traceback_buffer);
+
+    return traceback_size + self->max_nodes * ancestor_matcher_get_node_size(self)
+           + self->site_state.max_size * site_state_size
+           + self->batch.max_size * ancestor_matcher_get_haplotype_size(self)
+           + self->traceback_lists.max_size
+                 * (sizeof(*self->traceback_lists.slot_generation)
+                       + sizeof(*self->traceback_lists.hash)
+                       + sizeof(*self->traceback_lists.list))
+           + ancestor_matcher_get_checkpoint_memory(self)
+           + self->num_sites * 2 * sizeof(double);
+}
+
+/* Returns TSI_ERR_MATCHER_MEMORY_LIMIT if allocating another num_bytes would take
+ * us over the memory limit. The traceback is counted by the size of the blocks
+ * reserved by its allocator rather than the bytes handed out from them. */
+static int WARN_UNUSED
+ancestor_matcher_check_memory(ancestor_matcher_t *self, size_t num_bytes)
+{
+    int ret = 0;
+
+    if (self->max_memory > 0
+        && ancestor_matcher_get_memory(self, self->traceback_allocator.total_size)
+                   + num_bytes
+               > self->max_memory) {
+        ret = TSI_ERR_MATCHER_MEMORY_LIMIT;
+    }
+    return ret;
+}
+
+/* Checks that the traceback allocator can hand out num_bytes within the memory
+ * limit. This only costs memory when the allocator must reserve a new block. */
+static int WARN_UNUSED
+ancestor_matcher_check_traceback_memory(ancestor_matcher_t *self, size_t num_bytes)
+{
+    int ret = 0;
+    const tsk_blkalloc_t *allocator = &self->traceback_allocator;
+
+    if (self->max_memory > 0 && num_bytes > allocator->chunk_size) {
+        ret = TSI_ERR_MATCHER_MEMORY_LIMIT;
+    } else if (allocator->top + num_bytes > allocator->chunk_size
+               && allocator->current_chunk + 1 == allocator->num_chunks) {
+        ret = ancestor_matcher_check_memory(self, allocator->chunk_size);
+    }
+    return ret;
+}
+
+/* Grows the per-node arrays of the specified haplotype in place to max_nodes. */
+static int WARN_UNUSED
+ancestor_matcher_expand_haplotype_nodes(haplotype_state_t *state, size_t max_nodes)
+{
+    int ret = 0;
+    void *tmp;
+
+    tmp = realloc(state->likelihood, max_nodes * sizeof(*state->likelihood));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    state->likelihood = tmp;
+    tmp = realloc(state->likelihood_nodes, max_nodes * sizeof(*state->likelihood_nodes));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    state->likelihood_nodes = tmp;
+out:
+    return ret;
+}
+
+static void
+ancestor_matcher_free_haplotype(haplotype_state_t *state)
+{
+    tsi_safe_free(state->likelihood);
+    tsi_safe_free(state->likelihood_nodes);
+    tsi_safe_free(state->max_likelihood_node);
+    tsi_safe_free(state->traceback);
+    tsi_safe_free(state->output.left);
+    tsi_safe_free(state->output.right);
+    tsi_safe_free(state->output.parent);
+}
+
+static int WARN_UNUSED
+ancestor_matcher_alloc_haplotype(ancestor_matcher_t *self, haplotype_state_t *state)
+{
+    int ret = 0;
+    size_t u;
+
+    memset(state, 0, sizeof(*state));
+    state->traceback = calloc(self->num_sites, sizeof(*state->traceback));
+    state->max_likelihood_node
+        = malloc(self->num_sites * sizeof(*state->max_likelihood_node));
+    state->output.left = malloc(self->output.max_size * sizeof(tsk_id_t));
+    state->output.right = malloc(self->output.max_size * sizeof(tsk_id_t));
+    state->output.parent = malloc(self->output.max_size * sizeof(tsk_id_t));
+    if (state->traceback == NULL || state->max_likelihood_node == NULL
+        || state->output.left == NULL || state->output.right == NULL
+        || state->output.parent == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    memset(state->max_likelihood_node, 0xff,
+        self->num_sites * sizeof(*state->max_likelihood_node));
+    /* Otherwise, the node arrays are allocated by expand_nodes */
+    if (self->max_nodes > 0) {
+        ret = ancestor_matcher_expand_haplotype_nodes(state, self->max_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+        for (u = 0; u < self->num_nodes; u++) {
+            state->likelihood[u] = NONZERO_ROOT_LIKELIHOOD;
+        }
+    }
+out:
+    return ret;
+}
+
+/* Ensures that we have the state for at least max_size haplotypes. */
+static int WARN_UNUSED
+ancestor_matcher_expand_batch(ancestor_matcher_t *self, size_t max_size)
+{
+    int ret = 0;
+    size_t k;
+    void *p;
+
+    if (max_size <= self->batch.max_size) {
+        goto out;
+    }
+    ret = ancestor_matcher_check_memory(self,
+        (max_size - self->batch.max_size) * ancestor_matcher_get_haplotype_size(self));
+    if (ret != 0) {
+        goto out;
+    }
+    p = realloc(self->batch.state, max_size * sizeof(*self->batch.state));
+    if (p == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->batch.state = p;
+    for (k = self->batch.max_size; k < max_size; k++) {
+        ret = ancestor_matcher_alloc_haplotype(self, &self->batch.state[k]);
+        if (ret != 0) {
+            ancestor_matcher_free_haplotype(&self->batch.state[k]);
+            goto out;
+        }
+        self->batch.max_size = k + 1;
+    }
+out:
+    return ret;
+}
+
 int
 ancestor_matcher_alloc(ancestor_matcher_t *self,
     tree_sequence_builder_t *tree_sequence_builder, double *recombination_rate,
-    double *mismatch_rate, unsigned int precision, int flags)
+    double *mismatch_rate, unsigned int precision, size_t max_memory, int flags)
 {
     int ret = 0;
     /* TODO make these input parameters. */
     size_t traceback_block_size = 64 * 1024 * 1024;
+    size_t min_traceback_block_size = 4096;
+    size_t traceback_lists_size = 1024;
 
     memset(self, 0, sizeof(ancestor_matcher_t));
     /* All allocs for arrays related to nodes are done in expand_nodes */
     self->flags = flags;
     self->precision = precision;
     self->max_nodes = 0;
+    self->max_memory = max_memory;
     self->tree_sequence_builder = tree_sequence_builder;
     self->num_sites = tree_sequence_builder->num_sites;
     self->recombination_rate
         = malloc(self->num_sites * sizeof(*self->recombination_rate));
     self->mismatch_rate = malloc(self->num_sites * sizeof(*self->mismatch_rate));
     self->output.max_size = self->num_sites; /* We can probably make this smaller */
-    self->traceback = calloc(self->num_sites, sizeof(node_state_list_t));
-    self->max_likelihood_node = malloc(self->num_sites * sizeof(tsk_id_t));
-    self->output.left = malloc(self->output.max_size * sizeof(tsk_id_t));
-    self->output.right = malloc(self->output.max_size * sizeof(tsk_id_t));
-    self->output.parent = malloc(self->output.max_size * sizeof(tsk_id_t));
+    self->traceback_lists.max_size = traceback_lists_size;
+    self->traceback_lists.generation = 1;
+    self->traceback_lists.slot_generation
+        = calloc(traceback_lists_size, sizeof(*self->traceback_lists.slot_generation));
+    self->traceback_lists.hash
+        = malloc(traceback_lists_size * sizeof(*self->traceback_lists.hash));
+    self->traceback_lists.list
+        = malloc(traceback_lists_size * sizeof(*self->traceback_lists.list));
     if (self->recombination_rate == NULL || self->mismatch_rate == NULL
-        || self->traceback == NULL || self->max_likelihood_node == NULL
-        || self->output.left == NULL || self->output.right == NULL
-        || self->output.parent == NULL) {
+        || self->traceback_lists.slot_generation == NULL
+        || self->traceback_lists.hash == NULL || self->traceback_lists.list == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
+    ret = ancestor_matcher_expand_batch(self, 1);
+    if (ret != 0) {
+        goto out;
+    }
+    ancestor_matcher_load_haplotype(self, 0);
+    /* With a memory limit, the traceback blocks are a small fraction of it so
+     * that the unused part of the last block doesn't take us over. */
+    if (max_memory > 0) {
+        traceback_block_size = TSK_MIN(
+            traceback_block_size, TSK_MAX(max_memory / 16, min_traceback_block_size));
+    }
     ret = tsk_blkalloc_init(&self->traceback_allocator, traceback_block_size);
     if (ret != 0) {
         goto out;
     }
+    ret = ancestor_matcher_check_memory(self, 0);
+    if (ret != 0) {
+        goto out;
+    }
     memcpy(self->recombination_rate, recombination_rate,
         self->num_sites * sizeof(*self->recombination_rate));
     memcpy(self->mismatch_rate, mismatch_rate,
@@ -175,124 +526,243 @@ out:
 int
 ancestor_matcher_free(ancestor_matcher_t *self)
 {
+    size_t k;
+
+    for (k = 0; k < self->batch.max_size; k++) {
+        ancestor_matcher_free_haplotype(&self->batch.state[k]);
+    }
+    tsi_safe_free(self->batch.state);
     tsi_safe_free(self->recombination_rate);
     tsi_safe_free(self->mismatch_rate);
     tsi_safe_free(self->parent);
-    tsi_safe_free(self->left_child);
-    tsi_safe_free(self->right_child);
-    tsi_safe_free(self->left_sib);
-    tsi_safe_free(self->right_sib);
+    tsi_safe_free(self->num_children);
     tsi_safe_free(self->recombination_required);
-    tsi_safe_free(self->likelihood);
-    tsi_safe_free(self->likelihood_cache);
-    tsi_safe_free(self->likelihood_nodes);
-    tsi_safe_free(self->likelihood_nodes_tmp);
     tsi_safe_free(self->allelic_state);
-    tsi_safe_free(self->max_likelihood_node);
-    tsi_safe_free(self->traceback);
-    tsi_safe_free(self->output.left);
-    tsi_safe_free(self->output.right);
-    tsi_safe_free(self->output.parent);
+    tsi_safe_free(self->site_state.likelihood);
+    tsi_safe_free(self->site_state.allelic_state);
+    tsi_safe_free(self->site_state.recombination_required);
+    tsi_safe_free(self->traceback_keys);
+    tsi_safe_free(self->traceback_buffer);
+    tsi_safe_free(self->traceback_lists.slot_generation);
+    tsi_safe_free(self->traceback_lists.hash);
+    tsi_safe_free(self->traceback_lists.list);
+    tsi_safe_free(self->likelihood_checkpoints.offset);
+    tsi_safe_free(self->likelihood_checkpoints.num_likelihood_nodes);
+    tsi_safe_free(self->likelihood_checkpoints.last_root);
+    tsi_safe_free(self->likelihood_checkpoints.node);
+    tsi_safe_free(self->likelihood_checkpoints.likelihood);
     tsk_blkalloc_free(&self->traceback_allocator);
     return 0;
 }
 
-static int
-ancestor_matcher_delete_likelihood(
-    ancestor_matcher_t *self, const tsk_id_t node, double *restrict L)
+/* Removes the num_removed nodes whose likelihoods have been marked as nonzero
+ * roots from the list of likelihood nodes, keeping the remaining nodes in order.
+ * Removals are batched so that we only go through the list once per tree
+ * transition, however many roots leave the tree. */
+static void
+ancestor_matcher_remove_likelihood_nodes(
+    ancestor_matcher_t *self, const double *restrict L, int num_removed)
 {
-    /* Remove the specified node from the list of nodes */
     int j, k;
     tsk_id_t *restrict L_nodes = self->likelihood_nodes;
 
     k = 0;
     for (j = 0; j < self->num_likelihood_nodes; j++) {
         L_nodes[k] = L_nodes[j];
-        if (L_nodes[j] != node) {
+        if (L[L_nodes[j]] >= 0) {
             k++;
         }
     }
-    assert(self->num_likelihood_nodes == k + 1);
-    self->num_likelihood_nodes = k;
-    L[node] = NULL_LIKELIHOOD;
-    return 0;
+    assert(k == self->num_likelihood_nodes - num_removed);
+    self->num_likelihood_nodes -= num_removed;
+}
+
+static int
+cmp_uint32(const void *a, const void *b)
+{
+    const uint32_t *ia = (const uint32_t *) a;
+    const uint32_t *ib = (const uint32_t *) b;
+    return (*ia > *ib) - (*ia < *ib);
+}
+
+static int WARN_UNUSED
+ancestor_matcher_expand_traceback_lists(ancestor_matcher_t *self)
+{
+    int ret = 0;
+    size_t j, k, mask;
+    size_t max_size = 2 * self->traceback_lists.max_size;
+    uint32_t generation = self->traceback_lists.generation;
+    uint32_t *slot_generation = NULL;
+    uint32_t *hash = NULL;
+    node_state_list_t *list = NULL;
+
+    ret = ancestor_matcher_check_memory(self,
+        self->traceback_lists.max_size
+            * (sizeof(*slot_generation) + sizeof(*hash) + sizeof(*list)));
+    if (ret != 0) {
+        goto out;
+    }
+    slot_generation = calloc(max_size, sizeof(*slot_generation));
+    hash = malloc(max_size * sizeof(*hash));
+    list = malloc(max_size * sizeof(*list));
+    if (slot_generation == NULL || hash == NULL || list == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    mask = max_size - 1;
+    for (j = 0; j < self->traceback_lists.max_size; j++) {
+        if (self->traceback_lists.slot_generation[j] == generation) {
+            k = self->traceback_lists.hash[j] & mask;
+            while (slot_generation[k] == generation) {
+                k = (k + 1) & mask;
+            }
+            slot_generation[k] = generation;
+            hash[k] = self->traceback_lists.hash[j];
+            list[k] = self->traceback_lists.list[j];
+        }
+    }
+    tsi_safe_free(self->traceback_lists.slot_generation);
+    tsi_safe_free(self->traceback_lists.hash);
+    tsi_safe_free(self->traceback_lists.list);
+    self->traceback_lists.slot_generation = slot_generation;
+    self->traceback_lists.hash = hash;
+    self->traceback_lists.list = list;
+    self->traceback_lists.max_size = max_size;
+    slot_generation = NULL;
+    hash = NULL;
+    list = NULL;
+out:
+    tsi_safe_free(slot_generation);
+    tsi_safe_free(hash);
+    tsi_safe_free(list);
+    return ret;
 }
 
-/* Store the recombination_required state in the traceback */
+/* Store the recombination_required state in the traceback. Each list is stored
+ * as the sorted (node << 1) | R keys, delta and varint encoded, and identical
+ * lists within a call to find_paths share the same storage. */
 static int WARN_UNUSED
 ancestor_matcher_store_traceback(ancestor_matcher_t *self, const tsk_id_t site_id)
 {
     int ret = 0;
-    tsk_id_t u;
     int j;
-    int8_t *restrict list_R;
-    tsk_id_t *restrict list_node;
+    size_t k, mask, num_bytes;
+    uint32_t key, prev, h;
+    uint8_t *restrict p;
+    uint8_t *data;
     node_state_list_t *restrict list;
     node_state_list_t *restrict T = self->traceback;
+    uint32_t *restrict keys = self->traceback_keys;
+    uint8_t *restrict buffer = self->traceback_buffer;
     const tsk_id_t *restrict nodes = self->likelihood_nodes;
-    const int8_t *restrict R = self->recombination_required;
+    const int8_t *restrict R = self->site_state.recombination_required;
     const int num_likelihood_nodes = self->num_likelihood_nodes;
-    bool match;
-
-    /* Check to see if the previous site has the same recombination_required. If so,
-     * we can reuse the same list. */
-    match = false;
-    if (site_id > 0) {
-        list = &T[site_id - 1];
-        if (list->size == num_likelihood_nodes) {
-            list_node = list->node;
-            list_R = list->recombination_required;
-            match = true;
-            for (j = 0; j < num_likelihood_nodes; j++) {
-                if (list_node[j] != nodes[j] || list_R[j] != R[nodes[j]]) {
-                    match = false;
-                    break;
-                }
+    const uint32_t generation = self->traceback_lists.generation;
+
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        keys[j] = ((uint32_t) nodes[j] << 1) | (uint32_t)(R[j] != 0);
+    }
+    /* The lists are usually short, so insertion sort wins for these. */
+    if (num_likelihood_nodes <= 32) {
+        for (j = 1; j < num_likelihood_nodes; j++) {
+            key = keys[j];
+            k = (size_t) j;
+            while (k > 0 && keys[k - 1] > key) {
+                keys[k] = keys[k - 1];
+                k--;
             }
+            keys[k] = key;
         }
+    } else {
+        qsort(keys, (size_t) num_likelihood_nodes, sizeof(*keys), cmp_uint32);
+    }
+    /* Encode and compute the FNV-1a hash of the encoded bytes */
+    p = buffer;
+    prev = 0;
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        p = varint_encode(keys[j] - prev, p);
+        prev = keys[j];
+    }
+    num_bytes = (size_t)(p - buffer);
+    h = 2166136261u;
+    for (k = 0; k < num_bytes; k++) {
+        h = (h ^ buffer[k]) * 16777619u;
     }
 
-    if (match) {
-        T[site_id].size = T[site_id - 1].size;
-        T[site_id].node = T[site_id - 1].node;
-        T[site_id].recombination_required = T[site_id - 1].recombination_required;
-    } else {
-        list_node = tsk_blkalloc_get(&self->traceback_allocator,
-            (size_t) num_likelihood_nodes * sizeof(tsk_id_t));
-        list_R = tsk_blkalloc_get(
-            &self->traceback_allocator, (size_t) num_likelihood_nodes * sizeof(int8_t));
-        if (list_node == NULL || list_R == NULL) {
-            ret = TSI_ERR_NO_MEMORY;
+    /* Look for an identical list stored earlier in this call. */
+    mask = self->traceback_lists.max_size - 1;
+    k = h & mask;
+    while (self->traceback_lists.slot_generation[k] == generation) {
+        list = &self->traceback_lists.list[k];
+        if (self->traceback_lists.hash[k] == h && list->size == num_likelihood_nodes
+            && list->num_bytes == num_bytes
+            && memcmp(list->data, buffer, num_bytes) == 0) {
+            break;
+        }
+        k = (k + 1) & mask;
+    }
+    if (self->traceback_lists.slot_generation[k] != generation) {
+        /* Empty lists still need a distinct non-NULL pointer */
+        ret = ancestor_matcher_check_traceback_memory(self, TSK_MAX(num_bytes, 1));
+        if (ret != 0) {
             goto out;
         }
-        T[site_id].node = list_node;
-        T[site_id].recombination_required = list_R;
-        T[site_id].size = num_likelihood_nodes;
-        for (j = 0; j < num_likelihood_nodes; j++) {
-            u = nodes[j];
-            list_node[j] = u;
-            list_R[j] = R[u];
+        data = tsk_blkalloc_get(&self->traceback_allocator, TSK_MAX(num_bytes, 1));
+        if (data == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
         }
+        memcpy(data, buffer, num_bytes);
+        self->traceback_lists.slot_generation[k] = generation;
+        self->traceback_lists.hash[k] = h;
+        list = &self->traceback_lists.list[k];
+        list->size = num_likelihood_nodes;
+        list->num_bytes = (uint32_t) num_bytes;
+        list->data = data;
+        self->traceback_lists.size++;
+        self->stats.num_traceback_lists++;
+        self->stats.num_traceback_bytes += TSK_MAX(num_bytes, 1);
     }
+    T[site_id] = self->traceback_lists.list[k];
     self->total_traceback_size += (size_t) num_likelihood_nodes;
+    self->stats.num_traceback_sites++;
+    self->stats.num_traceback_nodes += (size_t) num_likelihood_nodes;
+    if (self->traceback_lists.size * 2 > self->traceback_lists.max_size) {
+        ret = ancestor_matcher_expand_traceback_lists(self);
+        if (ret != 0) {
+            goto out;
+        }
+    }
 out:
     return ret;
 }
 
+/* Returns true if there are no frozen mutations at the specified site. */
+static inline bool
+ancestor_matcher_site_has_no_mutations(ancestor_matcher_t *self, const tsk_id_t site)
+{
+    const size_t *restrict offset = self->tree_sequence_builder->frozen_mutations.offset;
+
+    return offset[site] == offset[site + 1];
+}
+
 /* Sets the specified allelic state array to reflect the mutations at the
  * specified site. */
 static inline void
 ancestor_matcher_set_allelic_state(
     ancestor_matcher_t *self, const tsk_id_t site, allele_t *restrict allelic_state)
 {
-    mutation_list_node_t *mutation;
+    const tree_sequence_builder_t *tsb = self->tree_sequence_builder;
+    const tsk_id_t *restrict node = tsb->frozen_mutations.node;
+    const allele_t *restrict derived_state = tsb->frozen_mutations.derived_state;
+    const size_t end = tsb->frozen_mutations.offset[site + 1];
+    size_t j;
 
     /* FIXME assuming that 0 is always the ancestral state */
     allelic_state[0] = 0;
 
-    for (mutation = self->tree_sequence_builder->sites.mutations[site]; mutation != NULL;
-         mutation = mutation->next) {
-        allelic_state[mutation->node] = mutation->derived_state;
+    for (j = tsb->frozen_mutations.offset[site]; j < end; j++) {
+        allelic_state[node[j]] = derived_state[j];
     }
 }
 
@@ -301,142 +771,247 @@ static inline void
 ancestor_matcher_unset_allelic_state(
     ancestor_matcher_t *self, const tsk_id_t site, allele_t *restrict allelic_state)
 {
-    mutation_list_node_t *mutation;
+    const tree_sequence_builder_t *tsb = self->tree_sequence_builder;
+    const tsk_id_t *restrict node = tsb->frozen_mutations.node;
+    const size_t end = tsb->frozen_mutations.offset[site + 1];
+    size_t j;
 
     allelic_state[0] = NULL_NODE;
-    for (mutation = self->tree_sequence_builder->sites.mutations[site]; mutation != NULL;
-         mutation = mutation->next) {
-        allelic_state[mutation->node] = TSK_NULL;
+    for (j = tsb->frozen_mutations.offset[site]; j < end; j++) {
+        allelic_state[node[j]] = TSK_NULL;
+    }
+}
+
+/* Ensures that the site_state buffers can hold at least size likelihood nodes. */
+static int WARN_UNUSED
+ancestor_matcher_expand_site_state(ancestor_matcher_t *self, size_t size)
+{
+    int ret = 0;
+    void *tmp;
+    size_t max_size = self->site_state.max_size;
+
+    if (size > max_size) {
+        max_size = TSK_MAX(size, 2 * max_size);
+        ret = ancestor_matcher_check_memory(self,
+            (max_size - self->site_state.max_size)
+                * (sizeof(double) + sizeof(allele_t) + sizeof(int8_t)
+                    + sizeof(uint32_t) + 5));
+        if (ret != 0) {
+            goto out;
+        }
+        tmp = realloc(self->site_state.likelihood, max_size * sizeof(double));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->site_state.likelihood = tmp;
+        tmp = realloc(self->site_state.allelic_state, max_size * sizeof(allele_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->site_state.allelic_state = tmp;
+        tmp = realloc(
+            self->site_state.recombination_required, max_size * sizeof(int8_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->site_state.recombination_required = tmp;
+        tmp = realloc(self->traceback_keys, max_size * sizeof(uint32_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->traceback_keys = tmp;
+        /* A varint of a uint32_t takes at most 5 bytes */
+        tmp = realloc(self->traceback_buffer, 5 * max_size);
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->traceback_buffer = tmp;
+        self->site_state.max_size = max_size;
     }
+out:
+    return ret;
 }
 
 static int WARN_UNUSED
 ancestor_matcher_update_site_likelihood_values(ancestor_matcher_t *self,
     const tsk_id_t site, const allele_t state, const tsk_id_t *restrict parent,
-    double *restrict L)
+    double *restrict L, bool *unchanged)
 {
     int ret = 0;
+    bool changed;
     const int num_likelihood_nodes = self->num_likelihood_nodes;
     const tsk_id_t *restrict L_nodes = self->likelihood_nodes;
     allele_t *restrict allelic_state = self->allelic_state;
-    int8_t *restrict recombination_required = self->recombination_required;
+    double *restrict X;
+    allele_t *restrict S;
+    int8_t *restrict R;
     int j;
     tsk_id_t u, v, max_L_node;
-    double max_L, p_last, p_no_recomb, p_recomb, p_t, p_e;
+    double max_L, p_no_recomb, p_t, p_e, pow1;
     const double rho = self->recombination_rate[site];
     const double mu = self->mismatch_rate[site];
     const double n = (double) self->tree_sequence_builder->num_nodes;
     const double num_alleles
         = (double) self->tree_sequence_builder->sites.num_alleles[site];
+    const double no_recomb_scale = 1 - rho + rho / n;
+    const double p_recomb = rho / n;
+    const double p_e_match = 1 - (num_alleles - 1) * mu;
 
     if (state >= num_alleles) {
         ret = TSI_ERR_BAD_HAPLOTYPE_ALLELE;
         goto out;
     }
-
-    ancestor_matcher_set_allelic_state(self, site, allelic_state);
-
-    max_L = -1;
-    max_L_node = NULL_NODE;
     assert(num_likelihood_nodes > 0);
-    /* printf("likelihoods for node=%d, n=%d\n", mutation_node,
-     * self->num_likelihood_nodes); */
+    ret = ancestor_matcher_expand_site_state(self, (size_t) num_likelihood_nodes);
+    if (ret != 0) {
+        goto out;
+    }
+    X = self->site_state.likelihood;
+    S = self->site_state.allelic_state;
+    R = self->site_state.recombination_required;
+
+    /* Gather the likelihood and allelic state of each likelihood node into the
+     * dense site_state buffers. This is the only pass that chases pointers
+     * through the tree; the remaining passes are straight-line loops over
+     * contiguous arrays that the compiler can vectorise. */
+    ancestor_matcher_set_allelic_state(self, site, allelic_state);
     for (j = 0; j < num_likelihood_nodes; j++) {
         u = L_nodes[j];
-        /* Get the allelic state at u. */
-        /* TODO we can cache the states here to save some time. One nice way we could
-         * do the caching is to save the L_node index in the allelic_state array as
-         * we traverse upwards, and then keep an array of the L_node states which
-         * we then look up. This would save a second upward traversal to mark the
-         * array after we've found the state value. */
+        /* Get the allelic state at u, and mark it on the nodes we pass on the
+         * way up so that later traversals stop there. Each node is therefore
+         * traversed at most twice per site. */
         v = u;
         while (allelic_state[v] == TSK_NULL) {
             v = parent[v];
         }
-        p_last = L[u];
-        p_no_recomb = p_last * (1 - rho + rho / n);
-        p_recomb = rho / n;
-        recombination_required[u] = false;
-        if (p_no_recomb > p_recomb) {
-            p_t = p_no_recomb;
-        } else {
-            p_t = p_recomb;
-            recombination_required[u] = true;
+        S[j] = allelic_state[v];
+        v = u;
+        while (allelic_state[v] == TSK_NULL) {
+            allelic_state[v] = S[j];
+            v = parent[v];
         }
-        p_e = mu;
-        if (allelic_state[v] == state || state == TSK_MISSING_DATA) {
-            p_e = 1 - (num_alleles - 1) * mu;
+        X[j] = L[u];
+    }
+    ancestor_matcher_unset_allelic_state(self, site, allelic_state);
+    /* With the mutation nodes unset, the marked nodes are the ones with a state
+     * on the way up from each likelihood node. */
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        v = L_nodes[j];
+        while (allelic_state[v] != TSK_NULL) {
+            allelic_state[v] = TSK_NULL;
+            v = parent[v];
         }
-        L[u] = p_t * p_e;
+    }
 
-        if (L[u] > max_L) {
-            max_L = L[u];
-            max_L_node = u;
-        }
+    max_L = -1;
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        p_no_recomb = X[j] * no_recomb_scale;
+        R[j] = p_no_recomb <= p_recomb;
+        p_t = p_no_recomb > p_recomb ? p_no_recomb : p_recomb;
+        p_e = S[j] == state || state == TSK_MISSING_DATA ? p_e_match : mu;
+        X[j] = p_t * p_e;
+        max_L = X[j] > max_L ? X[j] : max_L;
     }
-    /* ancestor_matcher_print_state(self, stdout); */
     if (max_L <= 0) {
         ret = TSI_ERR_MATCH_IMPOSSIBLE;
         goto out;
     }
+    /* The first node with the maximum likelihood */
+    max_L_node = NULL_NODE;
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        if (X[j] == max_L) {
+            max_L_node = L_nodes[j];
+            break;
+        }
+    }
     assert(max_L_node != NULL_NODE);
+    /* Recomputing a segment from a checkpoint must reproduce the forwards pass */
+    assert(self->max_likelihood_node[site] == NULL_NODE
+           || self->max_likelihood_node[site] == max_L_node);
     self->max_likelihood_node[site] = max_L_node;
 
-    /* Renormalise the likelihoods. */
+    /* Renormalise the likelihoods. If precision >= 22 we do not round. */
+    if (self->precision < 22) {
+        pow1 = pow(10.0, (double) self->precision);
+        for (j = 0; j < num_likelihood_nodes; j++) {
+            X[j] = tsk_round(X[j] / max_L, pow1);
+        }
+    } else {
+        for (j = 0; j < num_likelihood_nodes; j++) {
+            X[j] = X[j] / max_L;
+        }
+    }
+    changed = false;
     for (j = 0; j < num_likelihood_nodes; j++) {
         u = L_nodes[j];
-        L[u] = tsk_round(L[u] / max_L, self->precision);
+        changed = changed || L[u] != X[j];
+        L[u] = X[j];
     }
-    ancestor_matcher_unset_allelic_state(self, site, allelic_state);
+    *unchanged = !changed;
 out:
     return ret;
 }
 
 static int WARN_UNUSED
-ancestor_matcher_coalesce_likelihoods(ancestor_matcher_t *self,
-    const tsk_id_t *restrict parent, double *restrict L, double *restrict L_cache)
+ancestor_matcher_coalesce_likelihoods(
+    ancestor_matcher_t *self, const tsk_id_t *restrict parent, double *restrict L)
 {
     int ret = 0;
-    double L_p;
-    tsk_id_t u, v, p;
-    tsk_id_t *restrict cached_paths = self->likelihood_nodes_tmp;
+    tsk_id_t u, v, w, p;
     const int old_num_likelihood_nodes = self->num_likelihood_nodes;
     tsk_id_t *restrict L_nodes = self->likelihood_nodes;
-    int j, num_cached_paths, num_likelihood_nodes;
+    /* The site state has been stored, so we can use its likelihood buffer for
+     * the likelihood of the path above each likelihood node. */
+    double *restrict L_p = self->site_state.likelihood;
+    int j, num_likelihood_nodes;
 
-    num_cached_paths = 0;
-    num_likelihood_nodes = 0;
     assert(old_num_likelihood_nodes > 0);
+    assert(self->site_state.max_size >= (size_t) old_num_likelihood_nodes);
     for (j = 0; j < old_num_likelihood_nodes; j++) {
         u = L_nodes[j];
         p = parent[u];
         if (p != NULL_NODE) {
-            cached_paths[num_cached_paths] = p;
-            num_cached_paths++;
             v = p;
-            while (
-                likely(L[v] == NULL_LIKELIHOOD) && likely(L_cache[v] == CACHE_UNSET)) {
+            while (likely(L[v] == NULL_LIKELIHOOD)) {
                 v = parent[v];
             }
-            L_p = L_cache[v];
-            if (unlikely(L_p == CACHE_UNSET)) {
-                L_p = L[v];
-            }
+            w = get_likelihood_node(v, L);
+            L_p[j] = L[w];
             /* Fill in the L cache */
             v = p;
-            while (
-                likely(L[v] == NULL_LIKELIHOOD) && likely(L_cache[v] == CACHE_UNSET)) {
-                L_cache[v] = L_p;
+            while (likely(L[v] == NULL_LIKELIHOOD)) {
+                L[v] = CACHED_LIKELIHOOD - w;
                 v = parent[v];
             }
+        }
+    }
+    /* The cached paths lead to the likelihoods as they were before we delete
+     * any, so we only delete them once all of the paths are known. Deleting a
+     * likelihood that is equal to its path's doesn't change any path. */
+    num_likelihood_nodes = 0;
+    for (j = 0; j < old_num_likelihood_nodes; j++) {
+        u = L_nodes[j];
+        p = parent[u];
+        if (p != NULL_NODE) {
             /* If the likelihood for the parent is equal to the child we can
              * delete the child likelihood */
-            if (L[u] == L_p) {
+            if (L[u] == L_p[j]) {
                 L[u] = NULL_LIKELIHOOD;
             }
+            /* Reset the L cache */
+            v = p;
+            while (likely(v != NULL_NODE) && likely(L[v] <= CACHED_LIKELIHOOD)) {
+                L[v] = NULL_LIKELIHOOD;
+                v = parent[v];
+            }
         }
         if (L[u] >= 0) {
-            L_nodes[num_likelihood_nodes] = L_nodes[j];
+            L_nodes[num_likelihood_nodes] = u;
             num_likelihood_nodes++;
         }
     }
@@ -444,114 +1019,221 @@ ancestor_matcher_coalesce_likelihoods(ancestor_matcher_t *self,
     assert(num_likelihood_nodes > 0);
 
     self->num_likelihood_nodes = num_likelihood_nodes;
-    /* Reset the L cache */
-    for (j = 0; j < num_cached_paths; j++) {
-        v = cached_paths[j];
-        while (likely(v != NULL_NODE) && likely(L_cache[v] != CACHE_UNSET)) {
-            L_cache[v] = CACHE_UNSET;
-            v = parent[v];
-        }
-    }
-
     return ret;
 }
 
+/* Updates the likelihoods for the specified site. On return, repeatable is true
+ * if the site has no mutations and the update left the likelihood nodes and
+ * their values unchanged. */
 static int
 ancestor_matcher_update_site_state(ancestor_matcher_t *self, const tsk_id_t site,
     const allele_t state, tsk_id_t *restrict parent, double *restrict L,
-    double *restrict L_cache)
+    bool *repeatable)
 {
     int ret = 0;
-    mutation_list_node_t *mutation = self->tree_sequence_builder->sites.mutations[site];
-    tsk_id_t u;
+    const tree_sequence_builder_t *tsb = self->tree_sequence_builder;
+    const tsk_id_t *restrict mutation_node = tsb->frozen_mutations.node;
+    const size_t mutations_end = tsb->frozen_mutations.offset[site + 1];
+    const int num_likelihood_nodes = self->num_likelihood_nodes;
+    bool unchanged;
+    size_t j;
+    tsk_id_t u, v;
 
     assert(self->num_likelihood_nodes > 0);
 
     if (self->flags & TSI_EXTENDED_CHECKS) {
         ancestor_matcher_check_state(self);
     }
-    for (mutation = self->tree_sequence_builder->sites.mutations[site]; mutation != NULL;
-         mutation = mutation->next) {
+    for (j = tsb->frozen_mutations.offset[site]; j < mutations_end; j++) {
         /* Insert a new L-value for the mutation node if needed */
-        if (L[mutation->node] == NULL_LIKELIHOOD) {
-            u = mutation->node;
+        v = mutation_node[j];
+        if (L[v] == NULL_LIKELIHOOD) {
+            u = v;
             while (L[u] == NULL_LIKELIHOOD) {
                 u = parent[u];
                 assert(u != NULL_NODE);
             }
-            L[mutation->node] = L[u];
-            self->likelihood_nodes[self->num_likelihood_nodes] = mutation->node;
+            L[v] = L[u];
+            self->likelihood_nodes[self->num_likelihood_nodes] = v;
             self->num_likelihood_nodes++;
         }
     }
-    ret = ancestor_matcher_update_site_likelihood_values(self, site, state, parent, L);
+    ret = ancestor_matcher_update_site_likelihood_values(
+        self, site, state, parent, L, &unchanged);
     if (ret != 0) {
         goto out;
     }
-    ret = ancestor_matcher_store_traceback(self, site);
-    if (ret != 0) {
-        goto out;
+    if (site >= self->traceback_start) {
+        ret = ancestor_matcher_store_traceback(self, site);
+        if (ret != 0) {
+            goto out;
+        }
     }
-    ret = ancestor_matcher_coalesce_likelihoods(self, parent, L, L_cache);
+    ret = ancestor_matcher_coalesce_likelihoods(self, parent, L);
     if (ret != 0) {
         goto out;
     }
+    *repeatable = ancestor_matcher_site_has_no_mutations(self, site) && unchanged
+                  && self->num_likelihood_nodes == num_likelihood_nodes;
+out:
+    return ret;
+}
+
+/* Returns true if the update at site is the same function of the likelihoods
+ * as the update at site - 1, which is true if neither site has mutations (so
+ * that all nodes have the ancestral state) and the haplotype state and model
+ * rates are equal. */
+static inline bool
+ancestor_matcher_same_site_update(
+    ancestor_matcher_t *self, const tsk_id_t site, const allele_t *haplotype)
+{
+    const tree_sequence_builder_t *tsb = self->tree_sequence_builder;
+
+    return ancestor_matcher_site_has_no_mutations(self, site)
+           && haplotype[site] == haplotype[site - 1]
+           && self->recombination_rate[site] == self->recombination_rate[site - 1]
+           && self->mismatch_rate[site] == self->mismatch_rate[site - 1]
+           && tsb->sites.num_alleles[site] == tsb->sites.num_alleles[site - 1];
+}
+
+/* Sets the state for site to that of site - 1, where the update at site - 1
+ * was repeatable and the update at site is the same. Applying the same update
+ * to the same likelihoods gives the same result, so we can reuse the traceback
+ * and maximum likelihood node without going through the likelihood nodes. */
+static int WARN_UNUSED
+ancestor_matcher_repeat_site_state(ancestor_matcher_t *self, const tsk_id_t site)
+{
+    int ret = 0;
+
+    if (site > self->traceback_start) {
+        self->traceback[site] = self->traceback[site - 1];
+        self->total_traceback_size += (size_t) self->num_likelihood_nodes;
+        self->stats.num_traceback_sites++;
+        self->stats.num_traceback_nodes += (size_t) self->num_likelihood_nodes;
+    } else if (site == self->traceback_start) {
+        /* The site state from the update at site - 1 is still valid */
+        ret = ancestor_matcher_store_traceback(self, site);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    assert(self->max_likelihood_node[site] == NULL_NODE
+           || self->max_likelihood_node[site] == self->max_likelihood_node[site - 1]);
+    self->max_likelihood_node[site] = self->max_likelihood_node[site - 1];
 out:
     return ret;
 }
 
+/* Sets the per-node state for nodes in [start, end) to its value between calls:
+ * all tree arrays are null and all likelihoods are marked as non-zero roots. */
 static void
-ancestor_matcher_reset_tree(ancestor_matcher_t *self)
+ancestor_matcher_reset_nodes(ancestor_matcher_t *self, size_t start, size_t end)
+{
+    const size_t n = end - start;
+    size_t u, k;
+    haplotype_state_t *state;
+
+    memset(self->parent + start, 0xff, n * sizeof(*self->parent));
+    memset(self->num_children + start, 0, n * sizeof(*self->num_children));
+    memset(self->recombination_required + start, 0xff,
+        n * sizeof(*self->recombination_required));
+    memset(self->allelic_state + start, 0xff, n * sizeof(*self->allelic_state));
+    for (k = 0; k < self->batch.max_size; k++) {
+        state = &self->batch.state[k];
+        for (u = start; u < end; u++) {
+            state->likelihood[u] = NONZERO_ROOT_LIKELIHOOD;
+        }
+    }
+}
+
+/* As reset_nodes for node u, where only the first num_haplotypes haplotypes
+ * in the batch have been used. */
+static inline void
+ancestor_matcher_reset_node(ancestor_matcher_t *self, tsk_id_t u, size_t num_haplotypes)
 {
-    memset(self->parent, 0xff, self->num_nodes * sizeof(*self->parent));
-    memset(self->left_child, 0xff, self->num_nodes * sizeof(*self->left_child));
-    memset(self->right_child, 0xff, self->num_nodes * sizeof(*self->right_child));
-    memset(self->left_sib, 0xff, self->num_nodes * sizeof(*self->left_sib));
-    memset(self->right_sib, 0xff, self->num_nodes * sizeof(*self->right_sib));
-    memset(self->recombination_required, 0xff,
-        self->num_nodes * sizeof(*self->recombination_required));
+    size_t k;
+
+    self->parent[u] = NULL_NODE;
+    self->num_children[u] = 0;
+    for (k = 0; k < num_haplotypes; k++) {
+        self->batch.state[k].likelihood[u] = NONZERO_ROOT_LIKELIHOOD;
+    }
 }
 
+/* Grows the node arrays in place to max_nodes, keeping the state of the
+ * existing nodes. */
 static int WARN_UNUSED
-ancestor_matcher_expand_nodes(ancestor_matcher_t *self)
+ancestor_matcher_expand_nodes(ancestor_matcher_t *self, size_t max_nodes)
 {
-    int ret = TSI_ERR_NO_MEMORY;
+    int ret = 0;
+    void *tmp;
+    size_t k;
+
+    assert(max_nodes > self->max_nodes);
+    ret = ancestor_matcher_check_memory(self,
+        (max_nodes - self->max_nodes)
+            * (ancestor_matcher_get_node_size(self)
+                  + self->batch.max_size
+                        * ancestor_matcher_get_haplotype_node_size(self)));
+    if (ret != 0) {
+        goto out;
+    }
+    tmp = realloc(self->parent, max_nodes * sizeof(*self->parent));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->parent = tmp;
+    tmp = realloc(self->num_children, max_nodes * sizeof(*self->num_children));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->num_children = tmp;
+    tmp = realloc(
+        self->recombination_required, max_nodes * sizeof(*self->recombination_required));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->recombination_required = tmp;
+    tmp = realloc(self->allelic_state, max_nodes * sizeof(*self->allelic_state));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->allelic_state = tmp;
+    for (k = 0; k < self->batch.max_size; k++) {
+        ret = ancestor_matcher_expand_haplotype_nodes(&self->batch.state[k], max_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    ancestor_matcher_save_haplotype(self);
+    ancestor_matcher_load_haplotype(self, self->batch.current);
+    self->max_nodes = max_nodes;
+out:
+    return ret;
+}
 
-    tsi_safe_free(self->parent);
-    tsi_safe_free(self->left_child);
-    tsi_safe_free(self->right_child);
-    tsi_safe_free(self->left_sib);
-    tsi_safe_free(self->right_sib);
-    tsi_safe_free(self->recombination_required);
-    tsi_safe_free(self->likelihood);
-    tsi_safe_free(self->likelihood_cache);
-    tsi_safe_free(self->likelihood_nodes);
-    tsi_safe_free(self->likelihood_nodes_tmp);
-    tsi_safe_free(self->allelic_state);
+/* Frees the storage for the traceback lists for reuse */
+static int
+ancestor_matcher_reset_traceback(ancestor_matcher_t *self)
+{
+    int ret = tsk_blkalloc_reset(&self->traceback_allocator);
 
-    assert(self->max_nodes > 0);
-    self->parent = malloc(self->max_nodes * sizeof(*self->parent));
-    self->left_child = malloc(self->max_nodes * sizeof(*self->left_child));
-    self->right_child = malloc(self->max_nodes * sizeof(*self->right_child));
-    self->left_sib = malloc(self->max_nodes * sizeof(*self->left_sib));
-    self->right_sib = malloc(self->max_nodes * sizeof(*self->right_sib));
-    self->recombination_required
-        = malloc(self->max_nodes * sizeof(*self->recombination_required));
-    self->likelihood = malloc(self->max_nodes * sizeof(*self->likelihood));
-    self->likelihood_cache = malloc(self->max_nodes * sizeof(*self->likelihood_cache));
-    self->likelihood_nodes = malloc(self->max_nodes * sizeof(*self->likelihood_nodes));
-    self->likelihood_nodes_tmp
-        = malloc(self->max_nodes * sizeof(*self->likelihood_nodes_tmp));
-    self->allelic_state = malloc(self->max_nodes * sizeof(*self->allelic_state));
-
-    if (self->parent == NULL || self->left_child == NULL || self->right_child == NULL
-        || self->left_sib == NULL || self->right_sib == NULL
-        || self->recombination_required == NULL || self->likelihood == NULL
-        || self->likelihood_cache == NULL || self->likelihood_nodes == NULL
-        || self->likelihood_nodes_tmp == NULL || self->allelic_state == NULL) {
-        goto out;
-    }
-    ret = 0;
+    if (ret != 0) {
+        goto out;
+    }
+    /* Forget the stored traceback lists by moving to a new generation */
+    self->traceback_lists.generation++;
+    if (self->traceback_lists.generation == 0) {
+        memset(self->traceback_lists.slot_generation, 0,
+            self->traceback_lists.max_size
+                * sizeof(*self->traceback_lists.slot_generation));
+        self->traceback_lists.generation = 1;
+    }
+    self->traceback_lists.size = 0;
 out:
     return ret;
 }
@@ -560,26 +1242,40 @@ static int
 ancestor_matcher_reset(ancestor_matcher_t *self)
 {
     int ret = 0;
-
-    /* TODO realloc when this grows */
-    if (self->max_nodes != self->tree_sequence_builder->max_nodes) {
-        self->max_nodes = self->tree_sequence_builder->max_nodes;
-        ret = ancestor_matcher_expand_nodes(self);
+    size_t num_nodes;
+
+    /* We follow the node capacity of the tree sequence builder, which grows
+     * geometrically, so this happens once per doubling. If this would take us
+     * over the memory limit we only make room for the nodes in use. The
+     * per-node state is restored by find_path after each call, so we only need
+     * to initialise it for nodes that have been added since the last call. */
+    num_nodes = self->tree_sequence_builder->num_nodes;
+    if (self->tree_sequence_builder->max_nodes > self->max_nodes) {
+        ret = ancestor_matcher_expand_nodes(
+            self, self->tree_sequence_builder->max_nodes);
+        if (ret == TSI_ERR_MATCHER_MEMORY_LIMIT) {
+            ret = 0;
+            /* Node 0 is always present */
+            if (TSK_MAX(num_nodes, 1) > self->max_nodes) {
+                ret = ancestor_matcher_expand_nodes(self, TSK_MAX(num_nodes, 1));
+            }
+        }
         if (ret != 0) {
             goto out;
         }
     }
-    self->num_nodes = self->tree_sequence_builder->num_nodes;
-    assert(self->num_nodes <= self->max_nodes);
+    assert(num_nodes <= self->max_nodes);
+    if (num_nodes > self->num_nodes) {
+        ancestor_matcher_reset_nodes(self, self->num_nodes, num_nodes);
+    }
+    self->num_nodes = num_nodes;
 
-    memset(self->allelic_state, 0xff, self->num_nodes * sizeof(*self->allelic_state));
-    ret = tsk_blkalloc_reset(&self->traceback_allocator);
+    ret = ancestor_matcher_reset_traceback(self);
     if (ret != 0) {
         goto out;
     }
     self->total_traceback_size = 0;
     self->num_likelihood_nodes = 0;
-    ancestor_matcher_reset_tree(self);
 out:
     return ret;
 }
@@ -591,16 +1287,19 @@ ancestor_matcher_set_recombination_required(
     ancestor_matcher_t *self, tsk_id_t site, int8_t *restrict recombination_required)
 {
     int j;
-    const int8_t *restrict R = self->traceback[site].recombination_required;
-    const tsk_id_t *restrict node = self->traceback[site].node;
+    uint32_t key, delta;
+    const uint8_t *restrict p = self->traceback[site].data;
     const int size = self->traceback[site].size;
 
     /* We always set recombination_required for node 0 to false for the cases
      * where no recombination is needed at a particular site (which are
      * encoded by a traceback of size 0) */
     recombination_required[0] = 0;
+    key = 0;
     for (j = 0; j < size; j++) {
-        recombination_required[node[j]] = R[j];
+        p = varint_decode(p, &delta);
+        key += delta;
+        recombination_required[key >> 1] = (int8_t)(key & 1);
     }
 }
 
@@ -611,22 +1310,145 @@ ancestor_matcher_unset_recombination_required(
     ancestor_matcher_t *self, tsk_id_t site, int8_t *restrict recombination_required)
 {
     int j;
-    const tsk_id_t *restrict node = self->traceback[site].node;
+    uint32_t key, delta;
+    const uint8_t *restrict p = self->traceback[site].data;
     const int size = self->traceback[site].size;
 
+    key = 0;
     for (j = 0; j < size; j++) {
-        recombination_required[node[j]] = -1;
+        p = varint_decode(p, &delta);
+        key += delta;
+        recombination_required[key >> 1] = -1;
     }
     recombination_required[0] = -1;
 }
 
+/* Returns the number of edges in the left index with left <= pos */
+static inline size_t
+left_index_upper_bound(const edge_t *restrict edges, size_t num_edges, tsk_id_t pos)
+{
+    size_t lo = 0;
+    size_t hi = num_edges;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (edges[mid].left <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Returns the number of edges in the right index with right <= pos */
+static inline size_t
+right_index_upper_bound(const edge_t *restrict edges, size_t num_edges, tsk_id_t pos)
+{
+    size_t lo = 0;
+    size_t hi = num_edges;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (edges[mid].right <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Returns the first tree breakpoint >= pos, or num_sites if there is none */
+static tsk_id_t
+ancestor_matcher_next_breakpoint(ancestor_matcher_t *self, tsk_id_t pos)
+{
+    const edge_t *restrict in = self->tree_sequence_builder->left_index_edges;
+    const edge_t *restrict out = self->tree_sequence_builder->right_index_edges;
+    const size_t M = self->tree_sequence_builder->num_edges;
+    tsk_id_t ret = (tsk_id_t) self->num_sites;
+    size_t j;
+
+    j = left_index_upper_bound(in, M, pos - 1);
+    if (j < M) {
+        ret = TSK_MIN(ret, in[j].left);
+    }
+    j = right_index_upper_bound(out, M, pos - 1);
+    if (j < M) {
+        ret = TSK_MIN(ret, out[j].right);
+    }
+    return ret;
+}
+
+/* Returns the last checkpoint taken after at most num_in edges were inserted */
+static size_t
+ancestor_matcher_find_checkpoint(ancestor_matcher_t *self, size_t num_in)
+{
+    const size_t *restrict index = self->tree_sequence_builder->checkpoints.index;
+    size_t lo = 0;
+    size_t hi = self->tree_sequence_builder->checkpoints.size;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index[mid] <= num_in) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    assert(lo > 0);
+    return lo - 1;
+}
+
+/* Starts the output edges for each haplotype in the batch at end. */
+static void
+ancestor_matcher_start_traceback(
+    ancestor_matcher_t *self, size_t num_haplotypes, tsk_id_t end)
+{
+    size_t k;
+    tsk_id_t max_likelihood_node;
+
+    for (k = 0; k < num_haplotypes; k++) {
+        ancestor_matcher_select_haplotype(self, k);
+        self->output.size = 0;
+        self->output.right[self->output.size] = end;
+        max_likelihood_node = self->max_likelihood_node[end - 1];
+        assert(max_likelihood_node != NULL_NODE);
+        self->output.parent[self->output.size] = max_likelihood_node;
+    }
+}
+
+/* Finishes the output edges for each haplotype in the batch at start. */
+static void
+ancestor_matcher_finish_traceback(
+    ancestor_matcher_t *self, size_t num_haplotypes, tsk_id_t start)
+{
+    size_t k;
+
+    for (k = 0; k < num_haplotypes; k++) {
+        ancestor_matcher_select_haplotype(self, k);
+        self->output.left[self->output.size] = start;
+        self->output.size++;
+        assert(self->output.right[self->output.size - 1] != start);
+    }
+}
+
+/* Runs the traceback over the sites in [start, end) of a path starting at
+ * path_start for each haplotype in the batch, continuing the output edges from
+ * end and writing the matched haplotypes to match. This must be called
+ * directly after the forwards pass over [start, end), whose final tree we
+ * reuse. */
 static int WARN_UNUSED
-ancestor_matcher_run_traceback(ancestor_matcher_t *self, tsk_id_t start, tsk_id_t end,
-    allele_t *TSK_UNUSED(haplotype), allele_t *match)
+ancestor_matcher_run_traceback(ancestor_matcher_t *self, size_t num_haplotypes,
+    tsk_id_t path_start, tsk_id_t start, tsk_id_t end, allele_t *match)
 {
     int ret = 0;
     tsk_id_t l;
     edge_t edge;
+    size_t k;
     tsk_id_t u, v, max_likelihood_node;
     tsk_id_t left, right, pos;
     tsk_id_t *restrict parent = self->parent;
@@ -634,25 +1456,15 @@ ancestor_matcher_run_traceback(ancestor_matcher_t *self, tsk_id_t start, tsk_id_
     int8_t *restrict recombination_required = self->recombination_required;
     const edge_t *restrict in = self->tree_sequence_builder->right_index_edges;
     const edge_t *restrict out = self->tree_sequence_builder->left_index_edges;
-    int_fast32_t in_index = (int_fast32_t) self->tree_sequence_builder->num_edges - 1;
-    int_fast32_t out_index = (int_fast32_t) self->tree_sequence_builder->num_edges - 1;
-
-    /* Prepare for the traceback and get the memory ready for recording
-     * the output edges. */
-    self->output.size = 0;
-    self->output.right[self->output.size] = end;
-    self->output.parent[self->output.size] = NULL_NODE;
-
-    max_likelihood_node = self->max_likelihood_node[end - 1];
-    assert(max_likelihood_node != NULL_NODE);
-    self->output.parent[self->output.size] = max_likelihood_node;
-    assert(self->output.parent[self->output.size] != NULL_NODE);
-
-    /* Now go through the trees in reverse and run the traceback */
-    memset(parent, 0xff, self->num_nodes * sizeof(*parent));
-    memset(
-        recombination_required, 0xff, self->num_nodes * sizeof(*recombination_required));
-    pos = (tsk_id_t) self->num_sites;
+    const size_t M = self->tree_sequence_builder->num_edges;
+    int_fast32_t in_index, out_index;
+
+    /* The forwards pass leaves the tree at the first breakpoint pos >= end, so
+     * we go through the trees in reverse from there rather than from the end
+     * of the sequence. */
+    pos = ancestor_matcher_next_breakpoint(self, end);
+    out_index = (int_fast32_t) left_index_upper_bound(out, M, pos) - 1;
+    in_index = (int_fast32_t) right_index_upper_bound(in, M, pos) - 1;
 
     while (pos > start) {
         while (out_index >= 0 && out[out_index].left == pos) {
@@ -677,226 +1489,527 @@ ancestor_matcher_run_traceback(ancestor_matcher_t *self, tsk_id_t start, tsk_id_
 
         /* The tree is ready; perform the traceback at each site in this tree */
         assert(left < right);
-        for (l = TSK_MIN(right, end) - 1; l >= (int) TSK_MAX(left, start); l--) {
-            ancestor_matcher_set_allelic_state(self, l, allelic_state);
-            u = self->output.parent[self->output.size];
-            v = u;
-            while (allelic_state[v] == TSK_NULL) {
-                v = parent[v];
-            }
-            match[l] = allelic_state[v];
-            ancestor_matcher_unset_allelic_state(self, l, allelic_state);
+        for (k = 0; k < num_haplotypes; k++) {
+            ancestor_matcher_select_haplotype(self, k);
+            for (l = TSK_MIN(right, end) - 1; l >= (int) TSK_MAX(left, start); l--) {
+                ancestor_matcher_set_allelic_state(self, l, allelic_state);
+                u = self->output.parent[self->output.size];
+                v = u;
+                while (allelic_state[v] == TSK_NULL) {
+                    v = parent[v];
+                }
+                match[k * self->num_sites + (size_t) l] = allelic_state[v];
+                ancestor_matcher_unset_allelic_state(self, l, allelic_state);
 
-            /* Mark the traceback nodes on the tree */
-            ancestor_matcher_set_recombination_required(self, l, recombination_required);
+                /* Mark the traceback nodes on the tree */
+                ancestor_matcher_set_recombination_required(
+                    self, l, recombination_required);
 
-            /* Traverse up the tree from the current node. The first marked node that we
-             * meed tells us whether we need to recombine */
-            while (u != 0 && recombination_required[u] == -1) {
-                u = parent[u];
-                assert(u != NULL_NODE);
-            }
-            if (recombination_required[u] && l > start) {
-                max_likelihood_node = self->max_likelihood_node[l - 1];
-                assert(max_likelihood_node != NULL_NODE);
-                self->output.left[self->output.size] = l;
-                self->output.size++;
-                assert(self->output.size < self->output.max_size);
-                /* Start the next output edge */
-                self->output.right[self->output.size] = l;
-                self->output.parent[self->output.size] = max_likelihood_node;
+                /* Traverse up the tree from the current node. The first marked node
+                 * that we meed tells us whether we need to recombine */
+                while (u != 0 && recombination_required[u] == -1) {
+                    u = parent[u];
+                    assert(u != NULL_NODE);
+                }
+                if (recombination_required[u] && l > path_start) {
+                    max_likelihood_node = self->max_likelihood_node[l - 1];
+                    assert(max_likelihood_node != NULL_NODE);
+                    self->output.left[self->output.size] = l;
+                    self->output.size++;
+                    assert(self->output.size < self->output.max_size);
+                    /* Start the next output edge */
+                    self->output.right[self->output.size] = l;
+                    self->output.parent[self->output.size] = max_likelihood_node;
+                }
+                /* Unset the values in the tree for the next site. */
+                ancestor_matcher_unset_recombination_required(
+                    self, l, recombination_required);
             }
-            /* Unset the values in the tree for the next site. */
-            ancestor_matcher_unset_recombination_required(
-                self, l, recombination_required);
         }
     }
 
-    self->output.left[self->output.size] = start;
-    self->output.size++;
-    assert(self->output.right[self->output.size - 1] != start);
     return ret;
 }
 
 static inline void
-remove_edge(edge_t edge, tsk_id_t *restrict parent, tsk_id_t *restrict left_child,
-    tsk_id_t *restrict right_child, tsk_id_t *restrict left_sib,
-    tsk_id_t *restrict right_sib)
+remove_edge(edge_t edge, tsk_id_t *restrict parent, int32_t *restrict num_children,
+    tsk_id_t *restrict root)
 {
-    const tsk_id_t p = edge.parent;
-    const tsk_id_t c = edge.child;
-    const tsk_id_t lsib = left_sib[c];
-    const tsk_id_t rsib = right_sib[c];
+    parent[edge.child] = NULL_NODE;
+    num_children[edge.parent]--;
+    if (edge.parent == 0) {
+        *root ^= edge.child;
+    }
+}
 
-    if (lsib == NULL_NODE) {
-        left_child[p] = rsib;
-    } else {
-        right_sib[lsib] = rsib;
+static inline void
+insert_edge(edge_t edge, tsk_id_t *restrict parent, int32_t *restrict num_children,
+    tsk_id_t *restrict root)
+{
+    parent[edge.child] = edge.parent;
+    num_children[edge.parent]++;
+    if (edge.parent == 0) {
+        *root ^= edge.child;
     }
-    if (rsib == NULL_NODE) {
-        right_child[p] = lsib;
-    } else {
-        left_sib[rsib] = lsib;
+}
+
+/* Loads the tree that we reach by applying the edge removals and insertions
+ * in order up to the last insertion position <= start, using the tree sequence
+ * builder's checkpoints to avoid replaying the edges from the start of the
+ * sequence. The likelihoods of all nodes in the tree are marked as
+ * NULL_LIKELIHOOD for each haplotype. */
+static void
+ancestor_matcher_load_tree(ancestor_matcher_t *self, size_t num_haplotypes,
+    tsk_id_t start, tsk_id_t *restrict parent, int32_t *restrict num_children,
+    int_fast32_t *in_index, int_fast32_t *out_index, tsk_id_t *left, tsk_id_t *right)
+{
+    const tree_sequence_builder_t *tsb = self->tree_sequence_builder;
+    const edge_t *restrict in = tsb->left_index_edges;
+    const edge_t *restrict out = tsb->right_index_edges;
+    const size_t *restrict checkpoint_index = tsb->checkpoints.index;
+    const tsk_id_t *restrict checkpoint_edges = tsb->checkpoints.edges;
+    const size_t M = tsb->num_edges;
+    const haplotype_state_t *restrict state = self->batch.state;
+    size_t j, k, h, num_in, num_out;
+    edge_t edge;
+    tsk_id_t pos;
+
+    self->root = 0;
+    num_in = left_index_upper_bound(in, M, start);
+    *left = 0;
+    *right = (tsk_id_t) self->num_sites;
+    *in_index = 0;
+    *out_index = 0;
+    if (num_in == 0) {
+        if (M > 0) {
+            *right = in[0].left;
+        }
+        return;
+    }
+    pos = in[num_in - 1].left;
+
+    num_out = right_index_upper_bound(out, M, pos);
+
+    k = ancestor_matcher_find_checkpoint(self, num_in);
+    for (j = tsb->checkpoints.offset[k]; j < tsb->checkpoints.offset[k + 1]; j++) {
+        edge = in[checkpoint_edges[j]];
+        if (edge.right > pos) {
+            insert_edge(edge, parent, num_children, &self->root);
+            for (h = 0; h < num_haplotypes; h++) {
+                state[h].likelihood[edge.child] = NULL_LIKELIHOOD;
+            }
+        }
+    }
+    for (j = checkpoint_index[k]; j < num_in; j++) {
+        edge = in[j];
+        if (edge.right > pos) {
+            insert_edge(edge, parent, num_children, &self->root);
+            for (h = 0; h < num_haplotypes; h++) {
+                state[h].likelihood[edge.child] = NULL_LIKELIHOOD;
+            }
+        }
+    }
+
+    *left = pos;
+    if (num_in < M) {
+        *right = TSK_MIN(*right, in[num_in].left);
+    }
+    if (num_out < M) {
+        *right = TSK_MIN(*right, out[num_out].right);
     }
-    parent[c] = NULL_NODE;
-    left_sib[c] = NULL_NODE;
-    right_sib[c] = NULL_NODE;
+    *in_index = (int_fast32_t) num_in;
+    *out_index = (int_fast32_t) num_out;
 }
 
+/* Updates the likelihoods of the current haplotype for the roots of the tree:
+ * nonzero roots that have just left the tree in out[remove_start:out_index]
+ * are removed, and a new root gets a zero likelihood if needed. */
 static inline void
-insert_edge(edge_t edge, tsk_id_t *restrict parent, tsk_id_t *restrict left_child,
-    tsk_id_t *restrict right_child, tsk_id_t *restrict left_sib,
-    tsk_id_t *restrict right_sib)
-{
-    const tsk_id_t p = edge.parent;
-    const tsk_id_t c = edge.child;
-    const tsk_id_t u = right_child[p];
-
-    parent[c] = p;
-    if (u == NULL_NODE) {
-        left_child[p] = c;
-        left_sib[c] = NULL_NODE;
-        right_sib[c] = NULL_NODE;
-    } else {
-        right_sib[u] = c;
-        left_sib[c] = u;
-        right_sib[c] = NULL_NODE;
+ancestor_matcher_update_roots(ancestor_matcher_t *self, int_fast32_t remove_start,
+    int_fast32_t out_index, const tsk_id_t *restrict parent,
+    const int32_t *restrict num_children)
+{
+    const edge_t *restrict out = self->tree_sequence_builder->right_index_edges;
+    double *restrict L = self->likelihood;
+    haplotype_state_t *state = &self->batch.state[self->batch.current];
+    int_fast32_t l;
+    edge_t edge;
+    tsk_id_t root;
+    int num_removed = 0;
+
+    /* Remove the likelihoods for any nonzero roots that have just left
+     * the tree */
+    for (l = remove_start; l < out_index; l++) {
+        edge = out[l];
+        if (unlikely(is_nonzero_root(edge.child, parent, num_children))) {
+            num_removed += L[edge.child] >= 0;
+            L[edge.child] = NONZERO_ROOT_LIKELIHOOD;
+        }
+        if (unlikely(is_nonzero_root(edge.parent, parent, num_children))) {
+            num_removed += L[edge.parent] >= 0;
+            L[edge.parent] = NONZERO_ROOT_LIKELIHOOD;
+        }
+    }
+
+    root = self->root;
+    assert(num_children[0] <= 1);
+    if (root != state->last_root && state->last_root == 0) {
+        assert(L[0] >= 0);
+        L[0] = NONZERO_ROOT_LIKELIHOOD;
+        num_removed++;
+    }
+    if (num_removed > 0) {
+        ancestor_matcher_remove_likelihood_nodes(self, L, num_removed);
+    }
+    if (root != state->last_root) {
+        if (L[root] == NONZERO_ROOT_LIKELIHOOD) {
+            L[root] = 0;
+            self->likelihood_nodes[self->num_likelihood_nodes] = root;
+            self->num_likelihood_nodes++;
+        }
+        state->last_root = root;
     }
-    right_child[p] = c;
 }
 
-static int
-ancestor_matcher_run_forwards_match(
-    ancestor_matcher_t *self, tsk_id_t start, tsk_id_t end, allele_t *haplotype)
+/* Updates the likelihoods of the current haplotype after the specified edge
+ * has been removed from the tree. */
+static inline void
+ancestor_matcher_remove_edge_likelihood(
+    ancestor_matcher_t *self, edge_t edge, const tsk_id_t *restrict parent)
 {
-    int ret = 0;
-    tsk_id_t site;
-    edge_t edge;
-    tsk_id_t u, root, last_root;
-    double L_child = 0;
-    /* Use the restrict keyword here to try to improve performance by avoiding
-     * unecessary loads. We must be very careful to to ensure that all references
-     * to this memory for the duration of this function is through these variables.
-     */
     double *restrict L = self->likelihood;
-    double *restrict L_cache = self->likelihood_cache;
-    tsk_id_t *restrict parent = self->parent;
-    tsk_id_t *restrict left_child = self->left_child;
-    tsk_id_t *restrict right_child = self->right_child;
-    tsk_id_t *restrict left_sib = self->left_sib;
-    tsk_id_t *restrict right_sib = self->right_sib;
-    tsk_id_t pos, left, right;
-    const edge_t *restrict in = self->tree_sequence_builder->left_index_edges;
+    double L_child;
+    tsk_id_t u, w;
+
+    assert(L[edge.child] != NONZERO_ROOT_LIKELIHOOD);
+    if (L[edge.child] == NULL_LIKELIHOOD || L[edge.child] <= CACHED_LIKELIHOOD) {
+        u = edge.parent;
+        while (likely(L[u] == NULL_LIKELIHOOD)) {
+            u = parent[u];
+        }
+        w = get_likelihood_node(u, L);
+        L_child = L[w];
+        assert(L_child >= 0);
+        u = edge.parent;
+        /* Fill in the cache by traversing back upwards. Nodes with a likelihood
+         * keep it while we remove edges, so the cache stays valid. */
+        while (likely(L[u] == NULL_LIKELIHOOD)) {
+            L[u] = CACHED_LIKELIHOOD - w;
+            u = parent[u];
+        }
+        L[edge.child] = L_child;
+        self->likelihood_nodes[self->num_likelihood_nodes] = edge.child;
+        self->num_likelihood_nodes++;
+    }
+}
+
+/* Resets the likelihood cache of the current haplotype above the edges
+ * out[remove_start:out_index] that have just been removed. */
+static inline void
+ancestor_matcher_reset_likelihood_cache(ancestor_matcher_t *self,
+    int_fast32_t remove_start, int_fast32_t out_index, const tsk_id_t *restrict parent)
+{
     const edge_t *restrict out = self->tree_sequence_builder->right_index_edges;
-    const int_fast32_t M = (tsk_id_t) self->tree_sequence_builder->num_edges;
-    int_fast32_t in_index, out_index, l, remove_start;
-
-    /* Load the tree for start */
-    left = 0;
-    pos = 0;
-    in_index = 0;
-    out_index = 0;
-    right = (tsk_id_t) self->num_sites;
-    if (in_index < M && start < in[in_index].left) {
-        right = in[in_index].left;
-    }
-
-    /* TODO there's probably quite a big gain to made here by seeking
-     * directly to the tree that we're interested in rather than just
-     * building the trees sequentially */
-    while (in_index < M && out_index < M && in[in_index].left <= start) {
-        while (out_index < M && out[out_index].right == pos) {
-            remove_edge(
-                out[out_index], parent, left_child, right_child, left_sib, right_sib);
-            out_index++;
+    double *restrict L = self->likelihood;
+    int_fast32_t l;
+    tsk_id_t u;
+
+    /* A cached node is given a likelihood if its parent edge is removed, so
+     * all cached nodes are still in the tree, above one of the edges */
+    for (l = remove_start; l < out_index; l++) {
+        u = out[l].parent;
+        while (likely(L[u] <= CACHED_LIKELIHOOD)) {
+            L[u] = NULL_LIKELIHOOD;
+            u = parent[u];
         }
-        while (in_index < M && in[in_index].left == pos) {
-            insert_edge(
-                in[in_index], parent, left_child, right_child, left_sib, right_sib);
-            in_index++;
+    }
+}
+
+/* Inserts zero likelihoods for the current haplotype for any nonzero roots
+ * that have entered the tree with the specified edge. Note we don't bother
+ * trying to compress the tree here because this will be done for the next
+ * site anyway. */
+static inline void
+ancestor_matcher_insert_edge_likelihood(ancestor_matcher_t *self, edge_t edge)
+{
+    double *restrict L = self->likelihood;
+
+    if (unlikely(edge.parent != 0 && L[edge.parent] == NONZERO_ROOT_LIKELIHOOD)) {
+        L[edge.parent] = 0;
+        self->likelihood_nodes[self->num_likelihood_nodes] = edge.parent;
+        self->num_likelihood_nodes++;
+    }
+    if (unlikely(L[edge.child] == NONZERO_ROOT_LIKELIHOOD)) {
+        L[edge.child] = 0;
+        self->likelihood_nodes[self->num_likelihood_nodes] = edge.child;
+        self->num_likelihood_nodes++;
+    }
+}
+
+/* Makes room for size likelihood checkpoints and discards the saved values. */
+static int WARN_UNUSED
+ancestor_matcher_reset_checkpoints(ancestor_matcher_t *self, size_t size)
+{
+    int ret = 0;
+    void *tmp;
+    size_t max_size = self->likelihood_checkpoints.max_size;
+
+    if (size > max_size) {
+        max_size = TSK_MAX(size, 2 * max_size);
+        ret = ancestor_matcher_check_memory(self,
+            (max_size - self->likelihood_checkpoints.max_size)
+                * (sizeof(size_t) + sizeof(int) + sizeof(tsk_id_t)));
+        if (ret != 0) {
+            goto out;
         }
-        left = pos;
-        right = (tsk_id_t) self->num_sites;
-        if (in_index < M) {
-            right = TSK_MIN(right, in[in_index].left);
+        tmp = realloc(self->likelihood_checkpoints.offset, max_size * sizeof(size_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
         }
-        if (out_index < M) {
-            right = TSK_MIN(right, out[out_index].right);
+        self->likelihood_checkpoints.offset = tmp;
+        tmp = realloc(
+            self->likelihood_checkpoints.num_likelihood_nodes, max_size * sizeof(int));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->likelihood_checkpoints.num_likelihood_nodes = tmp;
+        tmp = realloc(
+            self->likelihood_checkpoints.last_root, max_size * sizeof(tsk_id_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
         }
-        pos = right;
+        self->likelihood_checkpoints.last_root = tmp;
+        self->likelihood_checkpoints.max_size = max_size;
     }
+    self->likelihood_checkpoints.size = size;
+    self->likelihood_checkpoints.num_values = 0;
+out:
+    return ret;
+}
 
-    /* Insert the initial likelihoods. All non-zero roots are marked with a
-     * special value so we can identify them when the enter the tree */
-    L_cache[0] = CACHE_UNSET;
-    for (u = 0; u < (tsk_id_t) self->num_nodes; u++) {
-        L_cache[u] = CACHE_UNSET;
-        if (parent[u] != NULL_NODE) {
-            L[u] = NULL_LIKELIHOOD;
-        } else {
-            L[u] = NONZERO_ROOT_LIKELIHOOD;
+/* Saves the likelihoods of the current haplotype as the specified checkpoint. */
+static int WARN_UNUSED
+ancestor_matcher_save_checkpoint(ancestor_matcher_t *self, size_t index)
+{
+    int ret = 0;
+    void *tmp;
+    int j;
+    tsk_id_t u;
+    const int num_likelihood_nodes = self->num_likelihood_nodes;
+    const size_t offset = self->likelihood_checkpoints.num_values;
+    size_t max_values = self->likelihood_checkpoints.max_values;
+
+    assert(index < self->likelihood_checkpoints.size);
+    if (offset + (size_t) num_likelihood_nodes > max_values) {
+        max_values = TSK_MAX(offset + (size_t) num_likelihood_nodes, 2 * max_values);
+        ret = ancestor_matcher_check_memory(self,
+            (max_values - self->likelihood_checkpoints.max_values)
+                * (sizeof(tsk_id_t) + sizeof(double)));
+        if (ret == TSI_ERR_MATCHER_MEMORY_LIMIT) {
+            /* Near the limit, only make room for this checkpoint */
+            max_values = offset + (size_t) num_likelihood_nodes;
+            ret = ancestor_matcher_check_memory(self,
+                (max_values - self->likelihood_checkpoints.max_values)
+                    * (sizeof(tsk_id_t) + sizeof(double)));
+        }
+        if (ret != 0) {
+            goto out;
+        }
+        tmp = realloc(self->likelihood_checkpoints.node, max_values * sizeof(tsk_id_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
         }
+        self->likelihood_checkpoints.node = tmp;
+        tmp = realloc(
+            self->likelihood_checkpoints.likelihood, max_values * sizeof(double));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->likelihood_checkpoints.likelihood = tmp;
+        self->likelihood_checkpoints.max_values = max_values;
     }
     if (self->flags & TSI_EXTENDED_CHECKS) {
-        ancestor_matcher_check_state(self);
+        ancestor_matcher_check_checkpoint_state(self);
     }
-    last_root = 0;
-    if (left_child[0] != NULL_NODE) {
-        last_root = left_child[0];
-        assert(right_sib[last_root] == NULL_NODE);
+    self->likelihood_checkpoints.offset[index] = offset;
+    self->likelihood_checkpoints.num_likelihood_nodes[index] = num_likelihood_nodes;
+    self->likelihood_checkpoints.last_root[index]
+        = self->batch.state[self->batch.current].last_root;
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        u = self->likelihood_nodes[j];
+        self->likelihood_checkpoints.node[offset + (size_t) j] = u;
+        self->likelihood_checkpoints.likelihood[offset + (size_t) j]
+            = self->likelihood[u];
     }
-    L[last_root] = 1.0;
-    self->likelihood_nodes[0] = last_root;
-    self->num_likelihood_nodes = 1;
+    self->likelihood_checkpoints.num_values = offset + (size_t) num_likelihood_nodes;
+    self->stats.num_checkpoints++;
+    self->stats.num_checkpoint_nodes += (size_t) num_likelihood_nodes;
+out:
+    return ret;
+}
 
-    remove_start = out_index;
-    while (left < end) {
-        assert(left < right);
+/* Loads the likelihoods of each haplotype in the batch at start from the
+ * specified checkpoint, after the tree has been loaded by load_tree. This tree
+ * can be to the left of start, so we first remove any edges that leave the
+ * tree before start; nodes that this leaves as non-zero roots are marked
+ * as such, and the remaining nodes in the tree have a NULL likelihood. */
+static void
+ancestor_matcher_load_checkpoint(ancestor_matcher_t *self, size_t num_haplotypes,
+    size_t checkpoint, tsk_id_t start, tsk_id_t *restrict parent,
+    int32_t *restrict num_children, int_fast32_t in_index, int_fast32_t *out_index,
+    tsk_id_t *left, tsk_id_t *right)
+{
+    const edge_t *restrict in = self->tree_sequence_builder->left_index_edges;
+    const edge_t *restrict out = self->tree_sequence_builder->right_index_edges;
+    const int_fast32_t M = (int_fast32_t) self->tree_sequence_builder->num_edges;
+    const haplotype_state_t *restrict state = self->batch.state;
+    const tsk_id_t *restrict node = self->likelihood_checkpoints.node;
+    const double *restrict likelihood = self->likelihood_checkpoints.likelihood;
+    size_t k, index, offset;
+    edge_t edge;
+    tsk_id_t u;
+    int j;
 
-        /* Remove the likelihoods for any nonzero roots that have just left
-         * the tree */
-        for (l = remove_start; l < out_index; l++) {
-            edge = out[l];
-            if (unlikely(is_nonzero_root(edge.child, parent, left_child))) {
-                if (L[edge.child] >= 0) {
-                    ancestor_matcher_delete_likelihood(self, edge.child, L);
+    /* load_tree inserts all the edges with left <= start */
+    assert(in_index == M || in[in_index].left > start);
+    while (*right <= start) {
+        while (*out_index < M && out[*out_index].right == *right) {
+            edge = out[*out_index];
+            (*out_index)++;
+            remove_edge(edge, parent, num_children, &self->root);
+            if (is_nonzero_root(edge.child, parent, num_children)) {
+                for (k = 0; k < num_haplotypes; k++) {
+                    state[k].likelihood[edge.child] = NONZERO_ROOT_LIKELIHOOD;
                 }
-                L[edge.child] = NONZERO_ROOT_LIKELIHOOD;
             }
-            if (unlikely(is_nonzero_root(edge.parent, parent, left_child))) {
-                if (L[edge.parent] >= 0) {
-                    ancestor_matcher_delete_likelihood(self, edge.parent, L);
+            if (is_nonzero_root(edge.parent, parent, num_children)) {
+                for (k = 0; k < num_haplotypes; k++) {
+                    state[k].likelihood[edge.parent] = NONZERO_ROOT_LIKELIHOOD;
                 }
-                L[edge.parent] = NONZERO_ROOT_LIKELIHOOD;
             }
         }
-
-        root = 0;
-        if (left_child[0] != NULL_NODE) {
-            root = left_child[0];
-            assert(right_sib[root] == NULL_NODE);
+        *left = *right;
+        *right = (tsk_id_t) self->num_sites;
+        if (in_index < M) {
+            *right = TSK_MIN(*right, in[in_index].left);
         }
-        if (root != last_root) {
-            if (last_root == 0) {
-                ancestor_matcher_delete_likelihood(self, last_root, L);
-                L[last_root] = NONZERO_ROOT_LIKELIHOOD;
-            }
-            if (L[root] == NONZERO_ROOT_LIKELIHOOD) {
-                L[root] = 0;
-                self->likelihood_nodes[self->num_likelihood_nodes] = root;
-                self->num_likelihood_nodes++;
-            }
-            last_root = root;
+        if (*out_index < M) {
+            *right = TSK_MIN(*right, out[*out_index].right);
         }
+    }
 
+    for (k = 0; k < num_haplotypes; k++) {
+        ancestor_matcher_select_haplotype(self, k);
+        index = checkpoint * num_haplotypes + k;
+        offset = self->likelihood_checkpoints.offset[index];
+        self->num_likelihood_nodes
+            = self->likelihood_checkpoints.num_likelihood_nodes[index];
+        for (j = 0; j < self->num_likelihood_nodes; j++) {
+            u = node[offset + (size_t) j];
+            self->likelihood[u] = likelihood[offset + (size_t) j];
+            self->likelihood_nodes[j] = u;
+        }
+        self->batch.state[k].last_root = self->likelihood_checkpoints.last_root[index];
         if (self->flags & TSI_EXTENDED_CHECKS) {
             ancestor_matcher_check_state(self);
+            ancestor_matcher_check_checkpoint_state(self);
+        }
+    }
+}
+
+/* Runs the forwards pass over [start, end) for each of the haplotypes in the
+ * batch. The tree is shared, so we only go through the tree transitions once;
+ * at each transition we update the likelihoods of every haplotype in turn.
+ * Haplotype k is stored in haplotypes[k * num_sites: (k + 1) * num_sites].
+ * If checkpoint >= 0, the likelihoods at start are loaded from this checkpoint.
+ * Otherwise, if the checkpoint interval is nonzero, we save the likelihoods
+ * every interval sites from start. */
+static int
+ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, size_t num_haplotypes,
+    tsk_id_t start, tsk_id_t end, allele_t *haplotypes, int checkpoint)
+{
+    int ret = 0;
+    tsk_id_t site;
+    edge_t edge;
+    size_t k;
+    tsk_id_t last_root;
+    /* Use the restrict keyword here to try to improve performance by avoiding
+     * unecessary loads. We must be very careful to to ensure that all references
+     * to this memory for the duration of this function is through these variables.
+     */
+    tsk_id_t *restrict parent = self->parent;
+    int32_t *restrict num_children = self->num_children;
+    tsk_id_t left, right;
+    const edge_t *restrict in = self->tree_sequence_builder->left_index_edges;
+    const edge_t *restrict out = self->tree_sequence_builder->right_index_edges;
+    const int_fast32_t M = (tsk_id_t) self->tree_sequence_builder->num_edges;
+    const allele_t *haplotype;
+    const size_t interval = checkpoint < 0 ? self->likelihood_checkpoints.interval : 0;
+    bool repeatable;
+    int_fast32_t in_index, out_index, remove_start;
+
+    /* Load the tree for start and insert the initial likelihoods. All nodes
+     * start out marked as non-zero roots, so that we can identify them when they
+     * enter the tree. */
+    ancestor_matcher_load_tree(self, num_haplotypes, start, parent, num_children,
+        &in_index, &out_index, &left, &right);
+    if (checkpoint >= 0) {
+        ancestor_matcher_load_checkpoint(self, num_haplotypes, (size_t) checkpoint,
+            start, parent, num_children, in_index, &out_index, &left, &right);
+    } else {
+        last_root = self->root;
+        assert(num_children[0] <= 1);
+        for (k = 0; k < num_haplotypes; k++) {
+            ancestor_matcher_select_haplotype(self, k);
+            self->likelihood[last_root] = 1.0;
+            self->likelihood_nodes[0] = last_root;
+            self->num_likelihood_nodes = 1;
+            self->batch.state[k].last_root = last_root;
+            if (self->flags & TSI_EXTENDED_CHECKS) {
+                ancestor_matcher_check_state(self);
+            }
         }
-        for (site = TSK_MAX(left, start); site < TSK_MIN(right, end); site++) {
-            ret = ancestor_matcher_update_site_state(
-                self, site, haplotype[site], parent, L, L_cache);
-            if (ret != 0) {
-                goto out;
+    }
+
+    remove_start = out_index;
+    while (left < end) {
+        assert(left < right);
+
+        for (k = 0; k < num_haplotypes; k++) {
+            ancestor_matcher_select_haplotype(self, k);
+            ancestor_matcher_update_roots(
+                self, remove_start, out_index, parent, num_children);
+            if (self->flags & TSI_EXTENDED_CHECKS) {
+                ancestor_matcher_check_state(self);
+            }
+            haplotype = haplotypes + k * self->num_sites;
+            repeatable = false;
+            for (site = TSK_MAX(left, start); site < TSK_MIN(right, end); site++) {
+                if (unlikely(interval > 0) && (size_t)(site - start) % interval == 0) {
+                    ret = ancestor_matcher_save_checkpoint(self,
+                        ((size_t)(site - start) / interval) * num_haplotypes + k);
+                    if (ret != 0) {
+                        goto out;
+                    }
+                }
+                /* Runs of sites with no mutations (and so with a uniform
+                 * emission probability) quickly reach a fixed point, after
+                 * which we can skip the per-site work. */
+                if (repeatable
+                    && ancestor_matcher_same_site_update(self, site, haplotype)) {
+                    ret = ancestor_matcher_repeat_site_state(self, site);
+                } else {
+                    ret = ancestor_matcher_update_site_state(self, site, haplotype[site],
+                        parent, self->likelihood, &repeatable);
+                }
+                if (ret != 0) {
+                    goto out;
+                }
             }
         }
 
@@ -905,59 +2018,26 @@ ancestor_matcher_run_forwards_match(
         while (out_index < M && out[out_index].right == right) {
             edge = out[out_index];
             out_index++;
-            remove_edge(edge, parent, left_child, right_child, left_sib, right_sib);
-            assert(L[edge.child] != NONZERO_ROOT_LIKELIHOOD);
-            if (L[edge.child] == NULL_LIKELIHOOD) {
-                u = edge.parent;
-                while (likely(L[u] == NULL_LIKELIHOOD)
-                       && likely(L_cache[u] == CACHE_UNSET)) {
-                    u = parent[u];
-                }
-                L_child = L_cache[u];
-                if (unlikely(L_child == CACHE_UNSET)) {
-                    L_child = L[u];
-                }
-                assert(L_child >= 0);
-                u = edge.parent;
-                /* Fill in the cache by traversing back upwards */
-                while (likely(L[u] == NULL_LIKELIHOOD)
-                       && likely(L_cache[u] == CACHE_UNSET)) {
-                    L_cache[u] = L_child;
-                    u = parent[u];
-                }
-                L[edge.child] = L_child;
-                self->likelihood_nodes[self->num_likelihood_nodes] = edge.child;
-                self->num_likelihood_nodes++;
+            remove_edge(edge, parent, num_children, &self->root);
+            for (k = 0; k < num_haplotypes; k++) {
+                ancestor_matcher_select_haplotype(self, k);
+                ancestor_matcher_remove_edge_likelihood(self, edge, parent);
             }
         }
-        /* reset the L cache */
-        for (l = remove_start; l < out_index; l++) {
-            edge = out[l];
-            u = edge.parent;
-            while (likely(L_cache[u] != CACHE_UNSET)) {
-                L_cache[u] = CACHE_UNSET;
-                u = parent[u];
-            }
+        for (k = 0; k < num_haplotypes; k++) {
+            ancestor_matcher_select_haplotype(self, k);
+            ancestor_matcher_reset_likelihood_cache(
+                self, remove_start, out_index, parent);
         }
 
         left = right;
         while (in_index < M && in[in_index].left == left) {
             edge = in[in_index];
             in_index++;
-            insert_edge(edge, parent, left_child, right_child, left_sib, right_sib);
-            /* Insert zero likelihoods for any nonzero roots that have entered
-             * the tree. Note we don't bother trying to compress the tree here
-             * because this will be done for the next site anyway. */
-            if (unlikely(
-                    edge.parent != 0 && L[edge.parent] == NONZERO_ROOT_LIKELIHOOD)) {
-                L[edge.parent] = 0;
-                self->likelihood_nodes[self->num_likelihood_nodes] = edge.parent;
-                self->num_likelihood_nodes++;
-            }
-            if (unlikely(L[edge.child] == NONZERO_ROOT_LIKELIHOOD)) {
-                L[edge.child] = 0;
-                self->likelihood_nodes[self->num_likelihood_nodes] = edge.child;
-                self->num_likelihood_nodes++;
+            insert_edge(edge, parent, num_children, &self->root);
+            for (k = 0; k < num_haplotypes; k++) {
+                ancestor_matcher_select_haplotype(self, k);
+                ancestor_matcher_insert_edge_likelihood(self, edge);
             }
         }
         right = (tsk_id_t) self->num_sites;
@@ -972,50 +2052,351 @@ out:
     return ret;
 }
 
+/* Restores the per-node state after a successful call to find_paths over
+ * [start, end). The only nodes that can have changed are the endpoints of
+ * edges that were in the tree at some point between start and the first
+ * breakpoint >= end, along with node 0. */
+static void
+ancestor_matcher_restore_nodes(
+    ancestor_matcher_t *self, size_t num_haplotypes, tsk_id_t start, tsk_id_t end)
+{
+    const tree_sequence_builder_t *tsb = self->tree_sequence_builder;
+    const edge_t *restrict in = tsb->left_index_edges;
+    const tsk_id_t *restrict checkpoint_edges = tsb->checkpoints.edges;
+    const size_t M = tsb->num_edges;
+    size_t j, k, num_in_start, num_in_end;
+    edge_t edge;
+    tsk_id_t pos;
+
+    ancestor_matcher_reset_node(self, 0, num_haplotypes);
+    if (M == 0) {
+        return;
+    }
+    num_in_start = left_index_upper_bound(in, M, start);
+    num_in_end
+        = left_index_upper_bound(in, M, ancestor_matcher_next_breakpoint(self, end));
+    pos = num_in_start > 0 ? in[num_in_start - 1].left : 0;
+    k = ancestor_matcher_find_checkpoint(self, num_in_start);
+    for (j = tsb->checkpoints.offset[k]; j < tsb->checkpoints.offset[k + 1]; j++) {
+        edge = in[checkpoint_edges[j]];
+        if (edge.right > pos) {
+            ancestor_matcher_reset_node(self, edge.child, num_haplotypes);
+            ancestor_matcher_reset_node(self, edge.parent, num_haplotypes);
+        }
+    }
+    for (j = tsb->checkpoints.index[k]; j < num_in_end; j++) {
+        edge = in[j];
+        if (edge.right > pos) {
+            ancestor_matcher_reset_node(self, edge.child, num_haplotypes);
+            ancestor_matcher_reset_node(self, edge.parent, num_haplotypes);
+        }
+    }
+}
+
+/* Estimates the number of bytes of traceback and of checkpoint per site for
+ * each haplotype from the matches so far. Returns false if we have nothing to
+ * go on. */
+static bool
+ancestor_matcher_estimate_site_memory(
+    ancestor_matcher_t *self, double *traceback_size, double *checkpoint_size)
+{
+    bool ret = true;
+    double nodes_per_site;
+    /* Each distinct list has a slot in traceback_lists, which is at least a
+     * quarter full */
+    const double list_size = 4.0
+                             * (sizeof(*self->traceback_lists.slot_generation)
+                                 + sizeof(*self->traceback_lists.hash)
+                                 + sizeof(*self->traceback_lists.list));
+
+    if (self->stats.num_traceback_sites > 0) {
+        nodes_per_site = (double) self->stats.num_traceback_nodes
+                         / (double) self->stats.num_traceback_sites;
+        *traceback_size = ((double) self->stats.num_traceback_bytes
+                              + (double) self->stats.num_traceback_lists * list_size)
+                          / (double) self->stats.num_traceback_sites;
+    } else if (self->stats.num_checkpoints > 0) {
+        nodes_per_site = (double) self->stats.num_checkpoint_nodes
+                         / (double) self->stats.num_checkpoints;
+        /* A varint of a uint32_t takes at most 5 bytes */
+        *traceback_size = 5 * nodes_per_site + list_size;
+    } else {
+        ret = false;
+        goto out;
+    }
+    *checkpoint_size
+        = nodes_per_site
+              * (sizeof(*self->likelihood_checkpoints.node)
+                  + sizeof(*self->likelihood_checkpoints.likelihood))
+          + sizeof(*self->likelihood_checkpoints.offset)
+          + sizeof(*self->likelihood_checkpoints.num_likelihood_nodes)
+          + sizeof(*self->likelihood_checkpoints.last_root);
+out:
+    return ret;
+}
+
+/* Returns true if we expect the traceback for num_haplotypes haplotypes over
+ * num_sites sites to fit within the memory limit, so that we don't need
+ * checkpoints. Without a memory limit we always checkpoint. */
+static bool
+ancestor_matcher_traceback_fits(
+    ancestor_matcher_t *self, size_t num_haplotypes, size_t num_sites)
+{
+    bool ret = false;
+    double traceback_size, checkpoint_size;
+    size_t memory;
+
+    if (self->max_memory == 0) {
+        goto out;
+    }
+    ret = ancestor_matcher_estimate_site_memory(self, &traceback_size, &checkpoint_size);
+    if (!ret) {
+        goto out;
+    }
+    /* The traceback blocks and checkpoints that we have are reused */
+    memory = ancestor_matcher_get_memory(self, 0)
+             - ancestor_matcher_get_checkpoint_memory(self)
+             + self->traceback_allocator.chunk_size;
+    ret = memory < self->max_memory
+          && (double) num_haplotypes * (double) num_sites * traceback_size
+                 <= (double) (self->max_memory - memory);
+out:
+    return ret;
+}
+
+/* Returns the checkpoint interval for matching over num_sites sites. With
+ * traceback t and checkpoint c bytes per site, the interval
+ * I = sqrt(num_sites * c / t) minimises the memory for the checkpoints and one
+ * segment of traceback, K * (num_sites / I) * c + K * I * t for K haplotypes.
+ * Until we have estimates for t and c we use sqrt(num_sites). */
+static size_t
+ancestor_matcher_get_checkpoint_interval(ancestor_matcher_t *self, size_t num_sites)
+{
+    size_t interval = (size_t) ceil(sqrt((double) num_sites));
+    double traceback_size, checkpoint_size;
+
+    if (self->max_memory > 0
+        && ancestor_matcher_estimate_site_memory(
+               self, &traceback_size, &checkpoint_size)) {
+        interval = (size_t) ceil(sqrt(
+            (double) num_sites * checkpoint_size / TSK_MAX(traceback_size, 1.0)));
+        interval = TSK_MAX(TSK_MIN(interval, num_sites), 1);
+    }
+    return interval;
+}
+
+/* Finds the paths for the batch over [start, end), splitting it into segments
+ * of the specified number of sites if this is nonzero. We save the likelihoods
+ * at the start of each segment in the forwards pass, and only store the
+ * traceback for one segment at a time. The traceback for each earlier segment
+ * is recomputed by running the forwards pass again from the likelihoods saved
+ * at its start, so that we do about twice as much work in the forwards pass. */
+static int WARN_UNUSED
+ancestor_matcher_find_segmented_paths(ancestor_matcher_t *self, size_t num_haplotypes,
+    tsk_id_t start, tsk_id_t end, allele_t *haplotypes, allele_t *matched_haplotypes,
+    size_t interval)
+{
+    int ret = 0;
+    size_t j, num_segments;
+    tsk_id_t segment_start;
+
+    /* Segment j is [start + j * interval, start + (j + 1) * interval). With
+     * a single segment we don't need any checkpoints. */
+    num_segments = 1;
+    if (interval > 0) {
+        num_segments = ((size_t)(end - start) + interval - 1) / interval;
+        if (num_segments == 1) {
+            interval = 0;
+        }
+    }
+    self->likelihood_checkpoints.interval = interval;
+    ret = ancestor_matcher_reset_checkpoints(
+        self, interval > 0 ? num_segments * num_haplotypes : 0);
+    if (ret != 0) {
+        goto out;
+    }
+    segment_start = start + (tsk_id_t)((num_segments - 1) * interval);
+    self->traceback_start = segment_start;
+    ret = ancestor_matcher_run_forwards_match(
+        self, num_haplotypes, start, end, haplotypes, -1);
+    if (ret != 0) {
+        goto out;
+    }
+    ancestor_matcher_start_traceback(self, num_haplotypes, end);
+    ret = ancestor_matcher_run_traceback(
+        self, num_haplotypes, start, segment_start, end, matched_haplotypes);
+    if (ret != 0) {
+        goto out;
+    }
+    ancestor_matcher_restore_nodes(self, num_haplotypes, start, end);
+    /* Recompute the traceback for the earlier segments in reverse order */
+    for (j = num_segments - 1; j > 0; j--) {
+        segment_start = start + (tsk_id_t)((j - 1) * interval);
+        ret = ancestor_matcher_reset_traceback(self);
+        if (ret != 0) {
+            goto out;
+        }
+        self->traceback_start = segment_start;
+        ret = ancestor_matcher_run_forwards_match(self, num_haplotypes, segment_start,
+            segment_start + (tsk_id_t) interval, haplotypes, (int)(j - 1));
+        if (ret != 0) {
+            goto out;
+        }
+        ret = ancestor_matcher_run_traceback(self, num_haplotypes, start,
+            segment_start, segment_start + (tsk_id_t) interval, matched_haplotypes);
+        if (ret != 0) {
+            goto out;
+        }
+        ancestor_matcher_restore_nodes(
+            self, num_haplotypes, segment_start, segment_start + (tsk_id_t) interval);
+    }
+out:
+    return ret;
+}
+
+/* Resets the state of the batch after a call to find_segmented_paths over
+ * [start, end). If the call failed we don't know how far we got, so we reset
+ * the state of all nodes. */
+static void
+ancestor_matcher_reset_batch(ancestor_matcher_t *self, size_t num_haplotypes,
+    tsk_id_t start, tsk_id_t end, bool failed)
+{
+    size_t k;
+    haplotype_state_t *state;
+
+    if (failed && self->max_nodes > 0) {
+        ancestor_matcher_reset_nodes(self, 0, self->num_nodes);
+    }
+    for (k = 0; k < TSK_MIN(num_haplotypes, self->batch.max_size); k++) {
+        state = &self->batch.state[k];
+        memset(state->traceback + start, 0,
+            ((size_t)(end - start)) * sizeof(*state->traceback));
+        memset(state->max_likelihood_node + start, 0xff,
+            ((size_t)(end - start)) * sizeof(*state->max_likelihood_node));
+    }
+}
+
+/* Finds the paths for a batch of haplotypes over [start, end) in a single pass
+ * through the trees. Haplotype k is read from haplotypes[k * num_sites:] and its
+ * match is written to matched_haplotypes[k * num_sites:]. The output edges for
+ * haplotype k are returned in left_output[k], right_output[k] and
+ * parent_output[k], which are valid until the next call.
+ *
+ * With TSI_CHECKPOINT_TRACEBACK and a memory limit, we only use checkpoints
+ * (see find_segmented_paths) if we don't expect the whole traceback to fit.
+ * If we hit the limit, the traceback and checkpoints stored so far give us
+ * better estimates of the memory needed, so we try again with checkpoints
+ * while these give a different interval. */
 int
-ancestor_matcher_find_path(ancestor_matcher_t *self, tsk_id_t start, tsk_id_t end,
-    allele_t *haplotype, allele_t *matched_haplotype, size_t *num_output_edges,
-    tsk_id_t **left_output, tsk_id_t **right_output, tsk_id_t **parent_output)
+ancestor_matcher_find_paths(ancestor_matcher_t *self, size_t num_haplotypes,
+    tsk_id_t start, tsk_id_t end, allele_t *haplotypes, allele_t *matched_haplotypes,
+    size_t *num_output_edges, tsk_id_t **left_output, tsk_id_t **right_output,
+    tsk_id_t **parent_output)
 {
     int ret = 0;
+    size_t j, k, interval, next_interval;
+    int num_attempts;
+    haplotype_state_t *state;
+    const tsk_id_t *node_id = self->tree_sequence_builder->frozen_nodes.id;
+    const size_t num_sites = (size_t)(end - start);
+    /* The number of times we try again with a different interval */
+    const int max_attempts = 4;
 
     ret = ancestor_matcher_reset(self);
     if (ret != 0) {
         goto out;
     }
-    ret = ancestor_matcher_run_forwards_match(self, start, end, haplotype);
+    ret = ancestor_matcher_expand_batch(self, num_haplotypes);
     if (ret != 0) {
         goto out;
     }
-    ret = ancestor_matcher_run_traceback(self, start, end, haplotype, matched_haplotype);
+    self->batch.size = num_haplotypes;
+    if (num_haplotypes == 0) {
+        goto out;
+    }
+    interval = 0;
+    if ((self->flags & TSI_CHECKPOINT_TRACEBACK)
+        && !ancestor_matcher_traceback_fits(self, num_haplotypes, num_sites)) {
+        interval = ancestor_matcher_get_checkpoint_interval(self, num_sites);
+    }
+    for (num_attempts = 1;; num_attempts++) {
+        ret = ancestor_matcher_find_segmented_paths(
+            self, num_haplotypes, start, end, haplotypes, matched_haplotypes, interval);
+        if (ret != TSI_ERR_MATCHER_MEMORY_LIMIT
+            || !(self->flags & TSI_CHECKPOINT_TRACEBACK)
+            || num_attempts == max_attempts) {
+            break;
+        }
+        next_interval = ancestor_matcher_get_checkpoint_interval(self, num_sites);
+        if (next_interval == interval) {
+            break;
+        }
+        interval = next_interval;
+        ancestor_matcher_reset_batch(self, num_haplotypes, start, end, true);
+        ret = ancestor_matcher_reset_traceback(self);
+        if (ret != 0) {
+            goto out;
+        }
+        self->total_traceback_size = 0;
+    }
     if (ret != 0) {
         goto out;
     }
-    /* Reset some memory for the next call */
-    memset(
-        self->traceback + start, 0, ((size_t)(end - start)) * sizeof(*self->traceback));
-    memset(self->max_likelihood_node + start, 0xff,
-        ((size_t)(end - start)) * sizeof(*self->max_likelihood_node));
-
-    *left_output = self->output.left;
-    *right_output = self->output.right;
-    *parent_output = self->output.parent;
-    *num_output_edges = self->output.size;
+    ancestor_matcher_finish_traceback(self, num_haplotypes, start);
+    ancestor_matcher_save_haplotype(self);
+    for (k = 0; k < num_haplotypes; k++) {
+        state = &self->batch.state[k];
+        /* We work in frozen node ids, so map the output back to node ids */
+        if (node_id != NULL) {
+            for (j = 0; j < state->output.size; j++) {
+                state->output.parent[j] = node_id[state->output.parent[j]];
+            }
+        }
+        left_output[k] = state->output.left;
+        right_output[k] = state->output.right;
+        parent_output[k] = state->output.parent;
+        num_output_edges[k] = state->output.size;
+    }
+    if (self->flags & TSI_EXTENDED_CHECKS) {
+        ancestor_matcher_check_reset_state(self);
+    }
 out:
+    /* Reset some memory for the next call */
+    ancestor_matcher_reset_batch(self, num_haplotypes, start, end, ret != 0);
     return ret;
 }
 
+int
+ancestor_matcher_find_path(ancestor_matcher_t *self, tsk_id_t start, tsk_id_t end,
+    allele_t *haplotype, allele_t *matched_haplotype, size_t *num_output_edges,
+    tsk_id_t **left_output, tsk_id_t **right_output, tsk_id_t **parent_output)
+{
+    return ancestor_matcher_find_paths(self, 1, start, end, haplotype,
+        matched_haplotype, num_output_edges, left_output, right_output, parent_output);
+}
+
 double
 ancestor_matcher_get_mean_traceback_size(ancestor_matcher_t *self)
 {
-    return (double) self->total_traceback_size / ((double) self->num_sites);
+    return (double) self->total_traceback_size
+           / ((double) self->num_sites * (double) TSK_MAX(self->batch.size, 1));
 }
-
 size_t
 ancestor_matcher_get_total_memory(ancestor_matcher_t *self)
 {
-    size_t total = self->traceback_allocator.total_size;
-    /* TODO add contributions from other objects */
+    return ancestor_matcher_get_memory(self, self->traceback_allocator.total_size);
+}
+
+/* Returns the memory needed for the state of each haplotype in a batch when
+ * matching against the current nodes of the tree sequence builder. This
+ * doesn't include the traceback lists, which are shared by the batch. */
+size_t
+ancestor_matcher_get_haplotype_memory(ancestor_matcher_t *self)
+{
+    const size_t max_nodes
+        = TSK_MAX(self->max_nodes, self->tree_sequence_builder->num_nodes);
 
-    return total;
+    return ancestor_matcher_get_haplotype_size(self)
+           + (max_nodes - self->max_nodes)
+                 * ancestor_matcher_get_haplotype_node_size(self);
 }
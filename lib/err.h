@@ -23,6 +23,10 @@
 #define TSI_ERR_BAD_NUM_SAMPLES                                     -19
 #define TSI_ERR_TOO_MANY_SITES                                      -20
 #define TSI_ERR_BAD_FOCAL_SITE                                      -21
+#define TSI_ERR_BAD_GENOTYPE                                        -22
+#define TSI_ERR_BAD_ANCESTOR_INDEX                                  -23
+#define TSI_ERR_ANCESTOR_BUFFER_TOO_SMALL                           -24
+#define TSI_ERR_MATCHER_MEMORY_LIMIT                                -25
 // clang-format on
 
 #ifdef __GNUC__
@@ -27,6 +27,7 @@
 #include <float.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <CUnit/Basic.h>
@@ -117,6 +118,292 @@ dump_tree_sequence_builder(
     free(mut_parent);
 }
 
+/* Checks that each checkpoint lists, in order, exactly the edges inserted before
+ * it that are still present at the last insertion position.
+ */
+static void
+verify_checkpoints(tree_sequence_builder_t *tsb)
+{
+    const edge_t *in = tsb->left_index_edges;
+    size_t j, k, c, offset;
+    tsk_id_t pos;
+
+    CU_ASSERT_FATAL(tsb->checkpoints.size > 0);
+    CU_ASSERT_EQUAL(tsb->checkpoints.index[0], 0);
+    CU_ASSERT_EQUAL(tsb->checkpoints.offset[1], 0);
+    for (k = 1; k < tsb->checkpoints.size; k++) {
+        c = tsb->checkpoints.index[k];
+        CU_ASSERT_FATAL(c > tsb->checkpoints.index[k - 1]);
+        CU_ASSERT_FATAL(c < tsb->num_edges);
+        pos = in[c - 1].left;
+        offset = tsb->checkpoints.offset[k];
+        for (j = 0; j < c; j++) {
+            if (in[j].right > pos) {
+                CU_ASSERT_FATAL(offset < tsb->checkpoints.offset[k + 1]);
+                CU_ASSERT_EQUAL(tsb->checkpoints.edges[offset], (tsk_id_t) j);
+                offset++;
+            }
+        }
+        CU_ASSERT_EQUAL(offset, tsb->checkpoints.offset[k + 1]);
+    }
+}
+
+/* Checks that the frozen node ids are a permutation of the nodes that keeps
+ * node 0 in place, and that the frozen edges are the edges in the left index
+ * with their nodes relabelled.
+ */
+static void
+verify_frozen_nodes(tree_sequence_builder_t *tsb)
+{
+    const tsk_id_t *id = tsb->frozen_nodes.id;
+    const tsk_id_t *frozen_id = tsb->frozen_nodes.frozen_id;
+    avl_node_t *a;
+    edge_t edge;
+    size_t j;
+
+    if (id == NULL) {
+        return;
+    }
+    CU_ASSERT_EQUAL_FATAL(tsb->frozen_nodes.size, tsb->num_nodes);
+    CU_ASSERT_EQUAL(id[0], 0);
+    for (j = 0; j < tsb->num_nodes; j++) {
+        CU_ASSERT_FATAL(id[j] >= 0 && (size_t) id[j] < tsb->num_nodes);
+        CU_ASSERT_EQUAL_FATAL(frozen_id[id[j]], (tsk_id_t) j);
+        CU_ASSERT_EQUAL(tree_sequence_builder_get_node_id(tsb, (tsk_id_t) j), id[j]);
+    }
+    j = 0;
+    for (a = tsb->left_index.head; a != NULL; a = a->next) {
+        edge = ((indexed_edge_t *) a->item)->edge;
+        CU_ASSERT_EQUAL(tsb->left_index_edges[j].left, edge.left);
+        CU_ASSERT_EQUAL(tsb->left_index_edges[j].right, edge.right);
+        CU_ASSERT_EQUAL(tsb->left_index_edges[j].parent, frozen_id[edge.parent]);
+        CU_ASSERT_EQUAL(tsb->left_index_edges[j].child, frozen_id[edge.child]);
+        j++;
+    }
+}
+
+/* Checks that matching the samples in batches with find_paths gives the same
+ * paths and matched haplotypes as matching them one at a time with find_path.
+ */
+static void
+verify_find_paths(ancestor_matcher_t *ancestor_matcher, size_t num_samples,
+    size_t num_sites, allele_t **samples)
+{
+    int ret;
+    size_t batch_size, j, k, num_haplotypes, num_edges;
+    allele_t *haplotypes = malloc(num_samples * num_sites * sizeof(*haplotypes));
+    allele_t *match = malloc(num_samples * num_sites * sizeof(*match));
+    allele_t *single_match = malloc(num_sites * sizeof(*single_match));
+    size_t *num_output_edges = malloc(num_samples * sizeof(*num_output_edges));
+    tsk_id_t **left = malloc(num_samples * sizeof(*left));
+    tsk_id_t **right = malloc(num_samples * sizeof(*right));
+    tsk_id_t **parent = malloc(num_samples * sizeof(*parent));
+    tsk_id_t **left_copy = malloc(num_samples * sizeof(*left_copy));
+    tsk_id_t **right_copy = malloc(num_samples * sizeof(*right_copy));
+    tsk_id_t **parent_copy = malloc(num_samples * sizeof(*parent_copy));
+    tsk_id_t *single_left, *single_right, *single_parent;
+
+    CU_ASSERT_FATAL(haplotypes != NULL);
+    CU_ASSERT_FATAL(match != NULL);
+    CU_ASSERT_FATAL(single_match != NULL);
+    CU_ASSERT_FATAL(num_output_edges != NULL);
+    CU_ASSERT_FATAL(left != NULL && right != NULL && parent != NULL);
+    CU_ASSERT_FATAL(left_copy != NULL && right_copy != NULL && parent_copy != NULL);
+
+    for (j = 0; j < num_samples; j++) {
+        memcpy(haplotypes + j * num_sites, samples[j], num_sites * sizeof(*haplotypes));
+    }
+    for (batch_size = 1; batch_size <= num_samples; batch_size *= 3) {
+        for (j = 0; j < num_samples; j += batch_size) {
+            num_haplotypes = TSK_MIN(batch_size, num_samples - j);
+            ret = ancestor_matcher_find_paths(ancestor_matcher, num_haplotypes, 0,
+                (tsk_id_t) num_sites, haplotypes + j * num_sites,
+                match + j * num_sites, num_output_edges, left, right, parent);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            /* The output buffers are reused by find_path, so take copies */
+            for (k = 0; k < num_haplotypes; k++) {
+                num_edges = num_output_edges[k];
+                left_copy[k] = malloc(num_edges * sizeof(tsk_id_t));
+                right_copy[k] = malloc(num_edges * sizeof(tsk_id_t));
+                parent_copy[k] = malloc(num_edges * sizeof(tsk_id_t));
+                CU_ASSERT_FATAL(left_copy[k] != NULL);
+                CU_ASSERT_FATAL(right_copy[k] != NULL);
+                CU_ASSERT_FATAL(parent_copy[k] != NULL);
+                memcpy(left_copy[k], left[k], num_edges * sizeof(tsk_id_t));
+                memcpy(right_copy[k], right[k], num_edges * sizeof(tsk_id_t));
+                memcpy(parent_copy[k], parent[k], num_edges * sizeof(tsk_id_t));
+            }
+            for (k = 0; k < num_haplotypes; k++) {
+                ret = ancestor_matcher_find_path(ancestor_matcher, 0,
+                    (tsk_id_t) num_sites, samples[j + k], single_match, &num_edges,
+                    &single_left, &single_right, &single_parent);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                CU_ASSERT_EQUAL_FATAL(num_edges, num_output_edges[k]);
+                CU_ASSERT_EQUAL(
+                    memcmp(single_left, left_copy[k], num_edges * sizeof(tsk_id_t)), 0);
+                CU_ASSERT_EQUAL(
+                    memcmp(single_right, right_copy[k], num_edges * sizeof(tsk_id_t)),
+                    0);
+                CU_ASSERT_EQUAL(
+                    memcmp(single_parent, parent_copy[k], num_edges * sizeof(tsk_id_t)),
+                    0);
+                CU_ASSERT_EQUAL(memcmp(single_match, match + (j + k) * num_sites,
+                                    num_sites * sizeof(*match)),
+                    0);
+                free(left_copy[k]);
+                free(right_copy[k]);
+                free(parent_copy[k]);
+            }
+        }
+    }
+
+    free(haplotypes);
+    free(match);
+    free(single_match);
+    free(num_output_edges);
+    free(left);
+    free(right);
+    free(parent);
+    free(left_copy);
+    free(right_copy);
+    free(parent_copy);
+}
+
+/* Checks that matching the samples with a range of memory limits either gives
+ * the same result as without a limit or fails with TSI_ERR_MATCHER_MEMORY_LIMIT,
+ * and that the matcher never reports more memory than its limit.
+ */
+static void
+verify_memory_limit(tree_sequence_builder_t *tsb, double *recombination_rates,
+    double *mismatch_rates, size_t num_samples, size_t num_sites, allele_t **samples,
+    int flags)
+{
+    int ret;
+    ancestor_matcher_t ancestor_matcher;
+    size_t j, required_memory, max_memory;
+    allele_t *haplotypes = malloc(num_samples * num_sites * sizeof(*haplotypes));
+    allele_t *match = malloc(num_samples * num_sites * sizeof(*match));
+    allele_t *limited_match = malloc(num_samples * num_sites * sizeof(*match));
+    size_t *num_output_edges = malloc(num_samples * sizeof(*num_output_edges));
+    tsk_id_t **left = malloc(num_samples * sizeof(*left));
+    tsk_id_t **right = malloc(num_samples * sizeof(*right));
+    tsk_id_t **parent = malloc(num_samples * sizeof(*parent));
+
+    CU_ASSERT_FATAL(haplotypes != NULL);
+    CU_ASSERT_FATAL(match != NULL && limited_match != NULL);
+    CU_ASSERT_FATAL(num_output_edges != NULL);
+    CU_ASSERT_FATAL(left != NULL && right != NULL && parent != NULL);
+
+    for (j = 0; j < num_samples; j++) {
+        memcpy(haplotypes + j * num_sites, samples[j], num_sites * sizeof(*haplotypes));
+    }
+    /* Without a limit, TSI_CHECKPOINT_TRACEBACK would always checkpoint */
+    ret = ancestor_matcher_alloc(&ancestor_matcher, tsb, recombination_rates,
+        mismatch_rates, 6, 0, flags & ~TSI_CHECKPOINT_TRACEBACK);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ancestor_matcher_find_paths(&ancestor_matcher, num_samples, 0,
+        (tsk_id_t) num_sites, haplotypes, match, num_output_edges, left, right, parent);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    /* The memory we need, without the unused part of the traceback blocks */
+    required_memory = ancestor_matcher_get_total_memory(&ancestor_matcher)
+                      - ancestor_matcher.traceback_allocator.total_size
+                      + ancestor_matcher.traceback_allocator.total_allocated;
+    ancestor_matcher_free(&ancestor_matcher);
+
+    for (j = 1; j <= 16; j *= 2) {
+        max_memory = required_memory * j / 4;
+        ret = ancestor_matcher_alloc(&ancestor_matcher, tsb, recombination_rates,
+            mismatch_rates, 6, max_memory, flags);
+        if (ret == 0) {
+            ret = ancestor_matcher_find_paths(&ancestor_matcher, num_samples, 0,
+                (tsk_id_t) num_sites, haplotypes, limited_match, num_output_edges,
+                left, right, parent);
+            CU_ASSERT_TRUE(
+                ancestor_matcher_get_total_memory(&ancestor_matcher) <= max_memory);
+        }
+        if (j >= 8) {
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+        }
+        if (ret == 0) {
+            CU_ASSERT_EQUAL(
+                memcmp(match, limited_match, num_samples * num_sites * sizeof(*match)),
+                0);
+        } else {
+            CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_MATCHER_MEMORY_LIMIT);
+        }
+        ancestor_matcher_free(&ancestor_matcher);
+    }
+
+    free(haplotypes);
+    free(match);
+    free(limited_match);
+    free(num_output_edges);
+    free(left);
+    free(right);
+    free(parent);
+}
+
+/* Checks that matching the samples with TSI_CHECKPOINT_TRACEBACK and no memory
+ * limit uses checkpoints and gives the same result as without them.
+ */
+static void
+verify_checkpoint_traceback(tree_sequence_builder_t *tsb, double *recombination_rates,
+    double *mismatch_rates, size_t num_samples, size_t num_sites, allele_t **samples,
+    int flags)
+{
+    int ret;
+    ancestor_matcher_t ancestor_matcher;
+    size_t j;
+    allele_t *haplotypes = malloc(num_samples * num_sites * sizeof(*haplotypes));
+    allele_t *match = malloc(num_samples * num_sites * sizeof(*match));
+    allele_t *checkpoint_match = malloc(num_samples * num_sites * sizeof(*match));
+    size_t *num_output_edges = malloc(num_samples * sizeof(*num_output_edges));
+    tsk_id_t **left = malloc(num_samples * sizeof(*left));
+    tsk_id_t **right = malloc(num_samples * sizeof(*right));
+    tsk_id_t **parent = malloc(num_samples * sizeof(*parent));
+
+    CU_ASSERT_FATAL(haplotypes != NULL);
+    CU_ASSERT_FATAL(match != NULL && checkpoint_match != NULL);
+    CU_ASSERT_FATAL(num_output_edges != NULL);
+    CU_ASSERT_FATAL(left != NULL && right != NULL && parent != NULL);
+
+    for (j = 0; j < num_samples; j++) {
+        memcpy(haplotypes + j * num_sites, samples[j], num_sites * sizeof(*haplotypes));
+    }
+    ret = ancestor_matcher_alloc(&ancestor_matcher, tsb, recombination_rates,
+        mismatch_rates, 6, 0, flags & ~TSI_CHECKPOINT_TRACEBACK);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ancestor_matcher_find_paths(&ancestor_matcher, num_samples, 0,
+        (tsk_id_t) num_sites, haplotypes, match, num_output_edges, left, right, parent);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL(ancestor_matcher.stats.num_checkpoints, 0);
+    ancestor_matcher_free(&ancestor_matcher);
+
+    ret = ancestor_matcher_alloc(&ancestor_matcher, tsb, recombination_rates,
+        mismatch_rates, 6, 0, flags | TSI_CHECKPOINT_TRACEBACK);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ancestor_matcher_find_paths(&ancestor_matcher, num_samples, 0,
+        (tsk_id_t) num_sites, haplotypes, checkpoint_match, num_output_edges, left,
+        right, parent);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    /* With ceil(sqrt(num_sites)) sites per segment, there is more than one
+     * segment if we have at least 3 sites */
+    if (num_sites > 2) {
+        CU_ASSERT_TRUE(ancestor_matcher.stats.num_checkpoints > 0);
+    }
+    CU_ASSERT_EQUAL(
+        memcmp(match, checkpoint_match, num_samples * num_sites * sizeof(*match)), 0);
+    ancestor_matcher_free(&ancestor_matcher);
+
+    free(haplotypes);
+    free(match);
+    free(checkpoint_match);
+    free(num_output_edges);
+    free(left);
+    free(right);
+    free(parent);
+}
+
 /* Given that we have a tree_sequence_builder with the specified state reflected
  * in the specified tables, check that we can population to another
  * tree_sequence_builder_t and get the same output.
@@ -125,6 +412,8 @@ static void
 verify_restore_tsb(tree_sequence_builder_t *tsb, tsk_table_collection_t *tables)
 {
     int ret;
+    size_t j;
+    const size_t num_mutations = tree_sequence_builder_get_num_mutations(tsb);
 
     tree_sequence_builder_t other_tsb;
     tsk_table_collection_t other_tables;
@@ -166,6 +455,16 @@ verify_restore_tsb(tree_sequence_builder_t *tsb, tsk_table_collection_t *tables)
         tree_sequence_builder_get_num_mutations(tsb), site, node, derived_state);
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 
+    /* Restoring the mutations also freezes them, in site order */
+    CU_ASSERT_EQUAL_FATAL(
+        other_tsb.frozen_mutations.offset[other_tsb.num_sites], num_mutations);
+    for (j = 0; j < num_mutations; j++) {
+        CU_ASSERT_TRUE(other_tsb.frozen_mutations.offset[site[j]] <= j);
+        CU_ASSERT_TRUE(j < other_tsb.frozen_mutations.offset[site[j] + 1]);
+        CU_ASSERT_EQUAL(other_tsb.frozen_mutations.node[j], node[j]);
+        CU_ASSERT_EQUAL(other_tsb.frozen_mutations.derived_state[j], derived_state[j]);
+    }
+
     dump_tree_sequence_builder(&other_tsb, &other_tables, 0);
 
     CU_ASSERT_TRUE_FATAL(tsk_table_collection_equals(tables, &other_tables));
@@ -329,9 +628,11 @@ initialise_builder(tree_sequence_builder_t *tsb, double oldest_time)
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 }
 
+/* The TSI_RELABEL_NODES flag is passed to the tree sequence builder and the
+ * other flags to the matcher. */
 static void
-run_random_data(size_t num_samples, size_t num_sites, int seed,
-    double recombination_rate, double mismatch_rate)
+run_random_data_flags(size_t num_samples, size_t num_sites, int seed,
+    double recombination_rate, double mismatch_rate, int flags)
 {
     tsk_table_collection_t tables;
     ancestor_builder_t ancestor_builder;
@@ -361,10 +662,11 @@ run_random_data(size_t num_samples, size_t num_sites, int seed,
     CU_ASSERT_FATAL(num_samples >= 2);
     ret = ancestor_builder_alloc(&ancestor_builder, num_samples, num_sites, 0);
     CU_ASSERT_EQUAL_FATAL(ret, 0);
-    ret = tree_sequence_builder_alloc(&tsb, num_sites, NULL, 1, 1, 0);
+    ret = tree_sequence_builder_alloc(
+        &tsb, num_sites, NULL, 1, 1, flags & TSI_RELABEL_NODES);
     CU_ASSERT_EQUAL_FATAL(ret, 0);
     ret = ancestor_matcher_alloc(&ancestor_matcher, &tsb, recombination_rates,
-        mismatch_rates, 6, TSI_EXTENDED_CHECKS);
+        mismatch_rates, 6, 0, TSI_EXTENDED_CHECKS | (flags & ~TSI_RELABEL_NODES));
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 
     for (j = 0; j < num_sites; j++) {
@@ -389,6 +691,8 @@ run_random_data(size_t num_samples, size_t num_sites, int seed,
             /* printf("NEW EPOCH: %f\n", ad.time); */
             ret = tree_sequence_builder_freeze_indexes(&tsb);
             CU_ASSERT_EQUAL_FATAL(ret, 0);
+            verify_checkpoints(&tsb);
+            verify_frozen_nodes(&tsb);
             time = ad.time;
         }
         ret = tree_sequence_builder_add_node(&tsb, ad.time, 0);
@@ -410,12 +714,19 @@ run_random_data(size_t num_samples, size_t num_sites, int seed,
     /* Add the samples */
     ret = tree_sequence_builder_freeze_indexes(&tsb);
     CU_ASSERT_EQUAL_FATAL(ret, 0);
+    verify_checkpoints(&tsb);
+    verify_frozen_nodes(&tsb);
     for (j = 0; j < num_samples; j++) {
         ret = tree_sequence_builder_add_node(&tsb, 0, TSK_NODE_IS_SAMPLE);
         CU_ASSERT_FATAL(ret >= 0);
         child = ret;
         add_haplotype(&tsb, &ancestor_matcher, child, 0, num_sites, samples[j]);
     }
+    verify_find_paths(&ancestor_matcher, num_samples, num_sites, samples);
+    verify_memory_limit(&tsb, recombination_rates, mismatch_rates, num_samples,
+        num_sites, samples, flags & ~TSI_RELABEL_NODES);
+    verify_checkpoint_traceback(&tsb, recombination_rates, mismatch_rates,
+        num_samples, num_sites, samples, flags & ~TSI_RELABEL_NODES);
     ancestor_matcher_print_state(&ancestor_matcher, _devnull);
     tree_sequence_builder_print_state(&tsb, _devnull);
 
@@ -438,6 +749,14 @@ run_random_data(size_t num_samples, size_t num_sites, int seed,
     free(mismatch_rates);
 }
 
+static void
+run_random_data(size_t num_samples, size_t num_sites, int seed,
+    double recombination_rate, double mismatch_rate)
+{
+    run_random_data_flags(
+        num_samples, num_sites, seed, recombination_rate, mismatch_rate, 0);
+}
+
 static void
 test_ancestor_builder_errors(void)
 {
@@ -445,6 +764,7 @@ test_ancestor_builder_errors(void)
     ancestor_builder_t ancestor_builder;
     allele_t genotypes_ones[4] = { 1, 1, 1, 1 };
     allele_t genotypes_zeros[4] = { 0, 0, 0, 0 };
+    allele_t genotypes_bad[4] = { 0, 1, 2, 0 };
     tsk_id_t start, end;
     allele_t haplotype[4];
 
@@ -463,6 +783,13 @@ test_ancestor_builder_errors(void)
     CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_TOO_MANY_SITES);
     ancestor_builder_free(&ancestor_builder);
 
+    ret = ancestor_builder_alloc(&ancestor_builder, 4, 1, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ancestor_builder_add_site(&ancestor_builder, 4, genotypes_bad);
+    CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_BAD_GENOTYPE);
+    CU_ASSERT_EQUAL_FATAL(ancestor_builder.num_sites, 0);
+    ancestor_builder_free(&ancestor_builder);
+
     ret = ancestor_builder_alloc(&ancestor_builder, 4, 2, 0);
     CU_ASSERT_EQUAL_FATAL(ret, 0);
     ret = ancestor_builder_add_site(&ancestor_builder, 4, genotypes_zeros);
@@ -514,6 +841,173 @@ test_ancestor_builder_one_site(void)
     ancestor_builder_free(&ancestor_builder);
 }
 
+static void
+test_ancestor_builder_add_sites(void)
+{
+    int ret = 0;
+    ancestor_builder_t ancestor_builder;
+    /* Site 0: singleton; 1: derived frequency 1/2; 2: fixed among known
+     * genotypes; 3: derived frequency 2/3; 4: excluded by the caller */
+    allele_t genotypes[5][4] = {
+        { 0, 1, 0, 0 },
+        { 0, 1, 1, 0 },
+        { 1, 1, -1, 1 },
+        { 1, 1, 0, -1 },
+        { 1, 1, 0, 0 },
+    };
+    double time[5] = { TSI_TIME_UNSPECIFIED, TSI_TIME_UNSPECIFIED,
+        TSI_TIME_UNSPECIFIED, TSI_TIME_UNSPECIFIED, 0.5 };
+    bool use_site[5] = { true, true, true, true, false };
+
+    ret = ancestor_builder_alloc(&ancestor_builder, 4, 5, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ancestor_builder_add_sites(
+        &ancestor_builder, 5, time, (allele_t *) genotypes, use_site);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_FALSE(use_site[0]);
+    CU_ASSERT_TRUE(use_site[1]);
+    CU_ASSERT_FALSE(use_site[2]);
+    CU_ASSERT_TRUE(use_site[3]);
+    CU_ASSERT_FALSE(use_site[4]);
+    CU_ASSERT_EQUAL_FATAL(ancestor_builder.num_sites, 2);
+    CU_ASSERT_EQUAL(ancestor_builder.sites[0].time, 0.5);
+    CU_ASSERT_EQUAL(ancestor_builder.sites[1].time, 2.0 / 3.0);
+
+    ret = ancestor_builder_finalise(&ancestor_builder);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL_FATAL(ancestor_builder.num_ancestors, 2);
+    CU_ASSERT_EQUAL(ancestor_builder.descriptors[0].time, 2.0 / 3.0);
+    CU_ASSERT_EQUAL(ancestor_builder.descriptors[0].focal_sites[0], 1);
+    CU_ASSERT_EQUAL(ancestor_builder.descriptors[1].time, 0.5);
+    CU_ASSERT_EQUAL(ancestor_builder.descriptors[1].focal_sites[0], 0);
+    ancestor_builder_print_state(&ancestor_builder, _devnull);
+
+    ancestor_builder_free(&ancestor_builder);
+}
+
+static void
+test_ancestor_builder_add_packed_sites(void)
+{
+    int ret = 0;
+    ancestor_builder_t ancestor_builder;
+    /* The same genotypes as test_ancestor_builder_add_sites, packed into
+     * derived and missing bit-planes. */
+    uint64_t genotypes[5][2] = {
+        { 0x2, 0x0 },
+        { 0x6, 0x0 },
+        { 0xb, 0x4 },
+        { 0x3, 0x8 },
+        { 0x3, 0x0 },
+    };
+    uint64_t bad_padding[1][2] = { { 0x13, 0x0 } };
+    uint64_t bad_missing[1][2] = { { 0x3, 0x1 } };
+    double time[5] = { TSI_TIME_UNSPECIFIED, TSI_TIME_UNSPECIFIED,
+        TSI_TIME_UNSPECIFIED, TSI_TIME_UNSPECIFIED, 0.5 };
+    bool use_site[5] = { true, true, true, true, false };
+
+    ret = ancestor_builder_alloc(&ancestor_builder, 4, 5, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ancestor_builder_add_packed_sites(
+        &ancestor_builder, 1, time, (uint64_t *) bad_padding, use_site);
+    CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_BAD_GENOTYPE);
+    ret = ancestor_builder_add_packed_sites(
+        &ancestor_builder, 1, time, (uint64_t *) bad_missing, use_site);
+    CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_BAD_GENOTYPE);
+    CU_ASSERT_EQUAL_FATAL(ancestor_builder.num_sites, 0);
+
+    ret = ancestor_builder_add_packed_sites(
+        &ancestor_builder, 5, time, (uint64_t *) genotypes, use_site);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_FALSE(use_site[0]);
+    CU_ASSERT_TRUE(use_site[1]);
+    CU_ASSERT_FALSE(use_site[2]);
+    CU_ASSERT_TRUE(use_site[3]);
+    CU_ASSERT_FALSE(use_site[4]);
+    CU_ASSERT_EQUAL_FATAL(ancestor_builder.num_sites, 2);
+    CU_ASSERT_EQUAL(ancestor_builder.sites[0].time, 0.5);
+    CU_ASSERT_EQUAL(ancestor_builder.sites[1].time, 2.0 / 3.0);
+    /* The genotypes are not copied */
+    CU_ASSERT_EQUAL(ancestor_builder.sites[0].derived, genotypes[1]);
+    CU_ASSERT_EQUAL(ancestor_builder.sites[0].missing, NULL);
+    CU_ASSERT_EQUAL(ancestor_builder.sites[1].derived, genotypes[3]);
+    CU_ASSERT_EQUAL(ancestor_builder.sites[1].missing, genotypes[3] + 1);
+
+    ret = ancestor_builder_finalise(&ancestor_builder);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL_FATAL(ancestor_builder.num_ancestors, 2);
+    CU_ASSERT_EQUAL(ancestor_builder.descriptors[0].time, 2.0 / 3.0);
+    CU_ASSERT_EQUAL(ancestor_builder.descriptors[0].focal_sites[0], 1);
+    CU_ASSERT_EQUAL(ancestor_builder.descriptors[1].time, 0.5);
+    CU_ASSERT_EQUAL(ancestor_builder.descriptors[1].focal_sites[0], 0);
+    ancestor_builder_print_state(&ancestor_builder, _devnull);
+
+    ancestor_builder_free(&ancestor_builder);
+}
+
+static void
+test_ancestor_builder_make_ancestors(void)
+{
+    int ret = 0;
+    ancestor_builder_t ancestor_builder;
+    allele_t genotypes[5][5] = {
+        { 0, 1, 1, 0, 1 },
+        { 1, 1, 0, 0, 0 },
+        { 0, 1, 1, 1, 1 },
+        { 1, 0, 1, -1, 0 },
+        { 0, 1, 1, 0, 0 },
+    };
+    allele_t haplotype[5];
+    allele_t buffer[11];
+    tsk_id_t start[5], end[5], s, e;
+    size_t j, num_made, first, offset;
+    ancestor_descriptor_t *ad;
+
+    ret = ancestor_builder_alloc(&ancestor_builder, 5, 5, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (j = 0; j < 5; j++) {
+        ret = ancestor_builder_add_site(
+            &ancestor_builder, (double) (j % 3), genotypes[j]);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+    }
+    ret = ancestor_builder_finalise(&ancestor_builder);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_FATAL(ancestor_builder.num_ancestors > 1);
+
+    ret = ancestor_builder_make_ancestors(&ancestor_builder, 0,
+        ancestor_builder.num_ancestors + 1, 11, buffer, start, end, &num_made);
+    CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_BAD_ANCESTOR_INDEX);
+    ret = ancestor_builder_make_ancestors(&ancestor_builder, 1, 0, 11, buffer, start,
+        end, &num_made);
+    CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_BAD_ANCESTOR_INDEX);
+    ret = ancestor_builder_make_ancestors(&ancestor_builder, 0,
+        ancestor_builder.num_ancestors, 4, buffer, start, end, &num_made);
+    CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_ANCESTOR_BUFFER_TOO_SMALL);
+
+    /* The buffer is too small to hold all the ancestors, so we need
+     * several calls. */
+    first = 0;
+    while (first < ancestor_builder.num_ancestors) {
+        ret = ancestor_builder_make_ancestors(&ancestor_builder, first,
+            ancestor_builder.num_ancestors, 11, buffer, start, end, &num_made);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        CU_ASSERT_FATAL(num_made > 0);
+        offset = 0;
+        for (j = 0; j < num_made; j++) {
+            ad = &ancestor_builder.descriptors[first + j];
+            ret = ancestor_builder_make_ancestor(&ancestor_builder,
+                ad->num_focal_sites, ad->focal_sites, &s, &e, haplotype);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            CU_ASSERT_EQUAL_FATAL(start[j], s);
+            CU_ASSERT_EQUAL_FATAL(end[j], e);
+            CU_ASSERT_FATAL(
+                memcmp(buffer + offset, haplotype + s, (size_t)(e - s)) == 0);
+            offset += (size_t)(e - s);
+        }
+        first += num_made;
+    }
+    ancestor_builder_free(&ancestor_builder);
+}
+
 static void
 test_matching_one_site(void)
 {
@@ -536,7 +1030,7 @@ test_matching_one_site(void)
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 
     ret = ancestor_matcher_alloc(
-        &ancestor_matcher, &tsb, &recombination_rate, &mismatch_rate, 12, 0);
+        &ancestor_matcher, &tsb, &recombination_rate, &mismatch_rate, 12, 0, 0);
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 
     ret = ancestor_matcher_find_path(
@@ -576,6 +1070,58 @@ test_matching_one_site(void)
     tsk_table_collection_free(&tables);
 }
 
+static void
+test_matching_memory_limit(void)
+{
+    int ret;
+    ancestor_matcher_t ancestor_matcher;
+    tree_sequence_builder_t tsb;
+    allele_t haplotype[1] = { 0 };
+    allele_t match[1];
+    double recombination_rate = 0;
+    double mismatch_rate = 0;
+    size_t num_edges, total_memory, max_memory;
+    tsk_id_t *left, *right, *parent;
+
+    ret = tree_sequence_builder_alloc(&tsb, 1, NULL, 1, 1, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = tree_sequence_builder_add_node(&tsb, 2.0, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = tree_sequence_builder_freeze_indexes(&tsb);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    /* The limit must leave room for the memory allocated up front */
+    ret = ancestor_matcher_alloc(
+        &ancestor_matcher, &tsb, &recombination_rate, &mismatch_rate, 12, 1, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, TSI_ERR_MATCHER_MEMORY_LIMIT);
+    ancestor_matcher_free(&ancestor_matcher);
+
+    /* Matching within the limit succeeds, and repeatedly as the traceback
+     * storage is reused between calls. */
+    max_memory = 1024 * 1024;
+    ret = ancestor_matcher_alloc(&ancestor_matcher, &tsb, &recombination_rate,
+        &mismatch_rate, 12, max_memory, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ancestor_matcher_find_path(
+        &ancestor_matcher, 0, 1, haplotype, match, &num_edges, &left, &right, &parent);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL(num_edges, 1);
+    CU_ASSERT_EQUAL(parent[0], 0);
+    total_memory = ancestor_matcher_get_total_memory(&ancestor_matcher);
+    CU_ASSERT_TRUE(total_memory > 0);
+    CU_ASSERT_TRUE(total_memory <= max_memory);
+    CU_ASSERT_TRUE(ancestor_matcher_get_haplotype_memory(&ancestor_matcher) > 0);
+    CU_ASSERT_TRUE(
+        ancestor_matcher_get_haplotype_memory(&ancestor_matcher) < total_memory);
+    ret = ancestor_matcher_find_path(
+        &ancestor_matcher, 0, 1, haplotype, match, &num_edges, &left, &right, &parent);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL(ancestor_matcher_get_total_memory(&ancestor_matcher), total_memory);
+    ancestor_matcher_free(&ancestor_matcher);
+
+    tree_sequence_builder_free(&tsb);
+}
+
 static void
 test_matching_one_site_many_alleles(void)
 {
@@ -623,7 +1169,7 @@ test_matching_one_site_many_alleles(void)
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 
     ret = ancestor_matcher_alloc(
-        &ancestor_matcher, &tsb, &recombination_rate, &mismatch_rate, 12, 0);
+        &ancestor_matcher, &tsb, &recombination_rate, &mismatch_rate, 12, 0, 0);
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 
     haplotype = 0;
@@ -753,6 +1299,45 @@ test_tsb_errors(void)
     tree_sequence_builder_free(&tsb);
 }
 
+static void
+test_tsb_reserve_nodes(void)
+{
+    int ret;
+    tree_sequence_builder_t tsb;
+    size_t j, max_nodes, num_resizes;
+
+    ret = tree_sequence_builder_alloc(&tsb, 1, NULL, 1, 1, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL_FATAL(tsb.max_nodes, 1);
+
+    /* Adding nodes one at a time doubles the capacity */
+    num_resizes = 0;
+    max_nodes = tsb.max_nodes;
+    for (j = 0; j < 1000; j++) {
+        ret = tree_sequence_builder_add_node(&tsb, (double) j, 0);
+        CU_ASSERT_EQUAL_FATAL(ret, (int) j);
+        if (tsb.max_nodes != max_nodes) {
+            CU_ASSERT_EQUAL_FATAL(tsb.max_nodes, 2 * max_nodes);
+            max_nodes = tsb.max_nodes;
+            num_resizes++;
+        }
+    }
+    CU_ASSERT_EQUAL_FATAL(num_resizes, 10);
+
+    ret = tree_sequence_builder_reserve_nodes(&tsb, 10);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL_FATAL(tsb.max_nodes, 1024);
+    ret = tree_sequence_builder_reserve_nodes(&tsb, 5000);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL_FATAL(tsb.max_nodes, 5000);
+    for (j = 0; j < tsb.max_nodes; j++) {
+        CU_ASSERT_FATAL(tsb.path[j] == NULL);
+    }
+    CU_ASSERT_EQUAL_FATAL(tsb.num_nodes, 1000);
+
+    tree_sequence_builder_free(&tsb);
+}
+
 static void
 test_random_data_n5_m3(void)
 {
@@ -804,6 +1389,46 @@ test_random_data_n100_m100(void)
     run_random_data(100, 100, 42, 1e-20, 1e-3);
 }
 
+static void
+test_random_data_n5_m5000(void)
+{
+    /* Enough sites to span several blocks of sites in the ancestor builder */
+    run_random_data(5, 5000, 42, 1e-3, 1e-20);
+}
+
+static void
+test_random_data_n300_m100(void)
+{
+    /* Enough samples to span several words of the sample bitsets */
+    run_random_data(300, 100, 42, 1e-3, 1e-20);
+}
+
+static void
+test_random_data_checkpoint_traceback(void)
+{
+    int seed;
+
+    for (seed = 1; seed < 10; seed++) {
+        run_random_data_flags(10, 100, seed, 1e-3, 1e-20, TSI_CHECKPOINT_TRACEBACK);
+        run_random_data_flags(10, 100, seed, 1e-20, 1e-3, TSI_CHECKPOINT_TRACEBACK);
+    }
+    run_random_data_flags(5, 3, 42, 1e-3, 1e-20, TSI_CHECKPOINT_TRACEBACK);
+    run_random_data_flags(100, 100, 42, 1e-3, 1e-20, TSI_CHECKPOINT_TRACEBACK);
+}
+
+static void
+test_random_data_relabel_nodes(void)
+{
+    int seed;
+
+    for (seed = 1; seed < 10; seed++) {
+        run_random_data_flags(10, 100, seed, 1e-3, 1e-20, TSI_RELABEL_NODES);
+        run_random_data_flags(10, 100, seed, 1e-20, 1e-3, TSI_RELABEL_NODES);
+    }
+    run_random_data_flags(
+        100, 100, 42, 1e-3, 1e-20, TSI_RELABEL_NODES | TSI_CHECKPOINT_TRACEBACK);
+}
+
 static int
 tsinfer_suite_init(void)
 {
@@ -859,11 +1484,17 @@ main(int argc, char **argv)
     CU_TestInfo tests[] = {
         { "test_ancestor_builder_errors", test_ancestor_builder_errors },
         { "test_ancestor_builder_one_site", test_ancestor_builder_one_site },
+        { "test_ancestor_builder_add_sites", test_ancestor_builder_add_sites },
+        { "test_ancestor_builder_add_packed_sites",
+            test_ancestor_builder_add_packed_sites },
+        { "test_ancestor_builder_make_ancestors", test_ancestor_builder_make_ancestors },
         /* TODO more ancestor builder tests */
         { "test_matching_one_site", test_matching_one_site },
         { "test_matching_one_site_many_alleles", test_matching_one_site_many_alleles },
+        { "test_matching_memory_limit", test_matching_memory_limit },
 
         { "test_tsb_errors", test_tsb_errors },
+        { "test_tsb_reserve_nodes", test_tsb_reserve_nodes },
 
         { "test_random_data_n5_m3", test_random_data_n5_m3 },
         { "test_random_data_n5_m20", test_random_data_n5_m20 },
@@ -871,6 +1502,11 @@ main(int argc, char **argv)
         { "test_random_data_n10_m100", test_random_data_n10_m100 },
         { "test_random_data_n100_m10", test_random_data_n100_m10 },
         { "test_random_data_n100_m100", test_random_data_n100_m100 },
+        { "test_random_data_n5_m5000", test_random_data_n5_m5000 },
+        { "test_random_data_n300_m100", test_random_data_n300_m100 },
+        { "test_random_data_checkpoint_traceback",
+            test_random_data_checkpoint_traceback },
+        { "test_random_data_relabel_nodes", test_random_data_relabel_nodes },
 
         CU_TEST_INFO_NULL,
     };
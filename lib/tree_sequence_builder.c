@@ -224,8 +224,11 @@ tree_sequence_builder_alloc(tree_sequence_builder_t *self, size_t num_sites,
     self->path = calloc(self->max_nodes, sizeof(*self->path));
     self->sites.mutations = calloc(self->num_sites, sizeof(*self->sites.mutations));
     self->sites.num_alleles = calloc(self->num_sites, sizeof(*self->sites.num_alleles));
+    /* There are no frozen mutations until the first freeze */
+    self->frozen_mutations.offset
+        = calloc(self->num_sites + 1, sizeof(*self->frozen_mutations.offset));
     if (self->time == NULL || self->node_flags == NULL || self->path == NULL
-        || self->sites.mutations == NULL) {
+        || self->sites.mutations == NULL || self->frozen_mutations.offset == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
@@ -273,6 +276,14 @@ tree_sequence_builder_free(tree_sequence_builder_t *self)
     tsi_safe_free(self->sites.num_alleles);
     tsi_safe_free(self->left_index_edges);
     tsi_safe_free(self->right_index_edges);
+    tsi_safe_free(self->checkpoints.index);
+    tsi_safe_free(self->checkpoints.offset);
+    tsi_safe_free(self->checkpoints.edges);
+    tsi_safe_free(self->frozen_mutations.offset);
+    tsi_safe_free(self->frozen_mutations.node);
+    tsi_safe_free(self->frozen_mutations.derived_state);
+    tsi_safe_free(self->frozen_nodes.id);
+    tsi_safe_free(self->frozen_nodes.frozen_id);
     tsk_blkalloc_free(&self->tsk_blkalloc);
     object_heap_free(&self->avl_node_heap);
     object_heap_free(&self->edge_heap);
@@ -332,34 +343,43 @@ tree_sequence_builder_free_edge(tree_sequence_builder_t *self, indexed_edge_t *e
     object_heap_free_object(&self->edge_heap, edge);
 }
 
-static int WARN_UNUSED
-tree_sequence_builder_expand_nodes(tree_sequence_builder_t *self)
+/* Ensures that there is space for at least num_nodes nodes. The capacity
+ * grows geometrically (by at least nodes_chunk_size), so that the matchers,
+ * which follow max_nodes, only need to resize once per doubling. */
+int WARN_UNUSED
+tree_sequence_builder_reserve_nodes(tree_sequence_builder_t *self, size_t num_nodes)
 {
     int ret = 0;
     void *tmp;
+    size_t max_nodes = self->max_nodes;
 
-    self->max_nodes += self->nodes_chunk_size;
-    tmp = realloc(self->time, self->max_nodes * sizeof(double));
+    if (num_nodes <= max_nodes) {
+        goto out;
+    }
+    max_nodes = TSK_MAX(max_nodes + self->nodes_chunk_size, 2 * max_nodes);
+    max_nodes = TSK_MAX(max_nodes, num_nodes);
+    tmp = realloc(self->time, max_nodes * sizeof(double));
     if (tmp == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
     self->time = tmp;
-    tmp = realloc(self->node_flags, self->max_nodes * sizeof(uint32_t));
+    tmp = realloc(self->node_flags, max_nodes * sizeof(uint32_t));
     if (tmp == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
     self->node_flags = tmp;
-    tmp = realloc(self->path, self->max_nodes * sizeof(edge_t *));
+    tmp = realloc(self->path, max_nodes * sizeof(edge_t *));
     if (tmp == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
     self->path = tmp;
     /* Zero out the extra nodes. */
-    memset(self->path + self->num_nodes, 0,
-        (self->max_nodes - self->num_nodes) * sizeof(edge_t *));
+    memset(self->path + self->max_nodes, 0,
+        (max_nodes - self->max_nodes) * sizeof(edge_t *));
+    self->max_nodes = max_nodes;
 out:
     return ret;
 }
@@ -370,11 +390,9 @@ tree_sequence_builder_add_node(
 {
     int ret = 0;
 
-    if (self->num_nodes == self->max_nodes) {
-        ret = tree_sequence_builder_expand_nodes(self);
-        if (ret != 0) {
-            goto out;
-        }
+    ret = tree_sequence_builder_reserve_nodes(self, self->num_nodes + 1);
+    if (ret != 0) {
+        goto out;
     }
     assert(self->num_nodes < self->max_nodes);
     ret = (int) self->num_nodes;
@@ -875,6 +893,215 @@ out:
     return ret;
 }
 
+/* Builds the checkpoints over the frozen left index. The list for a checkpoint
+ * at index c contains the edges e < c with right > left_index_edges[c - 1].left,
+ * which is a superset of the edges present in any tree that we load using it.
+ * We take a new checkpoint once the number of edges inserted since the last one
+ * exceeds the size of its list, so that the total size of the lists is at most
+ * twice the number of edges and loading a tree takes time proportional to its
+ * size. */
+static int WARN_UNUSED
+tree_sequence_builder_make_checkpoints(tree_sequence_builder_t *self)
+{
+    int ret = 0;
+    const edge_t *restrict in = self->left_index_edges;
+    const size_t M = self->num_edges;
+    const size_t min_interval = 64;
+    size_t j, k, last, next, size, max_checkpoints;
+    size_t *restrict index, *restrict offset;
+    tsk_id_t *restrict edges;
+    tsk_id_t pos;
+
+    tsi_safe_free(self->checkpoints.index);
+    tsi_safe_free(self->checkpoints.offset);
+    tsi_safe_free(self->checkpoints.edges);
+    max_checkpoints = M / min_interval + 2;
+    self->checkpoints.size = 0;
+    self->checkpoints.index = malloc(max_checkpoints * sizeof(size_t));
+    self->checkpoints.offset = malloc((max_checkpoints + 1) * sizeof(size_t));
+    self->checkpoints.edges = malloc((2 * M + 1) * sizeof(tsk_id_t));
+    index = self->checkpoints.index;
+    offset = self->checkpoints.offset;
+    edges = self->checkpoints.edges;
+    if (index == NULL || offset == NULL || edges == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+
+    /* The first checkpoint is the empty tree */
+    k = 0;
+    index[0] = 0;
+    offset[0] = 0;
+    offset[1] = 0;
+    last = 0;
+    size = 0;
+    while (true) {
+        next = last + TSK_MAX(min_interval, size);
+        if (next >= M) {
+            break;
+        }
+        k++;
+        assert(k < max_checkpoints);
+        pos = in[next - 1].left;
+        index[k] = next;
+        offset[k + 1] = offset[k];
+        for (j = offset[k - 1]; j < offset[k]; j++) {
+            if (in[edges[j]].right > pos) {
+                edges[offset[k + 1]] = edges[j];
+                offset[k + 1]++;
+            }
+        }
+        for (j = last; j < next; j++) {
+            if (in[j].right > pos) {
+                edges[offset[k + 1]] = (tsk_id_t) j;
+                offset[k + 1]++;
+            }
+        }
+        assert(offset[k + 1] <= 2 * M);
+        size = offset[k + 1] - offset[k];
+        last = next;
+    }
+    self->checkpoints.size = k + 1;
+out:
+    return ret;
+}
+
+/* Copies the per-site mutation lists into the contiguous frozen_mutations
+ * arrays, so that the matchers can read the mutations at a site sequentially. */
+static int WARN_UNUSED
+tree_sequence_builder_freeze_mutations(tree_sequence_builder_t *self)
+{
+    int ret = 0;
+    size_t j, k;
+    mutation_list_node_t *u;
+    const tsk_id_t *restrict frozen_id = self->frozen_nodes.frozen_id;
+
+    tsi_safe_free(self->frozen_mutations.node);
+    tsi_safe_free(self->frozen_mutations.derived_state);
+    self->frozen_mutations.node = malloc(
+        TSK_MAX(self->num_mutations, 1) * sizeof(*self->frozen_mutations.node));
+    self->frozen_mutations.derived_state = malloc(
+        TSK_MAX(self->num_mutations, 1) * sizeof(*self->frozen_mutations.derived_state));
+    if (self->frozen_mutations.node == NULL
+        || self->frozen_mutations.derived_state == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    k = 0;
+    for (j = 0; j < self->num_sites; j++) {
+        self->frozen_mutations.offset[j] = k;
+        for (u = self->sites.mutations[j]; u != NULL; u = u->next) {
+            self->frozen_mutations.node[k]
+                = frozen_id == NULL ? u->node : frozen_id[u->node];
+            self->frozen_mutations.derived_state[k] = u->derived_state;
+            k++;
+        }
+    }
+    assert(k == self->num_mutations);
+    self->frozen_mutations.offset[self->num_sites] = k;
+out:
+    return ret;
+}
+
+/* Assigns the frozen node ids for TSI_RELABEL_NODES. We take the parent of the
+ * leftmost edge of each node as its representative parent, which gives a forest
+ * whose root paths are typical of the root paths in the trees. The frozen ids
+ * are then the preorder of this forest, so that each subtree occupies a
+ * contiguous block of ids above its root. Node 0 has no edges, and so keeps
+ * frozen id 0. */
+static int WARN_UNUSED
+tree_sequence_builder_relabel_nodes(tree_sequence_builder_t *self)
+{
+    int ret = 0;
+    const size_t N = self->num_nodes;
+    size_t j, k, l, stack_top;
+    tsk_id_t u, v;
+    tsk_id_t *restrict id, *restrict frozen_id;
+    size_t *restrict child_offset = NULL;
+    tsk_id_t *restrict children = NULL;
+    tsk_id_t *restrict stack = NULL;
+
+    tsi_safe_free(self->frozen_nodes.id);
+    tsi_safe_free(self->frozen_nodes.frozen_id);
+    self->frozen_nodes.size = N;
+    self->frozen_nodes.id = malloc(TSK_MAX(N, 1) * sizeof(tsk_id_t));
+    self->frozen_nodes.frozen_id = malloc(TSK_MAX(N, 1) * sizeof(tsk_id_t));
+    child_offset = calloc(N + 1, sizeof(*child_offset));
+    children = malloc(TSK_MAX(N, 1) * sizeof(*children));
+    stack = malloc(TSK_MAX(N, 1) * sizeof(*stack));
+    id = self->frozen_nodes.id;
+    frozen_id = self->frozen_nodes.frozen_id;
+    if (id == NULL || frozen_id == NULL || child_offset == NULL || children == NULL
+        || stack == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+
+    /* Sort the children of each representative parent by id */
+    for (j = 0; j < N; j++) {
+        if (self->path[j] != NULL) {
+            child_offset[(size_t) self->path[j]->edge.parent + 1]++;
+        }
+    }
+    for (j = 0; j < N; j++) {
+        child_offset[j + 1] += child_offset[j];
+    }
+    for (j = 0; j < N; j++) {
+        if (self->path[j] != NULL) {
+            v = self->path[j]->edge.parent;
+            children[child_offset[v]] = (tsk_id_t) j;
+            child_offset[v]++;
+        }
+    }
+    for (j = N; j > 0; j--) {
+        child_offset[j] = child_offset[j - 1];
+    }
+    child_offset[0] = 0;
+
+    /* Parents are older than their children, so every node is reached from
+     * one of the nodes with no edges. */
+    k = 0;
+    for (j = 0; j < N; j++) {
+        if (self->path[j] != NULL) {
+            continue;
+        }
+        stack[0] = (tsk_id_t) j;
+        stack_top = 1;
+        while (stack_top > 0) {
+            stack_top--;
+            u = stack[stack_top];
+            id[k] = u;
+            frozen_id[u] = (tsk_id_t) k;
+            k++;
+            /* Push in reverse so that we visit the children in id order */
+            for (l = child_offset[u + 1]; l > child_offset[u]; l--) {
+                stack[stack_top] = children[l - 1];
+                stack_top++;
+            }
+        }
+    }
+    assert(k == N);
+    assert(N == 0 || id[0] == 0);
+out:
+    tsi_safe_free(child_offset);
+    tsi_safe_free(children);
+    tsi_safe_free(stack);
+    return ret;
+}
+
+static inline edge_t
+tree_sequence_builder_frozen_edge(
+    const tsk_id_t *restrict frozen_id, const indexed_edge_t *indexed_edge)
+{
+    edge_t edge = indexed_edge->edge;
+
+    if (frozen_id != NULL) {
+        edge.parent = frozen_id[edge.parent];
+        edge.child = frozen_id[edge.child];
+    }
+    return edge;
+}
+
 /* Freeze the tree traversal indexes from the state of the dynamic AVL
  * tree based indexes. This is done because it is *much* more efficient
  * to get the edges sequentially than to find the randomly around memory
@@ -888,7 +1115,15 @@ tree_sequence_builder_freeze_indexes(tree_sequence_builder_t *self)
     int ret = 0;
     avl_node_t *restrict a;
     size_t j = 0;
+    const tsk_id_t *frozen_id;
 
+    if (self->flags & TSI_RELABEL_NODES) {
+        ret = tree_sequence_builder_relabel_nodes(self);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    frozen_id = self->frozen_nodes.frozen_id;
     tsi_safe_free(self->left_index_edges);
     tsi_safe_free(self->right_index_edges);
     self->num_edges = avl_count(&self->left_index);
@@ -903,14 +1138,21 @@ tree_sequence_builder_freeze_indexes(tree_sequence_builder_t *self)
 
     j = 0;
     for (a = self->left_index.head; a != NULL; a = a->next) {
-        self->left_index_edges[j] = ((indexed_edge_t *) a->item)->edge;
+        self->left_index_edges[j]
+            = tree_sequence_builder_frozen_edge(frozen_id, a->item);
         j++;
     }
     j = 0;
     for (a = self->right_index.head; a != NULL; a = a->next) {
-        self->right_index_edges[j] = ((indexed_edge_t *) a->item)->edge;
+        self->right_index_edges[j]
+            = tree_sequence_builder_frozen_edge(frozen_id, a->item);
         j++;
     }
+    ret = tree_sequence_builder_make_checkpoints(self);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = tree_sequence_builder_freeze_mutations(self);
 out:
     return ret;
 }
@@ -922,6 +1164,10 @@ tree_sequence_builder_restore_nodes(
     int ret = -1;
     size_t j;
 
+    ret = tree_sequence_builder_reserve_nodes(self, self->num_nodes + num_nodes);
+    if (ret != 0) {
+        goto out;
+    }
     for (j = 0; j < num_nodes; j++) {
         ret = tree_sequence_builder_add_node(self, time[j], flags[j]);
         if (ret < 0) {
@@ -992,6 +1238,9 @@ tree_sequence_builder_restore_mutations(tree_sequence_builder_t *self,
             goto out;
         }
     }
+    /* Sample matching runs straight after restoring, so make the mutations
+     * visible to the matcher. */
+    ret = tree_sequence_builder_freeze_indexes(self);
 out:
     return ret;
 }
@@ -1062,6 +1311,15 @@ tree_sequence_builder_get_num_nodes(tree_sequence_builder_t *self)
     return self->num_nodes;
 }
 
+/* Returns the id of the node with the specified frozen id. */
+tsk_id_t
+tree_sequence_builder_get_node_id(tree_sequence_builder_t *self, tsk_id_t frozen_id)
+{
+    assert(self->frozen_nodes.id == NULL
+           || (frozen_id >= 0 && (size_t) frozen_id < self->frozen_nodes.size));
+    return self->frozen_nodes.id == NULL ? frozen_id : self->frozen_nodes.id[frozen_id];
+}
+
 size_t
 tree_sequence_builder_get_num_edges(tree_sequence_builder_t *self)
 {
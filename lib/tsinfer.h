@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <math.h>
 
 #include "tskit.h"
 #include "err.h"
@@ -31,18 +32,26 @@
 #define TSK_MISSING_DATA (-1)
 
 /* NULL_LIKELIHOOD represents a compressed path and NONZERO_ROOT_LIKELIHOOD
- * marks a node that is not in the current tree. */
+ * marks a node that is not in the current tree. While we walk up the tree,
+ * a likelihood of CACHED_LIKELIHOOD - v on a compressed path caches the fact
+ * that the likelihood of the path is that of node v. */
 #define NULL_LIKELIHOOD (-1)
 #define NONZERO_ROOT_LIKELIHOOD (-2)
+#define CACHED_LIKELIHOOD (-3)
 
 #define NULL_NODE (-1)
-#define CACHE_UNSET (-1)
 
 #define TSI_COMPRESS_PATH 1
 #define TSI_EXTENDED_CHECKS 2
+#define TSI_CHECKPOINT_TRACEBACK 8
+/* Flags for tree_sequence_builder_alloc */
+#define TSI_RELABEL_NODES 16
 
 #define TSI_NODE_IS_PC_ANCESTOR ((tsk_flags_t)(1u << 16))
 
+/* Equal to constants.TIME_UNSPECIFIED in the Python package */
+#define TSI_TIME_UNSPECIFIED (-INFINITY)
+
 typedef int8_t allele_t;
 
 typedef struct {
@@ -64,9 +73,16 @@ typedef struct _node_segment_list_node_t {
     struct _node_segment_list_node_t *next;
 } node_segment_list_node_t;
 
+/* Genotypes in the ancestor builder are stored as bit-planes over the
+ * samples. Bit j of the derived plane is set if sample j carries the derived
+ * allele, and bit j of the missing plane is set if sample j has missing data.
+ * The missing plane is NULL for sites with no missing data. The planes are
+ * either owned by the builder or, for packed sites, point into memory owned
+ * by the caller. */
 typedef struct {
     double time;
-    allele_t *genotypes;
+    const uint64_t *derived;
+    const uint64_t *missing;
 } site_t;
 
 typedef struct {
@@ -81,11 +97,14 @@ typedef struct _site_list_t {
     struct _site_list_t *next;
 } site_list_t;
 
-typedef struct {
-    allele_t *genotypes;
-    size_t num_samples;
+typedef struct _pattern_map_t {
+    const uint64_t *derived;
+    const uint64_t *missing;
+    uint64_t hash;
+    size_t num_words;
     size_t num_sites;
     site_list_t *sites;
+    struct _pattern_map_t *next; /* Next pattern in the same hash bucket */
 } pattern_map_t;
 
 typedef struct {
@@ -94,19 +113,28 @@ typedef struct {
     tsk_id_t *focal_sites;
 } ancestor_descriptor_t;
 
-/* Maps all ancestors with a specific time to their genotype patterns  */
+/* Maps all ancestors with a specific time to their genotype patterns, using
+ * a chained hash table keyed by the hash of the pattern's bitsets. */
 typedef struct {
     double time;
-    avl_tree_t pattern_map;
+    size_t num_patterns;
+    size_t num_buckets;
+    pattern_map_t **buckets;
 } time_map_t;
 
 typedef struct {
     size_t num_sites;
     size_t max_sites;
     size_t num_samples;
+    size_t num_words; /* Number of 64 bit words in a sample bitset */
     size_t num_ancestors;
     int flags;
     site_t *sites;
+    /* The maximum site time within each block of 64 sites, and each superblock
+     * of 4096 sites, used to skip over runs of younger sites. */
+    double *block_time;
+    double *superblock_time;
+    uint64_t *genotype_buffer;
     avl_tree_t time_map;
     tsk_blkalloc_t allocator;
     ancestor_descriptor_t *descriptors;
@@ -118,12 +146,31 @@ typedef struct _mutation_list_node_t {
     struct _mutation_list_node_t *next;
 } mutation_list_node_t;
 
+/* The nodes and recombination_required flags of a traceback list are encoded
+ * in data as the sorted keys (node << 1) | recombination_required, each
+ * stored as a varint of the difference from the previous key. */
 typedef struct {
     int32_t size;
-    tsk_id_t *node;
-    int8_t *recombination_required;
+    uint32_t num_bytes;
+    uint8_t *data;
 } node_state_list_t;
 
+/* The forwards pass and traceback state of a single haplotype. */
+typedef struct {
+    double *likelihood;
+    tsk_id_t *likelihood_nodes;
+    int num_likelihood_nodes;
+    tsk_id_t last_root;
+    tsk_id_t *max_likelihood_node;
+    node_state_list_t *traceback;
+    struct {
+        tsk_id_t *left;
+        tsk_id_t *right;
+        tsk_id_t *parent;
+        size_t size;
+    } output;
+} haplotype_state_t;
+
 typedef struct {
     int flags;
     size_t num_sites;
@@ -154,6 +201,36 @@ typedef struct {
     edge_t *left_index_edges;
     edge_t *right_index_edges;
     size_t num_edges; /* the number of edges in the frozen indexes */
+    /* Checkpoints into the frozen left index, used to load the tree at an
+     * arbitrary position without replaying the edges from the start. Checkpoint
+     * j is taken after inserting the first index[j] edges and lists, in left
+     * index order, the edges edges[offset[j]:offset[j + 1]] that are still
+     * present in the tree. */
+    struct {
+        size_t size;
+        size_t *index;
+        size_t *offset;
+        tsk_id_t *edges;
+    } checkpoints;
+    /* The mutations frozen along with the edge indexes, which are the ones used
+     * for matching. The mutations at site j are node[offset[j]:offset[j + 1]]
+     * with derived states derived_state[offset[j]:offset[j + 1]], in the order
+     * they were added. The linked lists in sites are only used for building. */
+    struct {
+        size_t *offset;
+        tsk_id_t *node;
+        allele_t *derived_state;
+    } frozen_mutations;
+    /* With TSI_RELABEL_NODES, the frozen edges and mutations refer to the nodes
+     * by their frozen ids, which put nodes that are likely to be on the same
+     * root path close together in memory. Frozen id j is node id[j], and node u
+     * has frozen id frozen_id[u], for the size nodes present at the last freeze.
+     * Otherwise, id and frozen_id are NULL and the ids are the same. */
+    struct {
+        size_t size;
+        tsk_id_t *id;
+        tsk_id_t *frozen_id;
+    } frozen_nodes;
 } tree_sequence_builder_t;
 
 typedef struct {
@@ -166,25 +243,84 @@ typedef struct {
     unsigned int precision;
     double *recombination_rate;
     double *mismatch_rate;
-    /* The quintuply linked tree */
+    /* The tree. We only need the parent of each node and its number of children
+     * to tell whether it is a root. Node 0 has at most one child, the root of
+     * the tree, and root is the XOR of its children (or 0 if it has none). */
     tsk_id_t *parent;
-    tsk_id_t *left_child;
-    tsk_id_t *right_child;
-    tsk_id_t *left_sib;
-    tsk_id_t *right_sib;
+    int32_t *num_children;
+    tsk_id_t root;
+    /* The likelihoods of the current haplotype, which also hold the cache of
+     * path likelihoods while we walk up the tree. With likelihood_nodes, this
+     * is all of the per-node state that each haplotype in a batch needs. */
     double *likelihood;
-    double *likelihood_cache;
     allele_t *allelic_state;
     int num_likelihood_nodes;
     /* At each site, record a node with the maximum likelihood. */
     tsk_id_t *max_likelihood_node;
     /* Used during traceback to map nodes where recombination is required. */
     int8_t *recombination_required;
-    tsk_id_t *likelihood_nodes_tmp;
     tsk_id_t *likelihood_nodes;
+    /* Dense per-site state for the likelihood nodes, stored in the same order
+     * as likelihood_nodes so that the likelihood update runs over contiguous
+     * memory. These and the traceback buffers have space for max_size nodes,
+     * and grow as needed. */
+    struct {
+        size_t max_size;
+        double *likelihood;
+        allele_t *allelic_state;
+        int8_t *recombination_required;
+    } site_state;
     node_state_list_t *traceback;
     tsk_blkalloc_t traceback_allocator;
     size_t total_traceback_size;
+    /* The maximum amount of memory that we can use, or 0 for no limit */
+    size_t max_memory;
+    /* Totals over all of the traceback lists and checkpoints stored by this
+     * matcher, from which we estimate the memory needed by later calls. */
+    struct {
+        size_t num_traceback_sites;
+        size_t num_traceback_nodes;
+        size_t num_traceback_lists;
+        size_t num_traceback_bytes;
+        size_t num_checkpoints;
+        size_t num_checkpoint_nodes;
+    } stats;
+    /* Buffers used to encode the traceback list for a site */
+    uint32_t *traceback_keys;
+    uint8_t *traceback_buffer;
+    /* Open addressing hash table of the traceback lists stored in the current
+     * call, so that identical lists are only stored once. Slots are in use if
+     * their generation matches the current generation. */
+    struct {
+        size_t size;
+        size_t max_size;
+        uint32_t generation;
+        uint32_t *slot_generation;
+        uint32_t *hash;
+        node_state_list_t *list;
+    } traceback_lists;
+    /* Only sites >= traceback_start are stored in the traceback */
+    tsk_id_t traceback_start;
+    /* With TSI_CHECKPOINT_TRACEBACK, the forwards pass saves the likelihoods
+     * every interval sites and only keeps the traceback for the last segment.
+     * With a memory limit, the interval is chosen to fit within it, and
+     * otherwise it is the square root of the number of sites.
+     * The traceback for the earlier segments is then recomputed from these
+     * checkpoints. For a batch of K haplotypes, the likelihood nodes of
+     * haplotype k at checkpoint j are stored in node (and their values in
+     * likelihood), starting at offset[j * K + k]. */
+    struct {
+        size_t interval;
+        size_t size;
+        size_t max_size;
+        size_t num_values;
+        size_t max_values;
+        size_t *offset;
+        int *num_likelihood_nodes;
+        tsk_id_t *last_root;
+        tsk_id_t *node;
+        double *likelihood;
+    } likelihood_checkpoints;
     struct {
         tsk_id_t *left;
         tsk_id_t *right;
@@ -192,6 +328,16 @@ typedef struct {
         size_t size;
         size_t max_size;
     } output;
+    /* find_paths matches a batch of haplotypes through a single traversal of
+     * the trees. Each haplotype has its own state, and the likelihood,
+     * traceback and output fields above refer to the state of the current
+     * haplotype. */
+    struct {
+        size_t size;
+        size_t max_size;
+        size_t current;
+        haplotype_state_t *state;
+    } batch;
 } ancestor_matcher_t;
 
 int ancestor_builder_alloc(
@@ -200,26 +346,42 @@ int ancestor_builder_free(ancestor_builder_t *self);
 int ancestor_builder_print_state(ancestor_builder_t *self, FILE *out);
 int ancestor_builder_add_site(
     ancestor_builder_t *self, double time, allele_t *genotypes);
+int ancestor_builder_add_sites(ancestor_builder_t *self, size_t num_sites,
+    double *time, allele_t *genotypes, bool *use_site);
+int ancestor_builder_add_packed_sites(ancestor_builder_t *self, size_t num_sites,
+    double *time, const uint64_t *genotypes, bool *use_site);
 int ancestor_builder_make_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
     tsk_id_t *focal_sites, tsk_id_t *start, tsk_id_t *end, allele_t *haplotype);
+int ancestor_builder_make_ancestors(ancestor_builder_t *self, size_t first, size_t last,
+    size_t buffer_size, allele_t *buffer, tsk_id_t *start, tsk_id_t *end,
+    size_t *num_made);
 int ancestor_builder_finalise(ancestor_builder_t *self);
 
 int ancestor_matcher_alloc(ancestor_matcher_t *self,
     tree_sequence_builder_t *tree_sequence_builder, double *recombination_rate,
-    double *mismatch_rate, unsigned int precision, int flags);
+    double *mismatch_rate, unsigned int precision, size_t max_memory, int flags);
 int ancestor_matcher_free(ancestor_matcher_t *self);
 int ancestor_matcher_find_path(ancestor_matcher_t *self, tsk_id_t start, tsk_id_t end,
     allele_t *haplotype, allele_t *matched_haplotype, size_t *num_output_edges,
     tsk_id_t **left_output, tsk_id_t **right_output, tsk_id_t **parent_output);
+int ancestor_matcher_find_paths(ancestor_matcher_t *self, size_t num_haplotypes,
+    tsk_id_t start, tsk_id_t end, allele_t *haplotypes, allele_t *matched_haplotypes,
+    size_t *num_output_edges, tsk_id_t **left_output, tsk_id_t **right_output,
+    tsk_id_t **parent_output);
 int ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out);
 double ancestor_matcher_get_mean_traceback_size(ancestor_matcher_t *self);
+void node_state_list_decode(
+    const node_state_list_t *self, tsk_id_t *node, int8_t *recombination_required);
 size_t ancestor_matcher_get_total_memory(ancestor_matcher_t *self);
+size_t ancestor_matcher_get_haplotype_memory(ancestor_matcher_t *self);
 
 int tree_sequence_builder_alloc(tree_sequence_builder_t *self, size_t num_sites,
     tsk_size_t *num_alleles, size_t nodes_chunk_size, size_t edges_chunk_size,
     int flags);
 int tree_sequence_builder_print_state(tree_sequence_builder_t *self, FILE *out);
 int tree_sequence_builder_free(tree_sequence_builder_t *self);
+int tree_sequence_builder_reserve_nodes(
+    tree_sequence_builder_t *self, size_t num_nodes);
 int tree_sequence_builder_add_node(
     tree_sequence_builder_t *self, double time, uint32_t flags);
 int tree_sequence_builder_add_path(tree_sequence_builder_t *self, tsk_id_t child,
@@ -231,6 +393,8 @@ int tree_sequence_builder_add_mutations(tree_sequence_builder_t *self, tsk_id_t
 int tree_sequence_builder_freeze_indexes(tree_sequence_builder_t *self);
 
 size_t tree_sequence_builder_get_num_nodes(tree_sequence_builder_t *self);
+tsk_id_t tree_sequence_builder_get_node_id(
+    tree_sequence_builder_t *self, tsk_id_t frozen_id);
 size_t tree_sequence_builder_get_num_edges(tree_sequence_builder_t *self);
 size_t tree_sequence_builder_get_num_mutations(tree_sequence_builder_t *self);
 
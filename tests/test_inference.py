@@ -954,6 +954,44 @@ class TestThreads(TsinferTestCase):
         self.assertTreeSequencesEqual(ts1, ts2)
 
 
+class TestPipeline(TsinferTestCase):
+    def verify(self, sample_data, **kwargs):
+        ts1 = tsinfer.infer(sample_data, **kwargs)
+        ts2 = tsinfer.infer(sample_data, pipeline=True, **kwargs)
+        self.assertTreeSequencesEqual(ts1, ts2)
+
+    def test_simulated(self):
+        ts = msprime.simulate(10, mutation_rate=2, recombination_rate=2, random_seed=3)
+        sample_data = tsinfer.SampleData.from_tree_sequence(ts)
+        self.verify(sample_data)
+        self.verify(sample_data, num_threads=3)
+        self.verify(sample_data, engine=tsinfer.PY_ENGINE)
+
+    def test_exclude_positions(self):
+        ts = msprime.simulate(10, mutation_rate=2, recombination_rate=2, random_seed=4)
+        sample_data = tsinfer.SampleData.from_tree_sequence(ts)
+        exclude = [site.position for site in ts.sites()][::3]
+        self.verify(sample_data, exclude_positions=exclude)
+
+    def test_no_inference_sites(self):
+        ts = msprime.simulate(10, mutation_rate=2, random_seed=5)
+        sample_data = tsinfer.SampleData.from_tree_sequence(ts)
+        exclude = [site.position for site in ts.sites()]
+        self.verify(sample_data, exclude_positions=exclude)
+
+    def test_small_queue(self):
+        ts = msprime.simulate(10, mutation_rate=5, recombination_rate=2, random_seed=6)
+        sample_data = tsinfer.SampleData.from_tree_sequence(ts)
+        ancestor_data = tsinfer.generate_ancestors(sample_data)
+        ts1 = tsinfer.match_ancestors(sample_data, ancestor_data)
+        for num_threads in [0, 2]:
+            # Every list of ancestors is queued on its own.
+            ts2 = tsinfer.inference._generate_and_match_ancestors(
+                sample_data, num_threads=num_threads, max_queued_bytes=1
+            )
+            self.assertTreeSequencesEqual(ts1, ts2)
+
+
 class TestAncestorGeneratorsEquivalant(unittest.TestCase):
     """
     Tests for the ancestor generation process.
@@ -1285,6 +1323,57 @@ class TestBuildAncestors(unittest.TestCase):
         ancestor_data = tsinfer.generate_ancestors(sample_data)
         self.verify_ancestors(sample_data, ancestor_data)
 
+    def test_packed_genotypes(self):
+        ts = msprime.simulate(
+            70, recombination_rate=10, mutation_rate=10, random_seed=11
+        )
+        sample_data = tsinfer.SampleData.from_tree_sequence(ts)
+        ancestor_data = tsinfer.generate_ancestors(sample_data)
+        with tempfile.TemporaryDirectory(prefix="tsinf_packed_test") as tmpdir:
+            path = os.path.join(tmpdir, "genotypes.npy")
+            for engine in [tsinfer.C_ENGINE, tsinfer.PY_ENGINE]:
+                # The first pass writes the file and the second reuses it.
+                for _ in range(2):
+                    other = tsinfer.generate_ancestors(
+                        sample_data, genotypes_path=path, engine=engine
+                    )
+                    self.assertTrue(os.path.exists(path))
+                    self.assertTrue(ancestor_data.data_equal(other))
+
+    def test_pack_genotypes(self):
+        for num_samples in [2, 63, 64, 65, 130]:
+            G = np.random.RandomState(num_samples).randint(
+                -1, 2, size=(10, num_samples)
+            ).astype(np.int8)
+            packed = tsinfer.algorithm.pack_genotypes(G)
+            num_words = (num_samples + 63) // 64
+            self.assertEqual(packed.shape, (10, 2 * num_words))
+            for j in range(10):
+                for k in range(num_samples):
+                    word, bit = divmod(k, 64)
+                    derived = (int(packed[j, word]) >> bit) & 1
+                    missing = (int(packed[j, num_words + word]) >> bit) & 1
+                    self.assertEqual(derived, G[j, k] == 1)
+                    self.assertEqual(missing, G[j, k] == tskit.MISSING_DATA)
+            G2 = tsinfer.algorithm.unpack_genotypes(packed, num_samples)
+            self.assertTrue(np.array_equal(G, G2))
+
+    def test_packed_genotypes_wrong_sample_data(self):
+        ts = msprime.simulate(10, mutation_rate=10, random_seed=12)
+        sample_data = tsinfer.SampleData.from_tree_sequence(ts)
+        with tempfile.TemporaryDirectory(prefix="tsinf_packed_test") as tmpdir:
+            path = os.path.join(tmpdir, "genotypes.npy")
+            np.save(path, np.zeros((ts.num_sites + 1, 2), dtype=np.uint64))
+            with self.assertRaises(ValueError):
+                tsinfer.generate_ancestors(sample_data, genotypes_path=path)
+            # A file packed from other sample data of the same shape is rejected
+            os.unlink(path)
+            tsinfer.generate_ancestors(sample_data, genotypes_path=path)
+            other = sample_data.copy()
+            other.finalise()
+            with self.assertRaises(ValueError):
+                tsinfer.generate_ancestors(other, genotypes_path=path)
+
 
 class TestAncestorsTreeSequence(unittest.TestCase):
     """
@@ -1558,6 +1647,7 @@ class AlgorithmsExactlyEqualMixin(object):
 
     path_compression_enabled = True
     precision = None
+    max_matcher_memory = None
 
     def infer(self, ts, engine, path_compression=False, precision=None):
         sample_data = tsinfer.SampleData(sequence_length=ts.sequence_length)
@@ -1574,6 +1664,7 @@ class AlgorithmsExactlyEqualMixin(object):
             engine=engine,
             path_compression=path_compression,
             precision=precision,
+            max_matcher_memory=self.max_matcher_memory,
             extended_checks=True,
         )
         inferred_ts = tsinfer.match_samples(
@@ -1583,6 +1674,7 @@ class AlgorithmsExactlyEqualMixin(object):
             simplify=True,
             path_compression=path_compression,
             precision=precision,
+            max_matcher_memory=self.max_matcher_memory,
             extended_checks=True,
         )
         return inferred_ts
@@ -1709,6 +1801,12 @@ class TestAlgorithmsExactlyEqualPrecision0(
     precision = 0
 
 
+class TestAlgorithmsExactlyEqualCheckpointTraceback(
+    unittest.TestCase, AlgorithmsExactlyEqualMixin
+):
+    max_matcher_memory = 2 ** 30
+
+
 class TestAlgorithmDebugOutput(unittest.TestCase):
     """
     Test routines used to debug output from the algorithm
@@ -1999,6 +2097,113 @@ class TestBadEngine(unittest.TestCase):
             )
 
 
+class TestMaxMatcherMemory(unittest.TestCase):
+    """
+    Tests for limiting the memory used by the matchers, which checkpoints
+    the traceback.
+    """
+
+    def get_example(self):
+        ts = msprime.simulate(10, mutation_rate=5, recombination_rate=2, random_seed=5)
+        return tsinfer.SampleData.from_tree_sequence(ts)
+
+    def test_bad_values(self):
+        sample_data = self.get_example()
+        ancestor_data = tsinfer.generate_ancestors(sample_data)
+        for bad_value in [0, -1]:
+            self.assertRaises(
+                ValueError,
+                tsinfer.match_ancestors,
+                sample_data,
+                ancestor_data,
+                max_matcher_memory=bad_value,
+            )
+
+    def test_same_result(self):
+        sample_data = self.get_example()
+        ts1 = tsinfer.infer(sample_data)
+        for num_threads in [0, 2]:
+            ts2 = tsinfer.infer(
+                sample_data, max_matcher_memory=2 ** 30, num_threads=num_threads
+            )
+            self.assertEqual(ts1.tables.edges, ts2.tables.edges)
+            self.assertEqual(ts1.tables.mutations, ts2.tables.mutations)
+
+    def test_limit_exceeded(self):
+        sample_data = self.get_example()
+        ancestor_data = tsinfer.generate_ancestors(sample_data)
+        with self.assertRaises(_tsinfer.LibraryError):
+            tsinfer.match_ancestors(sample_data, ancestor_data, max_matcher_memory=1)
+
+    def test_small_limits(self):
+        # With small limits, the matchers checkpoint the traceback and match
+        # samples in smaller batches, which doesn't change the result.
+        sample_data = self.get_example()
+        ancestors_ts = tsinfer.match_ancestors(
+            sample_data, tsinfer.generate_ancestors(sample_data)
+        )
+        ts1 = tsinfer.match_samples(sample_data, ancestors_ts)
+        for max_matcher_memory in [2 ** 17, 2 ** 18, 2 ** 20]:
+            ts2 = tsinfer.match_samples(
+                sample_data,
+                ancestors_ts,
+                max_matcher_memory=max_matcher_memory,
+                match_batch_size=100,
+            )
+            self.assertEqual(ts1.tables.edges, ts2.tables.edges)
+            self.assertEqual(ts1.tables.mutations, ts2.tables.mutations)
+
+
+class TestSampleMatchBatchSize(unittest.TestCase):
+    """
+    Tests that matching samples in batches through a single pass of the trees
+    gives the same result as matching them one at a time.
+    """
+
+    def verify(self, sample_data, engine, num_threads):
+        ancestors_ts = tsinfer.match_ancestors(
+            sample_data, tsinfer.generate_ancestors(sample_data), engine=engine
+        )
+        tables = []
+        for batch_size in [1, 3, 16, 100]:
+            ts = tsinfer.match_samples(
+                sample_data,
+                ancestors_ts,
+                engine=engine,
+                num_threads=num_threads,
+                extended_checks=True,
+                match_batch_size=batch_size,
+            )
+            tables.append(ts.dump_tables())
+        for other in tables[1:]:
+            self.assertEqual(tables[0].edges, other.edges)
+            self.assertEqual(tables[0].mutations, other.mutations)
+
+    def get_example(self):
+        ts = msprime.simulate(20, mutation_rate=5, recombination_rate=2, random_seed=6)
+        return tsinfer.SampleData.from_tree_sequence(ts)
+
+    def test_c_engine(self):
+        self.verify(self.get_example(), tsinfer.C_ENGINE, 0)
+
+    def test_c_engine_threads(self):
+        self.verify(self.get_example(), tsinfer.C_ENGINE, 2)
+
+    def test_py_engine(self):
+        self.verify(self.get_example(), tsinfer.PY_ENGINE, 0)
+
+    def test_bad_batch_size(self):
+        sample_data = self.get_example()
+        ancestors_ts = tsinfer.match_ancestors(
+            sample_data, tsinfer.generate_ancestors(sample_data)
+        )
+        for bad_size in [0, -1]:
+            with self.assertRaises(ValueError):
+                tsinfer.match_samples(
+                    sample_data, ancestors_ts, match_batch_size=bad_size
+                )
+
+
 class TestWrongAncestorsTreeSequence(unittest.TestCase):
     """
     Tests covering what happens when we provide an incorrect tree sequence
@@ -19,9 +19,12 @@
 """
 Integrity tests for the low-level module.
 """
+import math
 import sys
 import unittest
 
+import numpy as np
+
 import _tsinfer
 
 
@@ -73,12 +76,55 @@ class TestAncestorMatcher(unittest.TestCase):
             self.assertRaises(
                 TypeError, _tsinfer.AncestorMatcher, tsb, [1], [1], precision=bad_type
             )
+            self.assertRaises(
+                TypeError, _tsinfer.AncestorMatcher, tsb, [1], [1], max_memory=bad_type
+            )
+            self.assertRaises(
+                TypeError,
+                _tsinfer.AncestorMatcher,
+                tsb,
+                [1],
+                [1],
+                checkpoint_traceback=bad_type,
+            )
+        with self.assertRaises(ValueError):
+            _tsinfer.AncestorMatcher(tsb, [1], [1], max_memory=-1)
         for bad_array in [[], [[], []], None, "sdf", [1, 2, 3]]:
             with self.assertRaises(ValueError):
                 _tsinfer.AncestorMatcher(tsb, bad_array, [1])
             with self.assertRaises(ValueError):
                 _tsinfer.AncestorMatcher(tsb, [1], bad_array)
 
+    def test_max_memory(self):
+        tsb = _tsinfer.TreeSequenceBuilder([2])
+        tsb.add_node(2)
+        tsb.freeze_indexes()
+        haplotype = np.zeros(1, dtype=np.int8)
+        match = np.zeros(1, dtype=np.int8)
+        # The limit must leave room for the memory allocated up front
+        with self.assertRaises(_tsinfer.LibraryError):
+            _tsinfer.AncestorMatcher(tsb, [0], [0], max_memory=1)
+        max_memory = 2 ** 20
+        matcher = _tsinfer.AncestorMatcher(tsb, [0], [0], max_memory=max_memory)
+        left, right, parent = matcher.find_path(haplotype, 0, 1, match)
+        self.assertEqual(list(parent), [0])
+        self.assertLessEqual(matcher.total_memory, max_memory)
+        self.assertGreater(matcher.haplotype_memory, 0)
+        self.assertLess(matcher.haplotype_memory, matcher.total_memory)
+
+    def test_find_paths_bad_args(self):
+        tsb = _tsinfer.TreeSequenceBuilder([2, 2])
+        matcher = _tsinfer.AncestorMatcher(tsb, [1, 1], [1, 1])
+        haplotypes = np.zeros((3, 2), dtype=np.int8)
+        match = np.zeros((3, 2), dtype=np.int8)
+        for bad_shape in [(2,), (3, 3), (2, 2, 2)]:
+            with self.assertRaises(ValueError):
+                matcher.find_paths(np.zeros(bad_shape, dtype=np.int8), 0, 2, match)
+        for bad_shape in [(2,), (2, 2), (3, 3)]:
+            with self.assertRaises(ValueError):
+                matcher.find_paths(haplotypes, 0, 2, np.zeros(bad_shape, dtype=np.int8))
+        self.assertRaises(TypeError, matcher.find_paths, haplotypes, 0, 2, None)
+
 
 class TestTreeSequenceBuilder(unittest.TestCase):
     """
@@ -96,6 +142,8 @@ class TestTreeSequenceBuilder(unittest.TestCase):
                 _tsinfer.TreeSequenceBuilder([2], max_nodes=bad_type)
             with self.assertRaises(TypeError):
                 _tsinfer.TreeSequenceBuilder([2], max_edges=bad_type)
+            with self.assertRaises(TypeError):
+                _tsinfer.TreeSequenceBuilder([2], relabel_nodes=bad_type)
 
 
 class TestAncestorBuilder(unittest.TestCase):
@@ -122,6 +170,9 @@ class TestAncestorBuilder(unittest.TestCase):
         for bad_genotypes in ["asdf", [[], []], [0, 1, 2]]:
             with self.assertRaises(ValueError):
                 ab.add_site(time=0, genotypes=bad_genotypes)
+        for bad_genotypes in [[0, 2], [-2, 1], [127, 0]]:
+            with self.assertRaises(_tsinfer.LibraryError):
+                ab.add_site(time=0, genotypes=bad_genotypes)
 
     def test_add_too_many_sites(self):
         for max_sites in range(10):
@@ -132,4 +183,119 @@ class TestAncestorBuilder(unittest.TestCase):
                 with self.assertRaises(_tsinfer.LibraryError):
                     ab.add_site(time=1, genotypes=[0, 1])
 
+    def test_add_sites_bad_args(self):
+        ab = _tsinfer.AncestorBuilder(num_samples=3, max_sites=10)
+        G = [[0, 1, 1]]
+        for bad_genotypes in ["asdf", [0, 1, 1], [[0, 1]], [[[0, 1, 1]]]]:
+            with self.assertRaises(ValueError):
+                ab.add_sites(time=[0], genotypes=bad_genotypes, use_site=[True])
+        for bad_array in [[], [0, 0], [[0]]]:
+            with self.assertRaises(ValueError):
+                ab.add_sites(time=bad_array, genotypes=G, use_site=[True])
+            with self.assertRaises(ValueError):
+                ab.add_sites(time=[0], genotypes=G, use_site=bad_array)
+        with self.assertRaises(_tsinfer.LibraryError):
+            ab.add_sites(time=[0], genotypes=[[0, 2, 2]], use_site=[True])
+
+    def test_add_sites(self):
+        ab = _tsinfer.AncestorBuilder(num_samples=4, max_sites=10)
+        G = [
+            [0, 1, 0, 0],
+            [0, 1, 1, 0],
+            [1, 1, -1, 1],
+            [1, 1, 0, -1],
+            [1, 1, 0, 0],
+        ]
+        time = [-math.inf, -math.inf, -math.inf, -math.inf, 0.5]
+        use_site = [True, True, True, True, False]
+        added = ab.add_sites(time=time, genotypes=G, use_site=use_site)
+        self.assertEqual(list(added), [False, True, False, True, False])
+        self.assertEqual(ab.num_sites, 2)
+        descriptors = ab.ancestor_descriptors()
+        self.assertEqual(len(descriptors), 2)
+        self.assertEqual(descriptors[0][0], 2 / 3)
+        self.assertEqual(list(descriptors[0][1]), [1])
+        self.assertEqual(descriptors[1][0], 0.5)
+        self.assertEqual(list(descriptors[1][1]), [0])
+
+    def test_add_packed_sites_bad_args(self):
+        ab = _tsinfer.AncestorBuilder(num_samples=3, max_sites=10)
+        G = np.zeros((1, 2), dtype=np.uint64)
+        for bad_genotypes in ["asdf", [0, 0], [[0]], [[0, 0, 0]], [[[0, 0]]]]:
+            with self.assertRaises(ValueError):
+                ab.add_packed_sites(time=[0], genotypes=bad_genotypes, use_site=[True])
+        for bad_array in [[], [0, 0], [[0]]]:
+            with self.assertRaises(ValueError):
+                ab.add_packed_sites(time=bad_array, genotypes=G, use_site=[True])
+            with self.assertRaises(ValueError):
+                ab.add_packed_sites(time=[0], genotypes=G, use_site=bad_array)
+        # Bits beyond the last sample must be zero
+        with self.assertRaises(_tsinfer.LibraryError):
+            ab.add_packed_sites(time=[0], genotypes=[[0xF, 0]], use_site=[True])
+        # Samples cannot be both derived and missing
+        with self.assertRaises(_tsinfer.LibraryError):
+            ab.add_packed_sites(time=[0], genotypes=[[0x3, 0x1]], use_site=[True])
+
+    def test_add_packed_sites(self):
+        G = np.array(
+            [
+                [0, 1, 0, 0],
+                [0, 1, 1, 0],
+                [1, 1, -1, 1],
+                [1, 1, 0, -1],
+                [1, 1, 0, 0],
+            ],
+            dtype=np.int8,
+        )
+        # Derived bits followed by missing bits for each site
+        packed = np.array(
+            [[0x2, 0x0], [0x6, 0x0], [0xB, 0x4], [0x3, 0x8], [0x3, 0x0]],
+            dtype=np.uint64,
+        )
+        time = [-math.inf, -math.inf, -math.inf, -math.inf, 0.5]
+        use_site = [True, True, True, True, False]
+        ab1 = _tsinfer.AncestorBuilder(num_samples=4, max_sites=10)
+        ab2 = _tsinfer.AncestorBuilder(num_samples=4, max_sites=10)
+        added1 = ab1.add_sites(time=time, genotypes=G, use_site=use_site)
+        added2 = ab2.add_packed_sites(time=time, genotypes=packed, use_site=use_site)
+        self.assertTrue(np.array_equal(added1, added2))
+        # The builder keeps a reference to the packed genotypes.
+        del packed
+        d1 = ab1.ancestor_descriptors()
+        d2 = ab2.ancestor_descriptors()
+        self.assertEqual(len(d1), len(d2))
+        a1 = np.zeros(5, dtype=np.int8)
+        a2 = np.zeros(5, dtype=np.int8)
+        for (t1, focal1), (t2, focal2) in zip(d1, d2):
+            self.assertEqual(t1, t2)
+            self.assertTrue(np.array_equal(focal1, focal2))
+            self.assertEqual(ab1.make_ancestor(focal1, a1), ab2.make_ancestor(focal2, a2))
+            self.assertTrue(np.array_equal(a1, a2))
+
+    def test_make_ancestors(self):
+        ab = _tsinfer.AncestorBuilder(num_samples=4, max_sites=3)
+        for genotypes in [[0, 1, 1, 0], [1, 1, 0, 0], [0, 1, 1, 1]]:
+            ab.add_site(time=1, genotypes=genotypes)
+        descriptors = ab.ancestor_descriptors()
+        num_ancestors = len(descriptors)
+        buff = np.zeros(3 * num_ancestors, dtype=np.int8)
+        start = np.zeros(num_ancestors, dtype=np.int32)
+        end = np.zeros(num_ancestors, dtype=np.int32)
+        for first, last in [(-1, 1), (1, 0), (0, num_ancestors + 1)]:
+            with self.assertRaises(ValueError):
+                ab.make_ancestors(first, last, buff, start, end)
+        with self.assertRaises(ValueError):
+            ab.make_ancestors(0, num_ancestors, buff[:2], start, end)
+        with self.assertRaises(ValueError):
+            ab.make_ancestors(0, num_ancestors, buff, start[:0], end)
+        num_made = ab.make_ancestors(0, num_ancestors, buff, start, end)
+        self.assertEqual(num_made, num_ancestors)
+        a = np.zeros(3, dtype=np.int8)
+        offset = 0
+        for j, (_, focal_sites) in enumerate(descriptors):
+            s, e = ab.make_ancestor(focal_sites, a)
+            self.assertEqual((s, e), (start[j], end[j]))
+            self.assertTrue(np.array_equal(a[s:e], buff[offset : offset + e - s]))
+            offset += e - s
+
     # TODO need tester methods for the remaining methonds in the class.
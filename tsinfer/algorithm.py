@@ -35,6 +35,42 @@ import attr
 import tsinfer.constants as constants
 
 
+def pack_genotypes(genotypes):
+    """
+    Returns the specified (num_sites, num_samples) genotype matrix packed into
+    the bit-plane format used by AncestorBuilder.add_packed_sites. This is a
+    (num_sites, 2 * num_words) uint64 array, where num_words is the number of 64
+    bit words needed to hold one bit per sample. Each row holds the bits marking
+    the samples that carry allele 1, followed by those marking missing data.
+    """
+    genotypes = np.asarray(genotypes)
+    num_sites, num_samples = genotypes.shape
+    num_bytes = 8 * ((num_samples + 63) // 64)
+    packed = np.zeros((num_sites, 2, num_bytes), dtype=np.uint8)
+    for j, value in enumerate([1, tskit.MISSING_DATA]):
+        packed[:, j, : (num_samples + 7) // 8] = np.packbits(
+            genotypes == value, axis=1, bitorder="little"
+        )
+    return packed.reshape(num_sites, 2 * num_bytes).view("<u8")
+
+
+def unpack_genotypes(packed, num_samples):
+    """
+    Returns the (num_sites, num_samples) genotype matrix for the specified
+    genotypes in the format returned by pack_genotypes.
+    """
+    packed = np.ascontiguousarray(packed, dtype="<u8")
+    bits = np.unpackbits(
+        packed.view(np.uint8).reshape(packed.shape[0], 2, -1),
+        axis=2,
+        count=num_samples,
+        bitorder="little",
+    )
+    genotypes = bits[:, 0].astype(np.int8)
+    genotypes[bits[:, 1] == 1] = tskit.MISSING_DATA
+    return genotypes
+
+
 @attr.s
 class Edge(object):
     """
@@ -75,6 +111,7 @@ class AncestorBuilder(object):
         # It is handy to be able to add to d without checking, so we make this a
         # defaultdict of defaultdicts
         self.time_map = collections.defaultdict(lambda: collections.defaultdict(list))
+        self.descriptors = []
 
     @property
     def num_sites(self):
@@ -94,6 +131,33 @@ class AncestorBuilder(object):
         # Add each site to the list for this ancestor_uid at this timepoint
         sites_at_fixed_timepoint[ancestor_uid].append(site_id)
 
+    def add_sites(self, time, genotypes, use_site):
+        """
+        Adds the sites in the specified (num_sites, num_samples) genotype matrix
+        that are marked in use_site and are suitable for inference. Returns a
+        boolean array marking the sites that were added.
+        """
+        use_site = np.array(use_site, dtype=bool)
+        for j in np.where(use_site)[0]:
+            n_known = np.sum(genotypes[j] != tskit.MISSING_DATA)
+            n_derived = n_known - np.sum(genotypes[j] == 0)
+            use_site[j] = n_derived > 1 and n_derived < n_known
+            if use_site[j]:
+                site_time = time[j]
+                if site_time == constants.TIME_UNSPECIFIED:
+                    site_time = n_derived / n_known
+                self.add_site(site_time, genotypes[j])
+        return use_site
+
+    def add_packed_sites(self, time, genotypes, use_site):
+        """
+        Adds the sites in the specified genotype matrix in the format returned
+        by pack_genotypes, in the same way as add_sites.
+        """
+        return self.add_sites(
+            time, unpack_genotypes(genotypes, self.num_samples), use_site
+        )
+
     def print_state(self):
         print("Ancestor builder")
         print("Sites = ")
@@ -149,8 +213,30 @@ class AncestorBuilder(object):
                         ret.append((t, focal_sites[start : j + 1]))
                         start = j + 1
                 ret.append((t, focal_sites[start:]))
+        self.descriptors = ret
         return ret
 
+    def make_ancestors(self, first, last, haplotypes, start, end):
+        """
+        Makes the ancestors for descriptors first to last - 1, packing their
+        haplotypes contiguously into the haplotypes buffer and stopping when
+        it has less than num_sites space left. Returns the number made.
+        """
+        a = np.zeros(self.num_sites, dtype=np.int8)
+        offset = 0
+        num_made = 0
+        for j in range(first, last):
+            if haplotypes.shape[0] - offset < self.num_sites:
+                break
+            _, focal_sites = self.descriptors[j]
+            s, e = self.make_ancestor(focal_sites, a)
+            haplotypes[offset : offset + e - s] = a[s:e]
+            start[num_made] = s
+            end[num_made] = e
+            offset += e - s
+            num_made += 1
+        return num_made
+
     def compute_ancestral_states(self, a, focal_site, sites):
         """
         For a given focal site, and set of sites to fill in (usually all the ones
@@ -241,7 +327,9 @@ class AncestorBuilder(object):
 
 
 class TreeSequenceBuilder(object):
-    def __init__(self, num_alleles, max_nodes, max_edges):
+    def __init__(self, num_alleles, max_nodes, max_edges, relabel_nodes=False):
+        # Relabelling nodes only changes the memory layout in the C
+        # implementation, so we ignore relabel_nodes here.
         self.num_alleles = num_alleles
         self.num_sites = len(num_alleles)
         self.num_nodes = 0
@@ -627,7 +715,11 @@ class AncestorMatcher(object):
         mismatch_rate=None,
         precision=None,
         extended_checks=False,
+        max_memory=0,
+        checkpoint_traceback=False,
     ):
+        # max_memory and checkpoint_traceback only affect the memory used by
+        # the C implementation, and are ignored here.
         self.tree_sequence_builder = tree_sequence_builder
         self.mismatch_rate = mismatch_rate
         self.recombination_rate = recombination_rate
@@ -643,6 +735,7 @@ class AncestorMatcher(object):
         self.likelihood_nodes = None
         self.allelic_state = None
         self.total_memory = 0
+        self.haplotype_memory = 0
 
     def print_state(self):
         # TODO - don't crash when self.max_likelihood_node or self.traceback == None
@@ -1043,3 +1136,21 @@ class AncestorMatcher(object):
             parent[j] = e.parent
 
         return left, right, parent
+
+    def find_paths(self, haplotypes, start, end, match):
+        """
+        Returns the paths for a batch of haplotypes over the same [start, end)
+        interval, writing the matched haplotypes into the rows of match. The
+        C implementation shares a single traversal of the trees between the
+        haplotypes; here we simply match them one at a time.
+        """
+        paths = []
+        total_traceback_size = 0
+        for h, h_match in zip(haplotypes, match):
+            paths.append(self.find_path(h, start, end, h_match))
+            total_traceback_size += sum(len(t) for t in self.traceback)
+        if len(paths) > 0:
+            self.mean_traceback_size = total_traceback_size / (
+                self.num_sites * len(paths)
+            )
+        return paths
@@ -22,12 +22,14 @@ of the core tasks like ancestor generation and matching are delegated
 to other modules.
 """
 import collections
+import os
 import queue
 import time
 import logging
 import threading
 import json
 import heapq
+import uuid
 
 import numpy as np
 import humanize
@@ -96,7 +98,7 @@ class DummyProgress(object):
     Class that mimics the subset of the tqdm API that we use in this module.
     """
 
-    def update(self):
+    def update(self, n=1):
         pass
 
     def close(self):
@@ -195,13 +197,16 @@ def infer(
     recombination_rate=None,
     mismatch_rate=None,
     precision=None,
+    max_matcher_memory=None,
     exclude_positions=None,
+    pipeline=False,
+    match_batch_size=1,
     engine=constants.C_ENGINE,
     progress_monitor=None,
 ):
     """
     infer(sample_data, *, num_threads=0, path_compression=True, simplify=True,\
-            exclude_positions=None)
+            exclude_positions=None, pipeline=False)
 
     Runs the full :ref:`inference pipeline <sec_inference>` on the specified
     :class:`SampleData` instance and returns the inferred
@@ -226,28 +231,50 @@ def infer(
         main inference process using parsimony. The list does not need to be
         in to be in any particular order, and can include site positions that
         are not present in the sample data file.
+    :param bool pipeline: If True, match the ancestors as soon as they have
+        been generated, so that ancestor generation (using ``num_threads``
+        build threads) runs in the background concurrently with ancestor
+        matching. The generated ancestors are passed to the matcher in memory
+        rather than written to a file first, and generation pauses while about
+        64MiB of haplotypes are waiting to be matched. The inferred tree
+        sequence is identical to that returned when this is False (default).
+    :param int max_matcher_memory: The maximum number of bytes that each match
+        worker may use, or None for no limit (default). If the traceback would
+        not fit within this, the matchers only keep it for one segment of the
+        sequence at a time, and recompute the other segments from checkpoints.
+        Sample matching also uses batches smaller than ``match_batch_size``
+        where these would take more than half of the limit. Matching fails if
+        it cannot fit within the limit.
+    :param int match_batch_size: The number of samples that each match worker
+        matches together in a single pass through the trees (see
+        :func:`match_samples`; default = 1).
     :returns: The :class:`tskit.TreeSequence` object inferred from the
         input sample data.
     :rtype: tskit.TreeSequence
     """
-    ancestor_data = generate_ancestors(
-        sample_data,
-        num_threads=num_threads,
-        exclude_positions=exclude_positions,
-        engine=engine,
-        progress_monitor=progress_monitor,
-    )
-    ancestors_ts = match_ancestors(
-        sample_data,
-        ancestor_data,
+    match_kwargs = dict(
         engine=engine,
         num_threads=num_threads,
         recombination_rate=recombination_rate,
         mismatch_rate=mismatch_rate,
         precision=precision,
+        max_matcher_memory=max_matcher_memory,
         path_compression=path_compression,
         progress_monitor=progress_monitor,
     )
+    if pipeline:
+        ancestors_ts = _generate_and_match_ancestors(
+            sample_data, exclude_positions=exclude_positions, **match_kwargs
+        )
+    else:
+        ancestor_data = generate_ancestors(
+            sample_data,
+            num_threads=num_threads,
+            exclude_positions=exclude_positions,
+            engine=engine,
+            progress_monitor=progress_monitor,
+        )
+        ancestors_ts = match_ancestors(sample_data, ancestor_data, **match_kwargs)
     inferred_ts = match_samples(
         sample_data,
         ancestors_ts,
@@ -256,8 +283,10 @@ def infer(
         recombination_rate=recombination_rate,
         mismatch_rate=mismatch_rate,
         precision=precision,
+        max_matcher_memory=max_matcher_memory,
         path_compression=path_compression,
         simplify=simplify,
+        match_batch_size=match_batch_size,
         progress_monitor=progress_monitor,
     )
     return inferred_ts
@@ -269,13 +298,14 @@ def generate_ancestors(
     num_threads=0,
     path=None,
     exclude_positions=None,
+    genotypes_path=None,
     engine=constants.C_ENGINE,
     progress_monitor=None,
     **kwargs,
 ):
     """
     generate_ancestors(sample_data, *, num_threads=0, path=None, \
-            exclude_positions=None, **kwargs)
+            exclude_positions=None, genotypes_path=None, **kwargs)
 
     Runs the ancestor generation :ref:`algorithm <sec_inference_generate_ancestors>`
     on the specified :class:`SampleData` instance and returns the resulting
@@ -300,6 +330,16 @@ def generate_ancestors(
         for full inference. Sites with these positions will not be used to generate
         ancestors, and not used during the copying process. The list does not
         need be in any particular order.
+    :param str genotypes_path: If specified, the sample genotypes are stored
+        uncompressed as a bit matrix in the file at this path, which is written
+        first if it does not already exist. Ancestors are then generated directly
+        from a read-only memory map of this file rather than from a copy of the
+        genotypes held in memory, so that the operating system manages which
+        parts of the matrix are resident. This allows ancestors to be generated
+        for genotype matrices larger than the available RAM, and allows
+        several processes to share the same genotypes. An existing file must
+        have been written for the same sample data (as identified by its UUID),
+        or a ValueError is raised.
     :rtype: AncestorData
     :returns: The inferred ancestors stored in an :class:`AncestorData` instance.
     """
@@ -310,6 +350,7 @@ def generate_ancestors(
             sample_data,
             ancestor_data,
             num_threads=num_threads,
+            genotypes_path=genotypes_path,
             engine=engine,
             progress_monitor=progress_monitor,
         )
@@ -328,6 +369,7 @@ def match_ancestors(
     recombination_rate=None,
     mismatch_rate=None,
     precision=None,
+    max_matcher_memory=None,
     extended_checks=False,
     engine=constants.C_ENGINE,
     progress_monitor=None,
@@ -349,6 +391,8 @@ def match_ancestors(
         this is <= 0 then a simpler sequential algorithm is used (default).
     :param bool path_compression: Whether to merge edges that share identical
         paths (essentially taking advantage of shared recombination breakpoints).
+    :param int max_matcher_memory: The maximum number of bytes that each match
+        worker may use, or None for no limit (see :func:`infer`; default = None).
     :return: The ancestors tree sequence representing the inferred history
         of the set of ancestors.
     :rtype: tskit.TreeSequence
@@ -362,6 +406,7 @@ def match_ancestors(
         recombination_rate=recombination_rate,
         mismatch_rate=mismatch_rate,
         precision=precision,
+        max_matcher_memory=max_matcher_memory,
         path_compression=path_compression,
         extended_checks=extended_checks,
         engine=engine,
@@ -370,6 +415,114 @@ def match_ancestors(
     return matcher.match_ancestors()
 
 
+def _generate_and_match_ancestors(
+    sample_data,
+    *,
+    num_threads=0,
+    exclude_positions=None,
+    engine=constants.C_ENGINE,
+    progress_monitor=None,
+    max_queued_bytes=2 ** 26,
+    **kwargs,
+):
+    """
+    Generates the ancestors for the specified sample data in a background
+    thread, and matches them as soon as they have been built. Generation uses
+    num_threads build threads as in :func:`generate_ancestors`. At most about
+    max_queued_bytes of built haplotypes are held ahead of the matcher. Other
+    keyword arguments are passed to the :class:`AncestorMatcher` constructor.
+    Returns the ancestors tree sequence.
+    """
+    sample_data._check_finalised()
+    progress_monitor = _get_progress_monitor(progress_monitor)
+    ancestor_data = formats.AncestorData(sample_data)
+    generator = AncestorsGenerator(
+        sample_data,
+        ancestor_data,
+        num_threads=num_threads,
+        engine=engine,
+        progress_monitor=progress_monitor,
+    )
+    generator.add_sites(exclude_positions)
+    # We need to know the times of all ancestors before matching starts.
+    generator._compute_descriptors()
+    # The queue holds lists of ancestors. Epochs and batches vary in size by
+    # orders of magnitude, so rather than limit the number of lists we block
+    # the builder while the queued haplotypes take more than max_queued_bytes.
+    # A list is always accepted when the queue is empty, so that we can't block
+    # on a single large list.
+    ancestor_queue = queue.Queue()
+    queued_bytes = 0
+    queue_space = threading.Condition()
+
+    def put(ancestors):
+        nonlocal queued_bytes
+        num_bytes = 0
+        if ancestors is not None:
+            num_bytes = sum(a.haplotype.nbytes for a in ancestors)
+        with queue_space:
+            while 0 < queued_bytes and queued_bytes + num_bytes > max_queued_bytes:
+                queue_space.wait()
+            queued_bytes += num_bytes
+        ancestor_queue.put((num_bytes, ancestors))
+
+    def get():
+        nonlocal queued_bytes
+        item = ancestor_queue.get()
+        if item is None:
+            # The build thread has failed.
+            return None
+        num_bytes, ancestors = item
+        with queue_space:
+            queued_bytes -= num_bytes
+            queue_space.notify()
+        return ancestors
+
+    def build_worker(thread_index):
+        # We hold back the last ancestors until the ancestor data has been
+        # finalised, so that it is readable when the matcher stores its output.
+        pending = []
+
+        def consumer(ancestors):
+            if len(pending) > 0:
+                put(pending.pop())
+            pending.append(ancestors)
+
+        generator.run(consumer)
+        ancestor_data.record_provenance("generate-ancestors")
+        ancestor_data.finalise()
+        if len(pending) > 0:
+            put(pending.pop())
+        put(None)
+
+    build_thread = []
+
+    def ancestors():
+        # Building starts when the matcher asks for the first ancestor, after
+        # it has finished reading from the ancestor data.
+        build_thread.append(
+            threads.queue_producer_thread(
+                build_worker, ancestor_queue, name="build-worker"
+            )
+        )
+        for batch in iter(get, None):
+            yield from batch
+
+    matcher = AncestorMatcher(
+        sample_data,
+        ancestor_data,
+        ancestors_time=generator.ancestors_time,
+        ancestors=ancestors(),
+        num_threads=num_threads,
+        engine=engine,
+        progress_monitor=progress_monitor,
+        **kwargs,
+    )
+    ancestors_ts = matcher.match_ancestors()
+    build_thread[0].join()
+    return ancestors_ts
+
+
 def augment_ancestors(
     sample_data,
     ancestors_ts,
@@ -380,7 +533,9 @@ def augment_ancestors(
     recombination_rate=None,
     mismatch_rate=None,
     precision=None,
+    max_matcher_memory=None,
     extended_checks=False,
+    match_batch_size=1,
     engine=constants.C_ENGINE,
     progress_monitor=None,
 ):
@@ -418,8 +573,10 @@ def augment_ancestors(
         recombination_rate=recombination_rate,
         mismatch_rate=mismatch_rate,
         precision=precision,
+        max_matcher_memory=max_matcher_memory,
         path_compression=path_compression,
         extended_checks=extended_checks,
+        match_batch_size=match_batch_size,
         engine=engine,
         progress_monitor=progress_monitor,
     )
@@ -442,8 +599,10 @@ def match_samples(
     recombination_rate=None,
     mismatch_rate=None,
     precision=None,
+    max_matcher_memory=None,
     extended_checks=False,
     stabilise_node_ordering=False,
+    match_batch_size=1,
     engine=constants.C_ENGINE,
     progress_monitor=None,
     indexes=None,
@@ -478,6 +637,13 @@ def match_samples(
         adjust the time of "historical samples" (those associated with an individual
         having a non-zero time) such that the sample nodes in the tree sequence
         appear at the time of the individual with which they are associated.
+    :param int match_batch_size: The number of samples that each match worker
+        matches together in a single pass through the trees. Larger batches
+        share the cost of the tree transitions, but each sample in a batch
+        needs its own likelihood arrays, of about 12 bytes per node in the
+        ancestors tree sequence (default = 1).
+    :param int max_matcher_memory: The maximum number of bytes that each match
+        worker may use, or None for no limit (see :func:`infer`; default = None).
 
     :return: The tree sequence representing the inferred history
         of the sample.
@@ -491,8 +657,10 @@ def match_samples(
         recombination_rate=recombination_rate,
         mismatch_rate=mismatch_rate,
         precision=precision,
+        max_matcher_memory=max_matcher_memory,
         path_compression=path_compression,
         extended_checks=extended_checks,
+        match_batch_size=match_batch_size,
         engine=engine,
         progress_monitor=progress_monitor,
     )
@@ -653,16 +821,20 @@ class AncestorsGenerator(object):
         sample_data,
         ancestor_data,
         num_threads=0,
+        genotypes_path=None,
         engine=constants.C_ENGINE,
         progress_monitor=None,
     ):
         self.sample_data = sample_data
         self.ancestor_data = ancestor_data
+        self.genotypes_path = genotypes_path
         self.progress_monitor = progress_monitor
         self.max_sites = sample_data.num_sites
         self.num_sites = 0
         self.num_samples = sample_data.num_samples
         self.num_threads = num_threads
+        self.descriptors = None
+        self.packed_genotypes = None
         if engine == constants.C_ENGINE:
             logger.debug("Using C AncestorBuilder implementation")
             self.ancestor_builder = _tsinfer.AncestorBuilder(
@@ -683,79 +855,182 @@ class AncestorsGenerator(object):
         are held in the specified list of excluded site positions.
         """
         if exclude_positions is None:
-            exclude_positions = set()
+            exclude_positions = np.array([], dtype=np.float64)
         else:
             exclude_positions = np.array(exclude_positions, dtype=np.float64)
             if len(exclude_positions.shape) != 1:
                 raise ValueError("exclude_positions must be a 1D array of numbers")
-        exclude_positions = set(exclude_positions)
-
         logger.info("Starting addition of {} sites".format(self.max_sites))
         progress = self.progress_monitor.get("ga_add_sites", self.max_sites)
-        inference_site_id = []
-        for variant in self.sample_data.variants():
+        position = self.sample_data.sites_position[:]
+        site_time = self.sample_data.sites_time[:]
+        use_site = np.zeros(self.max_sites, dtype=bool)
+        for j, alleles in enumerate(self.sample_data.sites_alleles[:]):
             # If there's missing data the last allele is None
-            num_alleles = len(variant.alleles) - int(variant.alleles[-1] is None)
-            counts = allele_counts(variant.genotypes)
-            use_site = False
-            site = variant.site
-            if site.position not in exclude_positions:
-                if num_alleles == 2:
-                    if counts.derived > 1 and counts.derived < counts.known:
-                        use_site = True
-            if use_site:
-                time = site.time
-                if time == constants.TIME_UNSPECIFIED:
-                    # Non-variable sites have no obvious freq-as-time values
-                    assert counts.known != counts.derived
-                    assert counts.known != counts.ancestral
-                    assert counts.known > 0
-                    # Time = freq of *all* derived alleles. Note that if n_alleles > 2 this
-                    # may not be sensible: https://github.com/tskit-dev/tsinfer/issues/228
-                    time = counts.derived / counts.known
-                self.ancestor_builder.add_site(time, variant.genotypes)
-                inference_site_id.append(site.id)
-                self.num_sites += 1
-            progress.update()
+            num_alleles = len(alleles) - int(alleles[-1] is None)
+            use_site[j] = num_alleles == 2
+        use_site[np.isin(position, exclude_positions)] = False
+
+        # The genotype filtering and frequency-as-time computation is done by the
+        # ancestor builder, one chunk of the genotype matrix at a time.
+        # Note that if n_alleles > 2 frequency may not be a sensible time:
+        # https://github.com/tskit-dev/tsinfer/issues/228
+        inference_site_id = []
+        genotypes = self.sample_data.sites_genotypes
+        chunk_size = genotypes.chunks[0]
+        add_sites = self.ancestor_builder.add_sites
+        if self.genotypes_path is not None:
+            # The ancestor builder refers to the packed genotypes in place, so
+            # we keep a reference to the memory map for its lifetime.
+            self.packed_genotypes = self._open_packed_genotypes()
+            genotypes = self.packed_genotypes
+            add_sites = self.ancestor_builder.add_packed_sites
+        for start in range(0, self.max_sites, chunk_size):
+            end = min(start + chunk_size, self.max_sites)
+            added = add_sites(
+                time=site_time[start:end],
+                genotypes=genotypes[start:end],
+                use_site=use_site[start:end],
+            )
+            site_ids = start + np.where(added)[0]
+            inference_site_id.extend(site_ids)
+            self.num_sites += len(site_ids)
+            progress.update(end - start)
         progress.close()
         self.ancestor_data.set_inference_sites(inference_site_id)
         logger.info("Finished adding sites")
 
-    def _run_synchronous(self, progress):
-        a = np.zeros(self.num_sites, dtype=np.int8)
-        for t, focal_sites in self.descriptors:
-            before = time.perf_counter()
-            start, end = self.ancestor_builder.make_ancestor(focal_sites, a)
-            duration = time.perf_counter() - before
-            logger.debug(
-                "Made ancestor in {:.2f}s at timepoint {} (epoch {}) "
-                "from {} to {} (len={}) with {} focal sites ({})".format(
-                    duration,
-                    t,
-                    self.timepoint_to_epoch[t],
-                    start,
-                    end,
-                    end - start,
-                    focal_sites.shape[0],
-                    focal_sites,
-                )
+    def _open_packed_genotypes(self):
+        """
+        Returns a read-only memory map of the sample genotypes in the format
+        returned by algorithm.pack_genotypes, held in the file at genotypes_path.
+        If this file does not exist, we write it from the sample data first.
+        The first row of the file holds the UUID of the sample data, so that we
+        never use genotypes packed from different sample data.
+        """
+        path = self.genotypes_path
+        shape = (self.max_sites + 1, 2 * ((self.num_samples + 63) // 64))
+        header = np.zeros(shape[1], dtype="<u8")
+        header[:2] = np.frombuffer(uuid.UUID(self.sample_data.uuid).bytes, dtype="<u8")
+        if not os.path.exists(path):
+            logger.info("Writing packed genotypes to {}".format(path))
+            # Write to a temporary file first so that other processes never
+            # see a partially written file.
+            tmp_path = "{}.{}.tmp".format(path, os.getpid())
+            packed = np.lib.format.open_memmap(
+                tmp_path, mode="w+", dtype="<u8", shape=shape
             )
-            self.ancestor_data.add_ancestor(
-                start=start,
-                end=end,
-                time=t,
-                focal_sites=focal_sites,
-                haplotype=a[start:end],
+            packed[0] = header
+            genotypes = self.sample_data.sites_genotypes
+            chunk_size = genotypes.chunks[0]
+            for start in range(0, self.max_sites, chunk_size):
+                end = min(start + chunk_size, self.max_sites)
+                packed[start + 1 : end + 1] = algorithm.pack_genotypes(
+                    genotypes[start:end]
+                )
+            packed.flush()
+            del packed
+            os.replace(tmp_path, path)
+        packed = np.load(path, mmap_mode="r")
+        if (
+            packed.shape != shape
+            or packed.dtype != np.dtype("<u8")
+            or not np.array_equal(packed[0], header)
+        ):
+            raise ValueError(
+                "Packed genotypes file {} does not match the sample data".format(path)
             )
-            progress.update()
+        return packed[1:]
 
-    def _run_threaded(self, progress):
-        # This works by pushing the ancestor descriptors onto the build_queue,
-        # which the worker threads pop off and process. We need to add ancestors
-        # in the the ancestor_data object in the correct order, so we maintain
-        # a priority queue (add_queue) which allows us to track the next smallest
-        # index of the generated ancestor. We add build ancestors to this queue
-        # as they are built, and drain it when we can.
+    def _make_ancestors(self, first, last, haplotypes, start, end):
+        """
+        Makes the ancestors for descriptors first up to at most last - 1 with a
+        single call to the ancestor builder, and returns a list of their
+        (start, end, haplotype) tuples. Each haplotype covers [start, end) and
+        is a view into the haplotypes buffer.
+        """
+        num_made = self.ancestor_builder.make_ancestors(
+            first, last, haplotypes, start, end
+        )
+        ancestors = []
+        offset = 0
+        for s, e in zip(start[:num_made], end[:num_made]):
+            ancestors.append((s, e, haplotypes[offset : offset + e - s]))
+            offset += e - s
+        return ancestors
+
+    def _run_synchronous(self, progress, consumer=None):
+        """
+        Builds the ancestors for all descriptors in order and adds them to the
+        ancestor data. If consumer is not None, it is called with the list of
+        Ancestor objects made by each call to the ancestor builder.
+        """
+        # The haplotype buffer must hold at least num_sites values; we make it
+        # bigger so that short ancestors are built in fewer calls.
+        haplotypes = np.zeros(max(self.num_sites, 2 ** 16), dtype=np.int8)
+        start = np.zeros(self.num_ancestors, dtype=np.int32)
+        end = np.zeros(self.num_ancestors, dtype=np.int32)
+        first = 0
+        while first < self.num_ancestors:
+            t = self.descriptors[first][0]
+            last = first + 1
+            while last < self.num_ancestors and self.descriptors[last][0] == t:
+                last += 1
+            while first < last:
+                before = time.perf_counter()
+                ancestors = self._make_ancestors(first, last, haplotypes, start, end)
+                duration = time.perf_counter() - before
+                logger.debug(
+                    "Made {} ancestors in {:.2f}s".format(len(ancestors), duration)
+                )
+                made = []
+                for j, (s, e, haplotype) in enumerate(ancestors):
+                    _, focal_sites = self.descriptors[first + j]
+                    logger.debug(
+                        "Made ancestor at timepoint {} (epoch {}) "
+                        "from {} to {} (len={}) with {} focal sites ({})".format(
+                            t,
+                            self.timepoint_to_epoch[t],
+                            s,
+                            e,
+                            e - s,
+                            focal_sites.shape[0],
+                            focal_sites,
+                        )
+                    )
+                    ancestor_id = self.ancestor_data.add_ancestor(
+                        start=s,
+                        end=e,
+                        time=t,
+                        focal_sites=focal_sites,
+                        haplotype=haplotype,
+                    )
+                    if consumer is not None:
+                        # The buffer is reused, so we must copy the haplotype.
+                        made.append(
+                            formats.Ancestor(
+                                id=ancestor_id,
+                                start=s,
+                                end=e,
+                                time=t,
+                                focal_sites=focal_sites,
+                                haplotype=haplotype.copy(),
+                            )
+                        )
+                    progress.update()
+                if consumer is not None:
+                    consumer(made)
+                first += len(ancestors)
+
+    def _run_threaded(self, progress, consumer=None):
+        # This works by splitting the ancestor descriptors into contiguous
+        # batches which are pushed onto the build_queue. The worker threads pop
+        # these off and build all the ancestors in a batch with a single call to
+        # make_ancestors, which releases the GIL for the duration. We need to add
+        # ancestors in the ancestor_data object in the correct order, so we
+        # maintain a priority queue (add_queue) of built batches keyed by their
+        # index, and drain it when the next batch is available.
+        batch_size = max(1, min(256, self.num_ancestors // (16 * self.num_threads)))
         queue_depth = 8 * self.num_threads  # Seems like a reasonable limit
         build_queue = queue.Queue(queue_depth)
         add_lock = threading.Lock()
@@ -766,28 +1041,55 @@ class AncestorsGenerator(object):
             nonlocal next_add_index
             num_drained = 0
             while len(add_queue) > 0 and add_queue[0][0] == next_add_index:
-                _, t, focal_sites, s, e, haplotype = heapq.heappop(add_queue)
-                self.ancestor_data.add_ancestor(
-                    start=s, end=e, time=t, focal_sites=focal_sites, haplotype=haplotype
-                )
-                progress.update()
+                _, first, ancestors = heapq.heappop(add_queue)
+                made = []
+                for j, (s, e, haplotype) in enumerate(ancestors):
+                    t, focal_sites = self.descriptors[first + j]
+                    ancestor_id = self.ancestor_data.add_ancestor(
+                        start=s,
+                        end=e,
+                        time=t,
+                        focal_sites=focal_sites,
+                        haplotype=haplotype,
+                    )
+                    if consumer is not None:
+                        made.append(
+                            formats.Ancestor(
+                                id=ancestor_id,
+                                start=s,
+                                end=e,
+                                time=t,
+                                focal_sites=focal_sites,
+                                haplotype=haplotype,
+                            )
+                        )
+                    progress.update()
+                if consumer is not None:
+                    consumer(made)
                 next_add_index += 1
-                num_drained += 1
+                num_drained += len(ancestors)
             logger.debug("Drained {} ancestors from add queue".format(num_drained))
 
         def build_worker(thread_index):
-            a = np.zeros(self.num_sites, dtype=np.int8)
+            # The haplotype buffer must hold at least num_sites values; we make
+            # it bigger so that short ancestors are built in fewer calls.
+            haplotypes = np.zeros(max(self.num_sites, 2 ** 16), dtype=np.int8)
+            start = np.zeros(batch_size, dtype=np.int32)
+            end = np.zeros(batch_size, dtype=np.int32)
             while True:
                 work = build_queue.get()
                 if work is None:
                     break
-                index, t, focal_sites = work
-                start, end = self.ancestor_builder.make_ancestor(focal_sites, a)
-                with add_lock:
-                    haplotype = a[start:end].copy()
-                    heapq.heappush(
-                        add_queue, (index, t, focal_sites, start, end, haplotype)
+                index, first, last = work
+                ancestors = []
+                while first + len(ancestors) < last:
+                    made = self._make_ancestors(
+                        first + len(ancestors), last, haplotypes, start, end
                     )
+                    # The buffer is reused, so we must copy the haplotypes.
+                    ancestors.extend((s, e, h.copy()) for s, e, h in made)
+                with add_lock:
+                    heapq.heappush(add_queue, (index, first, ancestors))
                     drain_add_queue()
                 build_queue.task_done()
             build_queue.task_done()
@@ -800,8 +1102,9 @@ class AncestorsGenerator(object):
         ]
         logger.debug("Started {} build worker threads".format(self.num_threads))
 
-        for index, (t, focal_sites) in enumerate(self.descriptors):
-            build_queue.put((index, t, focal_sites))
+        for index, first in enumerate(range(0, self.num_ancestors, batch_size)):
+            last = min(first + batch_size, self.num_ancestors)
+            build_queue.put((index, first, last))
 
         # Stop the the worker threads.
         for j in range(self.num_threads):
@@ -810,7 +1113,11 @@ class AncestorsGenerator(object):
             build_threads[j].join()
         drain_add_queue()
 
-    def run(self):
+    def _compute_descriptors(self):
+        """
+        Computes the ancestor descriptors once all sites have been added, and
+        the times of all the ancestors that will be stored in the ancestor data.
+        """
         self.descriptors = self.ancestor_builder.ancestor_descriptors()
         self.num_ancestors = len(self.descriptors)
         # Maps epoch numbers to their corresponding ancestor times.
@@ -818,40 +1125,75 @@ class AncestorsGenerator(object):
         for t, _ in reversed(self.descriptors):
             if t not in self.timepoint_to_epoch:
                 self.timepoint_to_epoch[t] = len(self.timepoint_to_epoch) + 1
+        self.ancestors_time = np.zeros(0)
         if self.num_ancestors > 0:
-            logger.info("Starting build for {} ancestors".format(self.num_ancestors))
-            progress = self.progress_monitor.get("ga_generate", self.num_ancestors)
-            a = np.zeros(self.num_sites, dtype=np.int8)
-            root_time = max(self.timepoint_to_epoch.keys()) + 1
-            ultimate_ancestor_time = root_time + 1
-            # Add the ultimate ancestor. This is an awkward hack really; we don't
-            # ever insert this ancestor. The only reason to add it here is that
-            # it makes sure that the ancestor IDs we have in the ancestor file are
-            # the same as in the ancestor tree sequence. This seems worthwhile.
-            self.ancestor_data.add_ancestor(
-                start=0,
-                end=self.num_sites,
-                time=ultimate_ancestor_time,
-                focal_sites=[],
-                haplotype=a,
+            self.root_time = max(self.timepoint_to_epoch.keys()) + 1
+            self.ancestors_time = np.array(
+                [self.root_time + 1, self.root_time] + [t for t, _ in self.descriptors]
             )
-            # Hack to ensure we always have a root with zeros at every position.
-            self.ancestor_data.add_ancestor(
+
+    def _add_root_ancestors(self):
+        """
+        Adds the ultimate ancestor and the root ancestor to the ancestor data,
+        and returns them as a list of Ancestor objects.
+        """
+        a = np.zeros(self.num_sites, dtype=np.int8)
+        ultimate_ancestor_time = self.root_time + 1
+        ret = []
+        # Add the ultimate ancestor. This is an awkward hack really; we don't
+        # ever insert this ancestor. The only reason to add it here is that
+        # it makes sure that the ancestor IDs we have in the ancestor file are
+        # the same as in the ancestor tree sequence. This seems worthwhile.
+        # We also add a root with zeros at every position.
+        for t in [ultimate_ancestor_time, self.root_time]:
+            focal_sites = np.array([], dtype=np.int32)
+            ancestor_id = self.ancestor_data.add_ancestor(
                 start=0,
                 end=self.num_sites,
-                time=root_time,
-                focal_sites=np.array([], dtype=np.int32),
+                time=t,
+                focal_sites=focal_sites,
                 haplotype=a,
             )
+            ret.append(
+                formats.Ancestor(
+                    id=ancestor_id,
+                    start=0,
+                    end=self.num_sites,
+                    time=t,
+                    focal_sites=focal_sites,
+                    haplotype=a,
+                )
+            )
+        return ret
+
+    def run(self, consumer=None):
+        """
+        Builds the ancestors and adds them to the ancestor data. All sites must
+        have been added before calling this method. If consumer is not None, it
+        is called with lists of the Ancestor objects in the order that they are
+        added, so that they can be used before all ancestors have been built.
+        """
+        if self.descriptors is None:
+            self._compute_descriptors()
+        if self.num_ancestors > 0:
+            logger.info("Starting build for {} ancestors".format(self.num_ancestors))
+            progress = self.progress_monitor.get("ga_generate", self.num_ancestors)
+            roots = self._add_root_ancestors()
+            if consumer is not None:
+                consumer(roots)
             if self.num_threads <= 0:
-                self._run_synchronous(progress)
+                self._run_synchronous(progress, consumer)
             else:
-                self._run_threaded(progress)
+                self._run_threaded(progress, consumer)
             progress.close()
             logger.info("Finished building ancestors")
 
 
 class Matcher(object):
+    # Whether the tree sequence builder relabels the nodes for better memory
+    # locality in the matchers when the indexes are frozen.
+    relabel_nodes = False
+
     def __init__(
         self,
         sample_data,
@@ -861,6 +1203,7 @@ class Matcher(object):
         recombination_rate=None,
         mismatch_rate=None,
         precision=None,
+        max_matcher_memory=None,
         extended_checks=False,
         engine=constants.C_ENGINE,
         progress_monitor=None,
@@ -898,6 +1241,17 @@ class Matcher(object):
         self.mismatch_rate[:] = mismatch_rate
         self.precision = precision
 
+        # With a memory limit, the matchers store the traceback in checkpointed
+        # segments if it wouldn't fit otherwise.
+        self.max_matcher_memory = max_matcher_memory
+        matcher_kwargs = {}
+        if max_matcher_memory is not None:
+            if max_matcher_memory <= 0:
+                raise ValueError("max_matcher_memory must be > 0")
+            matcher_kwargs = dict(
+                max_memory=int(max_matcher_memory), checkpoint_traceback=True
+            )
+
         if engine == constants.C_ENGINE:
             logger.debug("Using C matcher implementation")
             self.tree_sequence_builder_class = _tsinfer.TreeSequenceBuilder
@@ -925,7 +1279,10 @@ class Matcher(object):
         max_edges = 64 * 1024
         max_nodes = 64 * 1024
         self.tree_sequence_builder = self.tree_sequence_builder_class(
-            num_alleles=num_alleles, max_nodes=max_nodes, max_edges=max_edges
+            num_alleles=num_alleles,
+            max_nodes=max_nodes,
+            max_edges=max_edges,
+            relabel_nodes=self.relabel_nodes,
         )
         logger.debug(
             "Allocated tree sequence builder with max_nodes={}".format(max_nodes)
@@ -947,6 +1304,7 @@ class Matcher(object):
                 mismatch_rate=self.mismatch_rate,
                 precision=precision,
                 extended_checks=self.extended_checks,
+                **matcher_kwargs,
             )
             for _ in range(num_threads)
         ]
@@ -958,16 +1316,8 @@ class Matcher(object):
         """
         matcher = self.matcher[thread_index]
         match = self.match[thread_index]
-        missing = haplotype == tskit.MISSING_DATA
-
         left, right, parent = matcher.find_path(haplotype, start, end, match)
-        self.results.set_path(child_id, left, right, parent)
-        match[missing] = tskit.MISSING_DATA
-        diffs = start + np.where(haplotype[start:end] != match[start:end])[0]
-        derived_state = haplotype[diffs]
-        self.results.set_mutations(child_id, diffs.astype(np.int32), derived_state)
-
-        self.match_progress.update()
+        self._set_result(child_id, haplotype, match, start, end, left, right, parent)
         self.mean_traceback_size[thread_index] += matcher.mean_traceback_size
         self.num_matches[thread_index] += 1
         logger.debug(
@@ -979,6 +1329,47 @@ class Matcher(object):
             )
         )
 
+    def _find_paths(self, child_ids, haplotypes, start, end, thread_index=0):
+        """
+        Finds the paths of a batch of haplotypes over the same [start, end)
+        interval in a single pass through the trees, and updates the results
+        for the specified thread_index.
+        """
+        matcher = self.matcher[thread_index]
+        haplotypes = np.array(haplotypes, dtype=np.int8)
+        match = np.full(haplotypes.shape, tskit.MISSING_DATA, np.int8)
+        paths = matcher.find_paths(haplotypes, start, end, match)
+        for child_id, haplotype, h_match, (left, right, parent) in zip(
+            child_ids, haplotypes, match, paths
+        ):
+            self._set_result(
+                child_id, haplotype, h_match, start, end, left, right, parent
+            )
+        self.mean_traceback_size[thread_index] += matcher.mean_traceback_size * len(
+            paths
+        )
+        self.num_matches[thread_index] += len(paths)
+        logger.debug(
+            "matched {} nodes; tb_size={:.2f} match_mem={}".format(
+                len(paths),
+                matcher.mean_traceback_size,
+                humanize.naturalsize(matcher.total_memory, binary=True),
+            )
+        )
+
+    def _set_result(self, child_id, haplotype, match, start, end, left, right, parent):
+        """
+        Records the path and mutations for the specified child from the output
+        of the matcher.
+        """
+        missing = haplotype == tskit.MISSING_DATA
+        self.results.set_path(child_id, left, right, parent)
+        match[missing] = tskit.MISSING_DATA
+        diffs = start + np.where(haplotype[start:end] != match[start:end])[0]
+        derived_state = haplotype[diffs]
+        self.results.set_mutations(child_id, diffs.astype(np.int32), derived_state)
+        self.match_progress.update()
+
     def convert_inference_mutations(self, tables):
         """
         Convert the mutations stored in the tree sequence builder into the output
@@ -1009,17 +1400,25 @@ class Matcher(object):
 
 
 class AncestorMatcher(Matcher):
-    def __init__(self, sample_data, ancestor_data, **kwargs):
+    def __init__(
+        self, sample_data, ancestor_data, ancestors_time=None, ancestors=None, **kwargs
+    ):
         super().__init__(sample_data, ancestor_data.sites_position[:], **kwargs)
         self.ancestor_data = ancestor_data
-        self.num_ancestors = self.ancestor_data.num_ancestors
-        self.epoch = self.ancestor_data.ancestors_time[:]
+        # The ancestor times and an iterator over the ancestors can be supplied
+        # directly, so that we can match ancestors while they are being built.
+        if ancestors_time is None:
+            ancestors_time = self.ancestor_data.ancestors_time[:]
+        if ancestors is None:
+            ancestors = self.ancestor_data.ancestors()
+        self.num_ancestors = len(ancestors_time)
+        self.epoch = ancestors_time
 
         # Add nodes for all the ancestors so that the ancestor IDs are equal
         # to the node IDs.
         for ancestor_id in range(self.num_ancestors):
             self.tree_sequence_builder.add_node(self.epoch[ancestor_id])
-        self.ancestors = self.ancestor_data.ancestors()
+        self.ancestors = iter(ancestors)
         # Consume the first ancestor.
         a = next(self.ancestors, None)
         self.num_epochs = 0
@@ -1233,7 +1632,15 @@ class AncestorMatcher(Matcher):
 
 
 class SampleMatcher(Matcher):
-    def __init__(self, sample_data, ancestors_ts, **kwargs):
+    # The indexes are only frozen once, so relabelling is cheap here and the
+    # trees are at their largest.
+    relabel_nodes = True
+
+    def __init__(self, sample_data, ancestors_ts, match_batch_size=1, **kwargs):
+        if match_batch_size < 1:
+            raise ValueError("match_batch_size must be >= 1")
+        # The number of samples that we match in a single pass through the trees.
+        self.match_batch_size = match_batch_size
         self.ancestors_ts_tables = ancestors_ts.dump_tables()
         super().__init__(sample_data, self.ancestors_ts_tables.sites.position, **kwargs)
         self.restore_tree_sequence_builder()
@@ -1298,16 +1705,49 @@ class SampleMatcher(Matcher):
             )
         )
 
-    def __process_sample(self, sample_id, haplotype, thread_index=0):
-        self._find_path(sample_id, haplotype, 0, self.num_sites, thread_index)
+    def __process_samples(self, sample_ids, haplotypes, thread_index=0):
+        self._find_paths(sample_ids, haplotypes, 0, self.num_sites, thread_index)
 
-    def __match_samples_single_threaded(self, indexes):
+    def __batch_size(self):
+        """
+        Returns the number of samples to match together. Each sample in a batch
+        has its own matching state, so with a memory limit we only match as
+        many together as fit in half of it.
+        """
+        batch_size = self.match_batch_size
+        haplotype_memory = self.matcher[0].haplotype_memory
+        if self.max_matcher_memory is not None and haplotype_memory > 0:
+            batch_size = min(
+                batch_size, int(self.max_matcher_memory) // (2 * haplotype_memory)
+            )
+        return max(1, batch_size)
+
+    def __sample_batches(self, indexes):
+        """
+        Returns an iterator over batches of (sample_ids, haplotypes) of up to
+        match_batch_size samples, which are matched together.
+        """
+        batch_size = self.__batch_size()
+        logger.debug("Matching samples in batches of {}".format(batch_size))
         sample_haplotypes = self.sample_data.haplotypes(
             indexes, sites=self.inference_site_id
         )
+        sample_ids = []
+        haplotypes = []
         for j, a in sample_haplotypes:
             assert len(a) == self.num_sites
-            self.__process_sample(self.sample_id_map[j], a)
+            sample_ids.append(self.sample_id_map[j])
+            haplotypes.append(a)
+            if len(sample_ids) == batch_size:
+                yield sample_ids, haplotypes
+                sample_ids = []
+                haplotypes = []
+        if len(sample_ids) > 0:
+            yield sample_ids, haplotypes
+
+    def __match_samples_single_threaded(self, indexes):
+        for sample_ids, haplotypes in self.__sample_batches(indexes):
+            self.__process_samples(sample_ids, haplotypes)
 
     def __match_samples_multi_threaded(self, indexes):
         # Note that this function is not almost identical to the match_ancestors
@@ -1323,8 +1763,8 @@ class SampleMatcher(Matcher):
                 work = match_queue.get()
                 if work is None:
                     break
-                sample_id, a = work
-                self.__process_sample(sample_id, a, thread_index)
+                sample_ids, haplotypes = work
+                self.__process_samples(sample_ids, haplotypes, thread_index)
                 match_queue.task_done()
             match_queue.task_done()
 
@@ -1336,11 +1776,8 @@ class SampleMatcher(Matcher):
         ]
         logger.debug("Started {} match worker threads".format(self.num_threads))
 
-        sample_haplotypes = self.sample_data.haplotypes(
-            indexes, sites=self.inference_site_id
-        )
-        for j, a in sample_haplotypes:
-            match_queue.put((self.sample_id_map[j], a))
+        for batch in self.__sample_batches(indexes):
+            match_queue.put(batch)
 
         # Stop the the worker threads.
         for j in range(self.num_threads):